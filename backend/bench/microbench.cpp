@@ -0,0 +1,692 @@
+// Microbenchmarks for the server's hot primitives.
+//
+//   tws_microbench [-f filter] [-s scale] [-r repeats] [-c corpus]... [-l log_file]
+//                  [-b baseline] [-t tolerance_pct]
+//
+// Every benchmark prints one JSON object per line:
+//
+//   {"name":"http_parse_request/browser","iterations":200000,"ns_per_op":412.3,"ops_per_sec":2425316}
+//
+// plus p50_ns/p99_ns where a per-operation latency is measured. Each one
+// runs `repeats` times and reports the fastest run. -f keeps benchmarks
+// whose name contains the filter; -s scales all iteration counts.
+//
+// Request corpora: three built-in ones (browser, api_login, minimal), and
+// each -c file adds one named after the file: raw HTTP requests back to
+// back, bodies sized by Content-Length. The parse benchmarks copy the
+// request into the read buffer on every iteration, as recv() would.
+//
+// With -b, results are compared with a previous run's output and the exit
+// status is 1 if any benchmark got slower than the tolerance (default 10%).
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "core/http/http_conn.h"
+#include "utils/block_queue/block_queue.h"
+#include "utils/log/log.h"
+#include "utils/threadpool/threadpool.h"
+#include "utils/timer/lst_timer.h"
+
+namespace {
+
+struct Options {
+    std::string filter;
+    double scale = 1;
+    int repeats = 3;
+    std::vector<std::string> corpus_files;
+    std::string log_file = "/tmp/tws_microbench.log";
+    std::string baseline;
+    double tolerance = 10;
+};
+
+struct Result {
+    std::string name;
+    long iterations;
+    double ns_per_op;
+    double p50_ns;
+    double p99_ns;
+};
+
+struct Corpus {
+    std::string name;
+    std::vector<std::string> requests;
+};
+
+Options g_options;
+std::vector<Result> g_results;
+
+int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Keeps the compiler from dropping work whose result is unused
+template <class T>
+void consume(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+bool selected(const std::string& name) {
+    return g_options.filter.empty() || name.find(g_options.filter) != std::string::npos;
+}
+
+long scaled(long iterations) {
+    return std::max(1L, (long)(iterations * g_options.scale));
+}
+
+void report(const Result& result) {
+    printf("{\"name\":\"%s\",\"iterations\":%ld,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f",
+           result.name.c_str(), result.iterations, result.ns_per_op,
+           result.ns_per_op > 0 ? 1e9 / result.ns_per_op : 0);
+    if (result.p50_ns > 0) {
+        printf(",\"p50_ns\":%.0f,\"p99_ns\":%.0f", result.p50_ns, result.p99_ns);
+    }
+    printf("}\n");
+    fflush(stdout);
+    g_results.push_back(result);
+}
+
+// Times `body(iterations)` (which runs the operation that many times)
+// and reports the best of the repeats
+template <class Body>
+void run(const std::string& name, long iterations, Body body) {
+    if (!selected(name)) {
+        return;
+    }
+    iterations = scaled(iterations);
+    double best = 0;
+    for (int r = 0; r < g_options.repeats; ++r) {
+        int64_t start = now_ns();
+        body(iterations);
+        double ns = (double)(now_ns() - start) / iterations;
+        if (r == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    report(Result{name, iterations, best, 0, 0});
+}
+
+// ---- HTTP parsing and response assembly ----
+
+const char BROWSER_REQUEST[] =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:9000\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,"
+    "image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: theme=dark; session=3f9a1c0e5b7d4e2a8c6f0b1d3e5a7c9f\r\n"
+    "\r\n";
+
+const char API_LOGIN_REQUEST[] =
+    "POST /api/login HTTP/1.1\r\n"
+    "Host: localhost:9000\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 44\r\n"
+    "\r\n"
+    "{\"username\":\"bench1\",\"password\":\"benchpass\"}";
+
+const char MINIMAL_REQUEST[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9000\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+// Splits back-to-back requests, using Content-Length for bodies
+bool load_corpus(const std::string& path, Corpus* corpus) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    std::string data = ss.str();
+    size_t slash = path.rfind('/');
+    corpus->name = slash == std::string::npos ? path : path.substr(slash + 1);
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t end = data.find("\r\n\r\n", pos);
+        if (end == std::string::npos) {
+            break;
+        }
+        long body = 0;
+        for (size_t line = data.find("\r\n", pos); line < end; line = data.find("\r\n", line + 2)) {
+            if (strncasecmp(data.c_str() + line + 2, "Content-Length:", 15) == 0) {
+                body = atol(data.c_str() + line + 17);
+            }
+        }
+        size_t len = end + 4 + body - pos;
+        if (len < (size_t)HttpConn::READ_BUFFER_SIZE) {
+            corpus->requests.push_back(data.substr(pos, len));
+        }
+        pos += len;
+    }
+    return !corpus->requests.empty();
+}
+
+} // namespace
+
+// Friend of HttpConn: drives the parser and response assembly directly,
+// without sockets, epoll or request handlers
+class HttpConnBench {
+public:
+    // process_read() up to the point where it would call do_request()
+    static HttpConn::HTTP_CODE parse(HttpConn& c, const std::string& request) {
+        c.init();
+        load(c, request);
+        HttpConn::LINE_STATUS line_status = HttpConn::LINE_OK;
+        HttpConn::HTTP_CODE ret = HttpConn::NO_REQUEST;
+        while ((c.m_check_state == HttpConn::CHECK_STATE_CONTENT && line_status == HttpConn::LINE_OK) ||
+               (line_status = c.parse_line()) == HttpConn::LINE_OK) {
+            char* text = c.get_line();
+            c.m_start_line = c.m_checked_idx;
+            switch (c.m_check_state) {
+                case HttpConn::CHECK_STATE_REQUESTLINE:
+                    ret = c.parse_request_line(text);
+                    if (ret == HttpConn::BAD_REQUEST) {
+                        return ret;
+                    }
+                    break;
+                case HttpConn::CHECK_STATE_HEADER:
+                    ret = c.parse_headers(text);
+                    if (ret != HttpConn::NO_REQUEST) {
+                        return ret;
+                    }
+                    break;
+                default:
+                    ret = c.parse_content(text);
+                    if (ret == HttpConn::GET_REQUEST) {
+                        return ret;
+                    }
+                    line_status = HttpConn::LINE_OPEN;
+                    break;
+            }
+        }
+        return HttpConn::NO_REQUEST;
+    }
+
+    // Only the line splitter, over the whole request
+    static int split_lines(HttpConn& c, const std::string& request) {
+        load(c, request);
+        c.m_checked_idx = 0;
+        int lines = 0;
+        while (c.parse_line() == HttpConn::LINE_OK) {
+            ++lines;
+        }
+        return lines;
+    }
+
+    static HttpConn::HTTP_CODE request_line(HttpConn& c, const std::string& line) {
+        memcpy(c.m_read_buf, line.c_str(), line.size() + 1);
+        c.m_check_state = HttpConn::CHECK_STATE_REQUESTLINE;
+        return c.parse_request_line(c.m_read_buf);
+    }
+
+    // Header lines only, without the request line and the blank line
+    static int headers(HttpConn& c, const std::vector<std::string>& lines) {
+        c.m_check_state = HttpConn::CHECK_STATE_HEADER;
+        c.m_content_length = 0;
+        c.m_session_token = 0;
+        int offset = 0;
+        for (const std::string& line : lines) {
+            memcpy(c.m_read_buf + offset, line.c_str(), line.size() + 1);
+            c.parse_headers(c.m_read_buf + offset);
+            offset += (int)line.size() + 1;
+        }
+        return (int)c.m_content_length;
+    }
+
+    // Status line and headers of a 200 response, as process_write builds them
+    static int response_headers(HttpConn& c, int content_length) {
+        c.m_write_idx = 0;
+        c.m_linger = true;
+        c.add_status_line(200, "OK");
+        c.add_headers(content_length);
+        return c.m_write_idx;
+    }
+
+    static void init(HttpConn& c) {
+        c.init();
+    }
+
+private:
+    static void load(HttpConn& c, const std::string& request) {
+        memcpy(c.m_read_buf, request.data(), request.size());
+        c.m_read_buf[request.size()] = '\0';
+        c.m_read_idx = (int)request.size();
+    }
+};
+
+namespace {
+
+std::vector<std::string> split_crlf(const std::string& request) {
+    std::vector<std::string> lines;
+    size_t pos = 0;
+    while (true) {
+        size_t end = request.find("\r\n", pos);
+        if (end == std::string::npos || end == pos) {
+            break;
+        }
+        lines.push_back(request.substr(pos, end - pos));
+        pos = end + 2;
+    }
+    return lines;
+}
+
+void bench_http(const std::vector<Corpus>& corpora) {
+    HttpConn* conn = new HttpConn();
+    HttpConnBench::init(*conn);
+
+    run("http_conn_init", 200000, [&](long n) {
+        for (long i = 0; i < n; ++i) {
+            HttpConnBench::init(*conn);
+        }
+    });
+
+    for (const Corpus& corpus : corpora) {
+        const std::vector<std::string>& requests = corpus.requests;
+        size_t count = requests.size();
+
+        run("http_parse_line/" + corpus.name, 200000, [&](long n) {
+            int lines = 0;
+            for (long i = 0; i < n; ++i) {
+                lines += HttpConnBench::split_lines(*conn, requests[i % count]);
+            }
+            consume(lines);
+        });
+
+        std::vector<std::string> request_lines;
+        std::vector<std::vector<std::string>> header_lines;
+        for (const std::string& request : requests) {
+            std::vector<std::string> lines = split_crlf(request);
+            request_lines.push_back(lines.empty() ? "" : lines[0]);
+            header_lines.push_back(std::vector<std::string>(lines.begin() + (lines.empty() ? 0 : 1), lines.end()));
+        }
+
+        run("http_parse_request_line/" + corpus.name, 1000000, [&](long n) {
+            int bad = 0;
+            for (long i = 0; i < n; ++i) {
+                bad += HttpConnBench::request_line(*conn, request_lines[i % count]) == HttpConn::BAD_REQUEST;
+            }
+            consume(bad);
+        });
+
+        run("http_parse_headers/" + corpus.name, 500000, [&](long n) {
+            int total = 0;
+            for (long i = 0; i < n; ++i) {
+                total += HttpConnBench::headers(*conn, header_lines[i % count]);
+            }
+            consume(total);
+        });
+
+        run("http_parse_request/" + corpus.name, 200000, [&](long n) {
+            int complete = 0;
+            for (long i = 0; i < n; ++i) {
+                complete += HttpConnBench::parse(*conn, requests[i % count]) == HttpConn::GET_REQUEST;
+            }
+            consume(complete);
+        });
+    }
+
+    run("http_response_headers", 1000000, [&](long n) {
+        int bytes = 0;
+        for (long i = 0; i < n; ++i) {
+            bytes += HttpConnBench::response_headers(*conn, 1000 + (int)(i & 1023));
+        }
+        consume(bytes);
+    });
+
+    delete conn;
+}
+
+// ---- Timer list ----
+
+void noop_timer(ClientData*) {
+}
+
+struct TimerSet {
+    std::vector<UtilTimer*> timers;
+    std::vector<ClientData> data;
+
+    TimerSet(long n, time_t base, unsigned seed) : timers(n), data(n) {
+        for (long i = 0; i < n; ++i) {
+            timers[i] = new UtilTimer();
+            timers[i]->cb_func = noop_timer;
+            timers[i]->user_data = &data[i];
+            data[i].sockfd = (int)i;
+            data[i].timer = timers[i];
+            seed = seed * 1103515245 + 12345;
+            timers[i]->expire = base + (seed >> 8) % 1000;
+        }
+    }
+};
+
+void bench_timers() {
+    static const long SIZES[] = {1000, 10000};
+    for (long size : SIZES) {
+        long n = scaled(size);
+        std::string suffix = "/" + std::to_string(n);
+        // The list is sorted and singly scanned, so adds and adjusts are O(n)
+        if (selected("timer_add" + suffix)) {
+            double best = 0;
+            for (int r = 0; r < g_options.repeats; ++r) {
+                TimerSet set(n, time(nullptr) + 100000, 1);
+                SortTimerLst list;
+                int64_t start = now_ns();
+                for (UtilTimer* timer : set.timers) {
+                    list.add_timer(timer);
+                }
+                double ns = (double)(now_ns() - start) / n;
+                best = r == 0 ? ns : std::min(best, ns);
+            }
+            report(Result{"timer_add" + suffix, n, best, 0, 0});
+        }
+
+        if (selected("timer_adjust" + suffix)) {
+            double best = 0;
+            for (int r = 0; r < g_options.repeats; ++r) {
+                time_t base = time(nullptr) + 100000;
+                TimerSet set(n, base, 2);
+                SortTimerLst list;
+                for (UtilTimer* timer : set.timers) {
+                    list.add_timer(timer);
+                }
+                // Like a connection seeing activity: its timer moves to the back
+                int64_t start = now_ns();
+                for (long i = 0; i < n; ++i) {
+                    UtilTimer* timer = set.timers[(i * 7919) % n];
+                    timer->expire = base + 1000 + i;
+                    list.adjust_timer(timer);
+                }
+                double ns = (double)(now_ns() - start) / n;
+                best = r == 0 ? ns : std::min(best, ns);
+            }
+            report(Result{"timer_adjust" + suffix, n, best, 0, 0});
+        }
+
+        if (selected("timer_tick" + suffix)) {
+            double best = 0;
+            for (int r = 0; r < g_options.repeats; ++r) {
+                // Every timer already expired, one tick removes them all
+                TimerSet set(n, time(nullptr) - 2000, 3);
+                SortTimerLst list;
+                for (UtilTimer* timer : set.timers) {
+                    list.add_timer(timer);
+                }
+                int64_t start = now_ns();
+                list.tick();
+                double ns = (double)(now_ns() - start) / n;
+                best = r == 0 ? ns : std::min(best, ns);
+            }
+            report(Result{"timer_tick" + suffix, n, best, 0, 0});
+        }
+    }
+}
+
+// ---- BlockQueue ----
+
+struct QueueState {
+    BlockQueue<long> queue;
+    long per_thread;
+    std::atomic<bool> go{false};
+    std::atomic<long long> sum{0};
+
+    QueueState(int capacity, long per) : queue(capacity), per_thread(per) {}
+};
+
+void* queue_producer(void* arg) {
+    QueueState* state = static_cast<QueueState*>(arg);
+    while (!state->go.load(std::memory_order_acquire)) {
+    }
+    for (long i = 0; i < state->per_thread; ++i) {
+        while (!state->queue.push(i)) {
+            sched_yield();
+        }
+    }
+    return nullptr;
+}
+
+void* queue_consumer(void* arg) {
+    QueueState* state = static_cast<QueueState*>(arg);
+    while (!state->go.load(std::memory_order_acquire)) {
+    }
+    long long sum = 0;
+    long item = 0;
+    for (long i = 0; i < state->per_thread; ++i) {
+        state->queue.pop(item);
+        sum += item;
+    }
+    state->sum += sum;
+    return nullptr;
+}
+
+void bench_block_queue() {
+    static const int THREADS[] = {1, 4};
+    for (int threads : THREADS) {
+        std::string name = "block_queue_push_pop/" + std::to_string(threads) + "x" + std::to_string(threads);
+        run(name, 1000000, [&](long n) {
+            QueueState state(1024, n / threads);
+            std::vector<pthread_t> ids(threads * 2);
+            for (int i = 0; i < threads; ++i) {
+                pthread_create(&ids[i], nullptr, queue_producer, &state);
+                pthread_create(&ids[threads + i], nullptr, queue_consumer, &state);
+            }
+            state.go.store(true, std::memory_order_release);
+            for (pthread_t id : ids) {
+                pthread_join(id, nullptr);
+            }
+            consume(state.sum.load());
+        });
+    }
+}
+
+// ---- threadpool ----
+
+// Stand-in for HttpConn with the members threadpool<T> touches
+struct PoolTask {
+    int m_state = 0;
+    int improv = 0;
+    int timer_flag = 0;
+    int64_t posted_ns = 0;
+    std::atomic<int64_t> ran_ns{0};
+
+    void process() { ran_ns.store(now_ns(), std::memory_order_release); }
+    bool read_once() { return true; }
+    bool write() { return true; }
+};
+
+void bench_threadpool() {
+    std::string name = "threadpool_dispatch";
+    if (!selected(name)) {
+        return;
+    }
+    static threadpool<PoolTask>* pool = new threadpool<PoolTask>(0, nullptr, 4, 10000);
+    long n = scaled(20000);
+    PoolTask task;
+    std::vector<int64_t> latencies;
+    double best = 0;
+    for (int r = 0; r < g_options.repeats; ++r) {
+        std::vector<int64_t> run_latencies(n);
+        for (long i = 0; i < n; ++i) {
+            task.ran_ns.store(0, std::memory_order_relaxed);
+            task.posted_ns = now_ns();
+            pool->append_p(&task);
+            int64_t ran;
+            while ((ran = task.ran_ns.load(std::memory_order_acquire)) == 0) {
+            }
+            run_latencies[i] = ran - task.posted_ns;
+        }
+        double mean = 0;
+        for (int64_t l : run_latencies) {
+            mean += l;
+        }
+        mean /= n;
+        if (r == 0 || mean < best) {
+            best = mean;
+            latencies.swap(run_latencies);
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+    report(Result{name, n, best, (double)latencies[n / 2], (double)latencies[(size_t)(n * 0.99)]});
+}
+
+// ---- Log ----
+
+void bench_log() {
+    bool any = selected("log_write_async") || selected("log_write_filtered");
+    if (!any) {
+        return;
+    }
+    Log* log = Log::get_instance();
+    if (!log->init(g_options.log_file.c_str(), 0, 8192, 5000000, 8192)) {
+        fprintf(stderr, "cannot open log file %s, skipping log benchmarks\n", g_options.log_file.c_str());
+        return;
+    }
+    log->set_level(Log::Level::INFO);
+    std::string user = "bench_user";
+
+    // Producer side of the async logger: records the arguments, formatting
+    // happens on the writer thread
+    run("log_write_async", 1000000, [&](long n) {
+        for (long i = 0; i < n; ++i) {
+            log->write_log(Log::Level::INFO, "request %ld from %s took %d us", i, user.c_str(), (int)(i & 4095));
+        }
+        log->flush();
+    });
+
+    // A call site below the configured level, as the LOG_* macros see it
+    run("log_write_filtered", 10000000, [&](long n) {
+        int enabled = 0;
+        for (long i = 0; i < n; ++i) {
+            enabled += log->is_enabled(Log::Level::DEBUG);
+        }
+        consume(enabled);
+    });
+}
+
+// ---- Baseline comparison ----
+
+// Reads name and ns_per_op from a previous run's output
+std::map<std::string, double> read_baseline(const std::string& path) {
+    std::map<std::string, double> baseline;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t name = line.find("\"name\":\"");
+        size_t ns = line.find("\"ns_per_op\":");
+        if (name == std::string::npos || ns == std::string::npos) {
+            continue;
+        }
+        name += 8;
+        size_t end = line.find('"', name);
+        baseline[line.substr(name, end - name)] = atof(line.c_str() + ns + 12);
+    }
+    return baseline;
+}
+
+int compare_baseline() {
+    std::map<std::string, double> baseline = read_baseline(g_options.baseline);
+    if (baseline.empty()) {
+        fprintf(stderr, "no results in baseline %s\n", g_options.baseline.c_str());
+        return 1;
+    }
+    int regressions = 0;
+    for (const Result& result : g_results) {
+        auto it = baseline.find(result.name);
+        if (it == baseline.end() || it->second <= 0) {
+            continue;
+        }
+        double change = (result.ns_per_op / it->second - 1) * 100;
+        if (change > g_options.tolerance) {
+            fprintf(stderr, "REGRESSION %s: %.1f ns/op -> %.1f ns/op (+%.1f%%)\n", result.name.c_str(),
+                    it->second, result.ns_per_op, change);
+            ++regressions;
+        }
+    }
+    if (regressions == 0) {
+        fprintf(stderr, "no regressions beyond %.0f%% against %s\n", g_options.tolerance,
+                g_options.baseline.c_str());
+    }
+    return regressions > 0 ? 1 : 0;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-f filter] [-s scale] [-r repeats] [-c corpus]... [-l log_file]\n"
+            "          [-b baseline] [-t tolerance_pct]\n",
+            prog);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "f:s:r:c:l:b:t:")) != -1) {
+        switch (opt) {
+            case 'f': g_options.filter = optarg; break;
+            case 's': g_options.scale = atof(optarg); break;
+            case 'r': g_options.repeats = atoi(optarg); break;
+            case 'c': g_options.corpus_files.push_back(optarg); break;
+            case 'l': g_options.log_file = optarg; break;
+            case 'b': g_options.baseline = optarg; break;
+            case 't': g_options.tolerance = atof(optarg); break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (g_options.scale <= 0 || g_options.repeats <= 0 || g_options.tolerance < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<Corpus> corpora = {
+        {"browser", {BROWSER_REQUEST}},
+        {"api_login", {API_LOGIN_REQUEST}},
+        {"minimal", {MINIMAL_REQUEST}},
+    };
+    for (const std::string& file : g_options.corpus_files) {
+        Corpus corpus;
+        if (!load_corpus(file, &corpus)) {
+            fprintf(stderr, "%s: no requests found\n", file.c_str());
+            return 2;
+        }
+        corpora.push_back(corpus);
+    }
+
+    bench_http(corpora);
+    bench_timers();
+    bench_block_queue();
+    bench_threadpool();
+    bench_log();
+
+    return g_options.baseline.empty() ? 0 : compare_baseline();
+}
@@ -0,0 +1,161 @@
+// Producer/consumer throughput of BlockQueue<T> against LockFreeQueue<T>.
+//
+//   queue_bench [-p producers] [-c consumers] [-n items] [-q capacity] [-b batch]
+//
+// Producers retry (yielding) when the queue is full, consumers use the
+// blocking pop (or pop_batch when -b > 1). Each line reports wall time,
+// throughput and how often producers found the queue full.
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <vector>
+
+#include "utils/block_queue/block_queue.h"
+#include "utils/block_queue/lockfree_queue.h"
+
+struct BenchConfig {
+    int producers = 4;
+    int consumers = 4;
+    long items = 4000000;
+    int capacity = 1024;
+    int batch = 1;
+};
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <class Queue>
+struct BenchState {
+    Queue queue;
+    BenchConfig config;
+    std::atomic<bool> go{false};
+    std::atomic<long> full_retries{0};
+    std::atomic<long long> checksum{0};
+
+    BenchState(const BenchConfig& cfg) : queue(cfg.capacity), config(cfg) {}
+};
+
+template <class Queue>
+static void* produce(void* arg) {
+    BenchState<Queue>* state = static_cast<BenchState<Queue>*>(arg);
+    long per_thread = state->config.items / state->config.producers;
+    int batch = state->config.batch;
+    long retries = 0;
+    while (!state->go.load(std::memory_order_acquire)) {
+    }
+
+    std::vector<long> items;
+    for (long i = 0; i < per_thread; i += batch) {
+        if (batch == 1) {
+            while (!state->queue.push(i)) {
+                ++retries;
+                sched_yield();
+            }
+            continue;
+        }
+        items.clear();
+        for (long j = i; j < i + batch && j < per_thread; ++j) {
+            items.push_back(j);
+        }
+        while (!state->queue.push_batch(items)) {
+            ++retries;
+            sched_yield();
+        }
+    }
+    state->full_retries += retries;
+    return nullptr;
+}
+
+template <class Queue>
+static void* consume(void* arg) {
+    BenchState<Queue>* state = static_cast<BenchState<Queue>*>(arg);
+    long per_thread = state->config.items / state->config.consumers;
+    int batch = state->config.batch;
+    long long sum = 0;
+    while (!state->go.load(std::memory_order_acquire)) {
+    }
+
+    if (batch == 1) {
+        long item = 0;
+        for (long i = 0; i < per_thread; ++i) {
+            state->queue.pop(item);
+            sum += item;
+        }
+    } else {
+        std::vector<long> items;
+        for (long i = 0; i < per_thread; i += batch) {
+            state->queue.pop_batch(items, batch);
+            for (long item : items) {
+                sum += item;
+            }
+        }
+    }
+    state->checksum += sum;
+    return nullptr;
+}
+
+template <class Queue>
+static void run(const char* name, const BenchConfig& config) {
+    BenchState<Queue> state(config);
+    std::vector<pthread_t> threads(config.producers + config.consumers);
+    for (int i = 0; i < config.producers; ++i) {
+        pthread_create(&threads[i], nullptr, produce<Queue>, &state);
+    }
+    for (int i = 0; i < config.consumers; ++i) {
+        pthread_create(&threads[config.producers + i], nullptr, consume<Queue>, &state);
+    }
+
+    double start = now_sec();
+    state.go.store(true, std::memory_order_release);
+    for (pthread_t& t : threads) {
+        pthread_join(t, nullptr);
+    }
+    double elapsed = now_sec() - start;
+
+    long per_producer = config.items / config.producers;
+    long long expected = (long long)config.producers * per_producer * (per_producer - 1) / 2;
+    printf("%-14s %8.3f s %10.2f Mops/s %12ld full-retries%s\n", name, elapsed,
+           config.items / elapsed / 1e6, state.full_retries.load(),
+           state.checksum.load() == expected ? "" : "  CHECKSUM MISMATCH");
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:c:n:q:b:")) != -1) {
+        switch (opt) {
+            case 'p': config.producers = atoi(optarg); break;
+            case 'c': config.consumers = atoi(optarg); break;
+            case 'n': config.items = atol(optarg); break;
+            case 'q': config.capacity = atoi(optarg); break;
+            case 'b': config.batch = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-p producers] [-c consumers] [-n items] [-q capacity] [-b batch]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (config.producers <= 0 || config.consumers <= 0 || config.batch <= 0 || config.capacity < config.batch) {
+        fprintf(stderr, "producers, consumers and batch must be positive, capacity >= batch\n");
+        return 1;
+    }
+    // Every producer and consumer handles the same whole number of batches
+    long unit = (long)config.producers * config.consumers * config.batch;
+    config.items = config.items / unit * unit;
+    if (config.items == 0) {
+        config.items = unit;
+    }
+
+    printf("%d producers, %d consumers, %ld items, capacity %d, batch %d\n", config.producers,
+           config.consumers, config.items, config.capacity, config.batch);
+    run<BlockQueue<long>>("BlockQueue", config);
+    run<LockFreeQueue<long>>("LockFreeQueue", config);
+    return 0;
+}
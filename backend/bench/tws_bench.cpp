@@ -0,0 +1,794 @@
+// HTTP/1.1 load generator for tiny_webserver.
+//
+//   tws_bench [-H host] [-p port] [-t threads] [-c connections] [-d seconds]
+//             [-w warmup] [-D depth] [-r rate] [-m mix] [-u users] [-P password]
+//             [-f path] [-i idle]
+//
+// Each thread drives its share of keep-alive connections from one epoll
+// loop, keeping up to `depth` requests in flight per connection.
+//
+// Without -r the load is closed-loop: a connection sends its next request
+// as soon as a response comes back, and latency is measured from the send.
+// With -r the load is open-loop at that many requests per second in total:
+// every request has an intended send time on a fixed schedule and latency is
+// measured from that time, so a stalled server is charged for the requests
+// it kept waiting (no coordinated omission).
+//
+// The mix is a comma separated list of kind:weight, e.g.
+//   static:8,login:1,register:1
+// with kinds static (GET of -f path, default /), login (POST /api/login JSON for one of -u users
+// named bench0..benchN-1), register (POST /api/register with a fresh user)
+// and metrics (GET /metrics).
+//
+// Latencies go into a log-linear histogram with 128 sub-buckets per power of
+// two (under 1% error); the report lists percentiles, throughput and
+// responses by status class. Responses still missing 5s after they were
+// due count as timeouts and their connection is reopened.
+//
+// -i opens that many extra keep-alive connections before the run, sends one
+// static request on each and then holds them idle until it ends, to measure
+// the cost of idle connections on the server; the report counts those the
+// server closed meanwhile (its idle timer closes them after about 15 s).
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace {
+
+const int64_t RESPONSE_TIMEOUT_NS = 5000000000LL;
+const int64_t RETRY_DELAY_NS = 100000000;
+const size_t READ_CHUNK = 16384;
+
+int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Log-linear histogram over nanoseconds, HdrHistogram style
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 7;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_EXPONENT = 40;  // ~18 minutes
+    static const int BUCKETS = (MAX_EXPONENT - SUB_BITS + 1) * SUB_BUCKETS;
+
+    LatencyHistogram() : m_counts(BUCKETS, 0), m_count(0), m_sum(0), m_max(0) {}
+
+    void record(int64_t ns) {
+        uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+        ++m_counts[bucket_of(v)];
+        ++m_count;
+        m_sum += v;
+        m_max = std::max(m_max, v);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        m_max = std::max(m_max, other.m_max);
+    }
+
+    // Upper edge of the bucket holding the q-th value, capped at the max
+    uint64_t percentile(double q) const {
+        if (m_count == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(q * (m_count - 1));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += m_counts[i];
+            if (seen > rank) {
+                return std::min(lower_bound(i + 1) - 1, m_max);
+            }
+        }
+        return m_max;
+    }
+
+    uint64_t count() const { return m_count; }
+    uint64_t max() const { return m_max; }
+    double mean() const { return m_count ? (double)m_sum / m_count : 0; }
+
+private:
+    static int bucket_of(uint64_t v) {
+        if (v < (uint64_t)SUB_BUCKETS) {
+            return (int)v;
+        }
+        int exponent = 63 - __builtin_clzll(v);
+        if (exponent >= MAX_EXPONENT) {
+            return BUCKETS - 1;
+        }
+        int shift = exponent - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + (int)((v >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t lower_bound(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        int shift = bucket / SUB_BUCKETS - 1;
+        return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    }
+
+    std::vector<uint64_t> m_counts;
+    uint64_t m_count;
+    uint64_t m_sum;
+    uint64_t m_max;
+};
+
+enum Kind {
+    KIND_STATIC = 0,
+    KIND_LOGIN,
+    KIND_REGISTER,
+    KIND_METRICS,
+    KIND_COUNT
+};
+
+const char* const KIND_NAMES[KIND_COUNT] = {"static", "login", "register", "metrics"};
+
+struct BenchConfig {
+    std::string host = "127.0.0.1";
+    int port = 9000;
+    int threads = 2;
+    int connections = 64;
+    double duration = 10;
+    double warmup = 1;
+    int depth = 1;
+    double rate = 0;
+    int weights[KIND_COUNT] = {1, 0, 0, 0};
+    int users = 100;
+    std::string password = "benchpass";
+    std::string static_path = "/";
+    int idle = 0;
+};
+
+struct Stats {
+    LatencyHistogram latency;
+    uint64_t completed = 0;
+    uint64_t status[6] = {0, 0, 0, 0, 0, 0};  // by class, [0] unparseable
+    uint64_t by_kind[KIND_COUNT] = {0, 0, 0, 0};
+    uint64_t bytes = 0;
+    uint64_t connect_errors = 0;
+    uint64_t io_errors = 0;
+    uint64_t timeouts = 0;
+    uint64_t reconnects = 0;
+
+    void merge(const Stats& other) {
+        latency.merge(other.latency);
+        completed += other.completed;
+        for (int i = 0; i < 6; ++i) {
+            status[i] += other.status[i];
+        }
+        for (int i = 0; i < KIND_COUNT; ++i) {
+            by_kind[i] += other.by_kind[i];
+        }
+        bytes += other.bytes;
+        connect_errors += other.connect_errors;
+        io_errors += other.io_errors;
+        timeouts += other.timeouts;
+        reconnects += other.reconnects;
+    }
+};
+
+struct InFlight {
+    int64_t start_ns;  // intended send time in open-loop mode
+    int64_t sent_ns;   // for the response timeout
+    Kind kind;
+};
+
+struct Connection {
+    int fd = -1;
+    bool connecting = false;
+    bool want_write = false;   // EPOLLOUT armed: connecting or `out` not fully sent
+    std::string out;         // bytes not yet written
+    size_t out_off = 0;
+    std::string in;          // bytes of responses not yet parsed
+    std::deque<InFlight> inflight;
+    int64_t next_send_ns = 0;  // open-loop schedule
+    int64_t interval_ns = 0;
+    std::deque<int64_t> due;   // open-loop requests waiting for a pipeline slot
+    int64_t retry_ns = 0;      // when to reconnect after a failed connect
+};
+
+struct Worker {
+    const BenchConfig* config;
+    int index;
+    int connections;
+    double rate;  // this thread's share
+    int64_t start_ns;
+    int64_t measure_ns;  // end of warmup
+    int64_t end_ns;
+    Stats stats;
+    uint64_t seq = 0;
+    uint32_t rng = 0;
+    pthread_t thread;
+};
+
+uint32_t next_random(uint32_t* state) {
+    // xorshift32
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+Kind pick_kind(Worker* w) {
+    int total = 0;
+    for (int weight : w->config->weights) {
+        total += weight;
+    }
+    int r = (int)(next_random(&w->rng) % (uint32_t)total);
+    for (int i = 0; i < KIND_COUNT; ++i) {
+        r -= w->config->weights[i];
+        if (r < 0) {
+            return (Kind)i;
+        }
+    }
+    return KIND_STATIC;
+}
+
+void append_request(Worker* w, Kind kind, std::string* out) {
+    char body[256];
+    int body_len = 0;
+    std::string static_line = "GET " + w->config->static_path + " HTTP/1.1\r\n";
+    const char* line = static_line.c_str();
+    switch (kind) {
+        case KIND_LOGIN:
+            line = "POST /api/login HTTP/1.1\r\n";
+            body_len = snprintf(body, sizeof(body), "{\"username\":\"bench%u\",\"password\":\"%s\"}",
+                                next_random(&w->rng) % (uint32_t)w->config->users,
+                                w->config->password.c_str());
+            break;
+        case KIND_REGISTER:
+            line = "POST /api/register HTTP/1.1\r\n";
+            body_len = snprintf(body, sizeof(body),
+                                "{\"username\":\"bench_%d_%d_%llu\",\"password\":\"%s\"}",
+                                (int)getpid(), w->index, (unsigned long long)++w->seq,
+                                w->config->password.c_str());
+            break;
+        case KIND_METRICS:
+            line = "GET /metrics HTTP/1.1\r\n";
+            break;
+        default:
+            break;
+    }
+    out->append(line);
+    out->append("Host: ");
+    out->append(w->config->host);
+    out->append("\r\nConnection: keep-alive\r\n");
+    if (body_len > 0) {
+        char headers[96];
+        snprintf(headers, sizeof(headers),
+                 "Content-Type: application/json\r\nContent-Length: %d\r\n\r\n", body_len);
+        out->append(headers);
+        out->append(body, body_len);
+    } else {
+        out->append("\r\n");
+    }
+}
+
+// Length of the first complete response in `in`, 0 if incomplete, -1 if malformed
+long response_length(const std::string& in, int* status) {
+    size_t header_end = in.find("\r\n\r\n");
+    if (header_end == std::string::npos) {
+        return in.size() > 65536 ? -1 : 0;
+    }
+    *status = 0;
+    if (in.compare(0, 5, "HTTP/") == 0) {
+        size_t space = in.find(' ');
+        if (space != std::string::npos && space < header_end) {
+            *status = atoi(in.c_str() + space + 1);
+        }
+    }
+    long content_length = 0;
+    size_t pos = in.find("\r\n");
+    while (pos < header_end) {
+        size_t next = in.find("\r\n", pos + 2);
+        const char* line = in.c_str() + pos + 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = atol(line + 15);
+        }
+        pos = next;
+    }
+    size_t total = header_end + 4 + (size_t)content_length;
+    return in.size() >= total ? (long)total : 0;
+}
+
+void close_connection(int epollfd, Connection* c) {
+    if (c->fd >= 0) {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, nullptr);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->connecting = false;
+    c->want_write = false;
+    c->out.clear();
+    c->out_off = 0;
+    c->in.clear();
+}
+
+bool open_connection(Worker* w, int epollfd, Connection* c, const struct sockaddr_in& addr) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        ++w->stats.connect_errors;
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS) {
+        ++w->stats.connect_errors;
+        close(fd);
+        return false;
+    }
+    c->fd = fd;
+    c->connecting = true;
+    c->want_write = true;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.ptr = c;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+    return true;
+}
+
+// Requests that were in flight on a dropped connection are lost; in
+// open-loop mode they are not re-sent, the schedule simply continues
+void drop_connection(Worker* w, int epollfd, Connection* c, const struct sockaddr_in& addr) {
+    close_connection(epollfd, c);
+    c->inflight.clear();
+    ++w->stats.reconnects;
+    if (!open_connection(w, epollfd, c, addr)) {
+        c->retry_ns = now_ns() + RETRY_DELAY_NS;
+    }
+}
+
+void queue_request(Worker* w, Connection* c, int64_t start_ns) {
+    Kind kind = pick_kind(w);
+    append_request(w, kind, &c->out);
+    c->inflight.push_back(InFlight{start_ns, now_ns(), kind});
+}
+
+// Level-triggered EPOLLOUT would fire on every wait once connected, so it
+// is only armed while there is something to write
+void set_write_interest(int epollfd, Connection* c, bool on) {
+    if (c->want_write == on) {
+        return;
+    }
+    c->want_write = on;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (on ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.ptr = c;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+bool flush_output(Worker* w, int epollfd, Connection* c) {
+    if (c->fd < 0 || c->connecting) {
+        return true;
+    }
+    while (c->out_off < c->out.size()) {
+        ssize_t n = send(c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_write_interest(epollfd, c, true);
+                return true;
+            }
+            ++w->stats.io_errors;
+            return false;
+        }
+        c->out_off += (size_t)n;
+    }
+    c->out.clear();
+    c->out_off = 0;
+    set_write_interest(epollfd, c, false);
+    return true;
+}
+
+// Fill the pipeline: closed-loop keeps it full, open-loop sends what is due
+void fill_pipeline(Worker* w, Connection* c, int64_t now) {
+    if (c->fd < 0 || c->connecting) {
+        return;
+    }
+    if (w->rate <= 0) {
+        while ((int)c->inflight.size() < w->config->depth) {
+            queue_request(w, c, now_ns());
+        }
+        return;
+    }
+    while (c->next_send_ns <= now && c->next_send_ns < w->end_ns) {
+        c->due.push_back(c->next_send_ns);
+        c->next_send_ns += c->interval_ns;
+    }
+    while (!c->due.empty() && (int)c->inflight.size() < w->config->depth) {
+        queue_request(w, c, c->due.front());
+        c->due.pop_front();
+    }
+}
+
+bool read_responses(Worker* w, Connection* c) {
+    char buf[READ_CHUNK];
+    while (true) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            c->in.append(buf, (size_t)n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n < 0 || !c->inflight.empty()) {
+            ++w->stats.io_errors;
+        }
+        return false;
+    }
+
+    while (true) {
+        int status = 0;
+        long len = response_length(c->in, &status);
+        if (len < 0) {
+            ++w->stats.io_errors;
+            return false;
+        }
+        if (len == 0) {
+            break;
+        }
+        int64_t now = now_ns();
+        if (c->inflight.empty()) {
+            ++w->stats.io_errors;
+            return false;
+        }
+        InFlight req = c->inflight.front();
+        c->inflight.pop_front();
+        c->in.erase(0, (size_t)len);
+        if (req.start_ns >= w->measure_ns && now <= w->end_ns) {
+            Stats& s = w->stats;
+            s.latency.record(now - req.start_ns);
+            ++s.completed;
+            ++s.status[status >= 100 && status < 600 ? status / 100 : 0];
+            ++s.by_kind[req.kind];
+            s.bytes += (uint64_t)len;
+        }
+    }
+    return true;
+}
+
+void* run_worker(void* arg) {
+    Worker* w = static_cast<Worker*>(arg);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(w->config->port);
+    inet_pton(AF_INET, w->config->host.c_str(), &addr.sin_addr);
+
+    int epollfd = epoll_create1(0);
+    std::vector<Connection> conns(w->connections);
+    int64_t interval = w->rate > 0 ? (int64_t)(1e9 * w->connections / w->rate) : 0;
+    for (int i = 0; i < w->connections; ++i) {
+        Connection& c = conns[i];
+        c.interval_ns = interval;
+        // Spread the connections' schedules over one interval
+        c.next_send_ns = w->start_ns + (interval * i) / std::max(1, w->connections);
+        open_connection(w, epollfd, &c, addr);
+    }
+
+    std::vector<struct epoll_event> events(w->connections + 1);
+    while (true) {
+        int64_t now = now_ns();
+        if (now >= w->end_ns) {
+            break;
+        }
+        int timeout_ms = 10;
+        if (w->rate > 0) {
+            int64_t next = w->end_ns;
+            for (const Connection& c : conns) {
+                next = std::min(next, c.next_send_ns);
+            }
+            // Round up: a 0 ms wait before a sub-millisecond deadline would spin
+            timeout_ms = (int)std::max<int64_t>(0, std::min<int64_t>(10, (next - now + 999999) / 1000000));
+        }
+        int n = epoll_wait(epollfd, events.data(), (int)events.size(), timeout_ms);
+        for (int i = 0; i < n; ++i) {
+            Connection* c = static_cast<Connection*>(events[i].data.ptr);
+            if (c->fd < 0) {
+                continue;
+            }
+            if (c->connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    ++w->stats.connect_errors;
+                    close_connection(epollfd, c);
+                    c->retry_ns = now_ns() + RETRY_DELAY_NS;
+                    continue;
+                }
+                c->connecting = false;
+            }
+            bool ok = true;
+            if (events[i].events & EPOLLOUT) {
+                ok = flush_output(w, epollfd, c);
+            }
+            if (ok && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                ok = read_responses(w, c);
+            }
+            if (!ok) {
+                drop_connection(w, epollfd, c, addr);
+            }
+        }
+
+        now = now_ns();
+        for (Connection& c : conns) {
+            if (c.fd < 0) {
+                if (now >= c.retry_ns) {
+                    ++w->stats.reconnects;
+                    if (!open_connection(w, epollfd, &c, addr)) {
+                        c.retry_ns = now + RETRY_DELAY_NS;
+                    }
+                }
+                continue;
+            }
+            if (!c.inflight.empty() && now - c.inflight.front().sent_ns > RESPONSE_TIMEOUT_NS) {
+                w->stats.timeouts += c.inflight.size();
+                drop_connection(w, epollfd, &c, addr);
+                continue;
+            }
+            fill_pipeline(w, &c, now);
+            if (!flush_output(w, epollfd, &c)) {
+                drop_connection(w, epollfd, &c, addr);
+            }
+        }
+    }
+
+    // Requests still in flight at the end are not counted
+    for (Connection& c : conns) {
+        close_connection(epollfd, &c);
+    }
+    close(epollfd);
+    return nullptr;
+}
+
+bool parse_mix(const char* spec, int* weights) {
+    for (int i = 0; i < KIND_COUNT; ++i) {
+        weights[i] = 0;
+    }
+    std::string s(spec);
+    size_t pos = 0;
+    int total = 0;
+    while (pos <= s.size()) {
+        size_t comma = s.find(',', pos);
+        std::string item = s.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        size_t colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        int weight = colon == std::string::npos ? 1 : atoi(item.c_str() + colon + 1);
+        int kind = -1;
+        for (int i = 0; i < KIND_COUNT; ++i) {
+            if (name == KIND_NAMES[i]) {
+                kind = i;
+            }
+        }
+        if (kind < 0 || weight < 0) {
+            fprintf(stderr, "bad mix entry '%s'\n", item.c_str());
+            return false;
+        }
+        weights[kind] += weight;
+        total += weight;
+        if (comma == std::string::npos) {
+            break;
+        }
+        pos = comma + 1;
+    }
+    return total > 0;
+}
+
+void print_report(const BenchConfig& config, const Stats& s, double seconds) {
+    printf("%llu responses in %.2f s: %.1f req/s, %.2f MB/s\n", (unsigned long long)s.completed,
+           seconds, s.completed / seconds, s.bytes / seconds / 1e6);
+    printf("status: 1xx %llu  2xx %llu  3xx %llu  4xx %llu  5xx %llu  other %llu\n",
+           (unsigned long long)s.status[1], (unsigned long long)s.status[2],
+           (unsigned long long)s.status[3], (unsigned long long)s.status[4],
+           (unsigned long long)s.status[5], (unsigned long long)s.status[0]);
+    printf("by kind:");
+    for (int i = 0; i < KIND_COUNT; ++i) {
+        if (config.weights[i] > 0) {
+            printf(" %s %llu", KIND_NAMES[i], (unsigned long long)s.by_kind[i]);
+        }
+    }
+    printf("\nerrors: connect %llu, io %llu, timeouts %llu, reconnects %llu\n",
+           (unsigned long long)s.connect_errors, (unsigned long long)s.io_errors,
+           (unsigned long long)s.timeouts, (unsigned long long)s.reconnects);
+    printf("latency%s (us): mean %.1f", config.rate > 0 ? " from intended send" : "",
+           s.latency.mean() / 1e3);
+    static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999, 0.9999};
+    static const char* const NAMES[] = {"p50", "p90", "p99", "p99.9", "p99.99"};
+    for (int i = 0; i < 5; ++i) {
+        printf("  %s %.1f", NAMES[i], s.latency.percentile(QUANTILES[i]) / 1e3);
+    }
+    printf("  max %.1f\n", s.latency.max() / 1e3);
+}
+
+// One request and its response, blocking. A connect alone can succeed
+// for a connection the server's full accept queue later drops.
+bool warm_idle(int fd, const BenchConfig& config) {
+    std::string request = "GET " + config.static_path + " HTTP/1.1\r\nHost: " + config.host +
+                          "\r\nConnection: keep-alive\r\n\r\n";
+    if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+        return false;
+    }
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    std::string in;
+    char buf[READ_CHUNK];
+    for (;;) {
+        int status;
+        long len = response_length(in, &status);
+        if (len != 0) {
+            return len > 0 && status < 400;
+        }
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return false;
+        }
+        in.append(buf, n);
+    }
+}
+
+std::vector<int> open_idle(const BenchConfig& config, int* failed) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    inet_pton(AF_INET, config.host.c_str(), &addr.sin_addr);
+    std::vector<int> fds;
+    *failed = 0;
+    for (int i = 0; i < config.idle; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            !warm_idle(fd, config)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            ++*failed;
+            continue;
+        }
+        fds.push_back(fd);
+    }
+    return fds;
+}
+
+// Closes the idle connections, returns how many the server had closed
+int close_idle(const std::vector<int>& fds) {
+    int closed = 0;
+    for (int fd : fds) {
+        char c;
+        ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            ++closed;
+        }
+        close(fd);
+    }
+    return closed;
+}
+
+void raise_fd_limit(int needed) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)needed) {
+        rl.rlim_cur = std::min(rl.rlim_max, (rlim_t)needed);
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-H host] [-p port] [-t threads] [-c connections] [-d seconds] [-w warmup]\n"
+            "          [-D depth] [-r rate] [-m mix] [-u users] [-P password] [-f path] [-i idle]\n"
+            "  mix: comma separated kind:weight, kinds static, login, register, metrics\n",
+            prog);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:t:c:d:w:D:r:m:u:P:f:i:")) != -1) {
+        switch (opt) {
+            case 'H': config.host = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 't': config.threads = atoi(optarg); break;
+            case 'c': config.connections = atoi(optarg); break;
+            case 'd': config.duration = atof(optarg); break;
+            case 'w': config.warmup = atof(optarg); break;
+            case 'D': config.depth = atoi(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 'm':
+                if (!parse_mix(optarg, config.weights)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'u': config.users = atoi(optarg); break;
+            case 'P': config.password = optarg; break;
+            case 'f': config.static_path = optarg; break;
+            case 'i': config.idle = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    struct in_addr probe;
+    if (inet_pton(AF_INET, config.host.c_str(), &probe) != 1) {
+        fprintf(stderr, "host must be an IPv4 address\n");
+        return 1;
+    }
+    if (config.threads <= 0 || config.connections < config.threads || config.depth <= 0 ||
+        config.duration <= 0 || config.warmup < 0 || config.rate < 0 || config.users <= 0 ||
+        config.idle < 0 || config.static_path.empty() || config.static_path[0] != '/') {
+        fprintf(stderr, "threads, depth, duration and users must be positive, connections >= threads, "
+                        "path must start with /\n");
+        return 1;
+    }
+    raise_fd_limit(config.connections + config.idle + 64);
+
+    printf("%s:%d, %d threads, %d connections, depth %d, %s", config.host.c_str(), config.port,
+           config.threads, config.connections, config.depth, config.rate > 0 ? "" : "closed loop");
+    if (config.rate > 0) {
+        printf("open loop at %.0f req/s", config.rate);
+    }
+    printf(", %.1f s + %.1f s warmup\n", config.duration, config.warmup);
+
+    int idle_failed = 0;
+    std::vector<int> idle_fds = open_idle(config, &idle_failed);
+    // tws_matrix takes the first output as the start of the warmup
+    fflush(stdout);
+
+    int64_t start = now_ns();
+    std::vector<Worker> workers(config.threads);
+    for (int i = 0; i < config.threads; ++i) {
+        Worker& w = workers[i];
+        w.config = &config;
+        w.index = i;
+        w.connections = config.connections / config.threads + (i < config.connections % config.threads);
+        w.rate = config.rate * w.connections / config.connections;
+        w.start_ns = start;
+        w.measure_ns = start + (int64_t)(config.warmup * 1e9);
+        w.end_ns = w.measure_ns + (int64_t)(config.duration * 1e9);
+        w.rng = 2463534242u + 7919u * (uint32_t)i;
+    }
+    for (Worker& w : workers) {
+        pthread_create(&w.thread, nullptr, run_worker, &w);
+    }
+    Stats total;
+    for (Worker& w : workers) {
+        pthread_join(w.thread, nullptr);
+        total.merge(w.stats);
+    }
+    print_report(config, total, config.duration);
+    if (config.idle > 0) {
+        int idle_closed = close_idle(idle_fds);
+        printf("idle: %d held, %d failed to open, %d closed by server\n",
+               (int)idle_fds.size() - idle_closed, idle_failed, idle_closed);
+    }
+    return 0;
+}
@@ -0,0 +1,636 @@
+// Benchmark matrix: runs tiny_webserver under every combination of the
+// given settings against a set of standard workloads and prints one
+// comparison report.
+//
+//   tws_matrix [-S server] [-B tws_bench] [-m trig_modes] [-a actor_models]
+//              [-t thread_nums] [-s sql_nums] [-W workloads] [-d seconds]
+//              [-w warmup] [-c connections] [-T bench_threads] [-p port]
+//              [-x "server args"] [-C workdir] [-o report.csv]
+//
+// -m, -a, -t, -s and -W take comma separated lists (defaults: all four
+// trigger modes, both actor models, 8 threads, 8 SQL connections, all
+// workloads). -x adds arguments to every server run, e.g. "-u fake:rows=1000"
+// to benchmark without MySQL or "-c 1" to turn logging off.
+//
+// Every (configuration, workload) pair gets a fresh server started in the
+// work directory (default: a new directory under /tmp) with the static files
+// the workloads request, and one tws_bench run against it. For each run the
+// report gives throughput, latency percentiles, errors, the server's CPU use
+// during the measured interval (cores, and microseconds per request) and its
+// peak RSS. The summary ranks the configurations per workload.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace {
+
+const size_t SMALL_FILE_SIZE = 1024;
+const size_t LARGE_FILE_SIZE = 1024 * 1024;
+const int READY_TIMEOUT_MS = 30000;
+const int STOP_TIMEOUT_MS = 10000;
+
+struct Workload {
+    const char* name;
+    const char* description;
+    std::vector<std::string> bench_args;
+};
+
+const Workload WORKLOADS[] = {
+    {"small_static", "GET of a 1 KiB page", {"-m", "static"}},
+    {"large_static", "GET of a 1 MiB file", {"-m", "static", "-f", "/large.html"}},
+    {"login_mix", "static 6 : login 3 : register 1", {"-m", "static:6,login:3,register:1", "-u", "1000"}},
+    {"idle_keepalive", "small static with 2000 idle keep-alive connections held open",
+     {"-m", "static", "-i", "2000"}},
+};
+const int WORKLOAD_COUNT = sizeof(WORKLOADS) / sizeof(WORKLOADS[0]);
+
+struct Options {
+    std::string server = "./tiny_webserver";
+    std::string bench = "./tws_bench";
+    std::vector<int> trig_modes = {0, 1, 2, 3};
+    std::vector<int> actor_models = {0, 1};
+    std::vector<int> thread_nums = {8};
+    std::vector<int> sql_nums = {8};
+    std::vector<int> workloads = {0, 1, 2, 3};
+    double duration = 10;
+    double warmup = 2;
+    int connections = 64;
+    int bench_threads = 2;
+    int port = 9100;
+    std::vector<std::string> server_args;
+    std::string workdir;
+    std::string csv;
+};
+
+struct Result {
+    int trig_mode = 0;
+    int actor_model = 0;
+    int thread_num = 0;
+    int sql_num = 0;
+    int workload = 0;
+    bool ok = false;
+    std::string error;
+    double req_per_sec = 0;
+    double mb_per_sec = 0;
+    double p50_us = 0;
+    double p90_us = 0;
+    double p99_us = 0;
+    double p999_us = 0;
+    double max_us = 0;
+    unsigned long long errors = 0;      // connect, io, timeouts and 5xx
+    int idle_closed = 0;
+    double cpu_cores = 0;
+    double rss_peak_mb = 0;
+};
+
+volatile pid_t g_server_pid = 0;
+
+int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sleep_ns(int64_t ns) {
+    if (ns <= 0) {
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> out;
+    size_t pos = 0;
+    while (pos <= s.size()) {
+        size_t next = s.find(sep, pos);
+        std::string item = s.substr(pos, next == std::string::npos ? std::string::npos : next - pos);
+        if (!item.empty()) {
+            out.push_back(item);
+        }
+        if (next == std::string::npos) {
+            break;
+        }
+        pos = next + 1;
+    }
+    return out;
+}
+
+bool parse_int_list(const char* spec, std::vector<int>* out) {
+    out->clear();
+    for (const std::string& item : split(spec, ',')) {
+        char* end;
+        long v = strtol(item.c_str(), &end, 10);
+        if (*end != '\0' || v < 0) {
+            return false;
+        }
+        out->push_back((int)v);
+    }
+    return !out->empty();
+}
+
+bool parse_workloads(const char* spec, std::vector<int>* out) {
+    out->clear();
+    for (const std::string& item : split(spec, ',')) {
+        int found = -1;
+        for (int i = 0; i < WORKLOAD_COUNT; ++i) {
+            if (item == WORKLOADS[i].name) {
+                found = i;
+            }
+        }
+        if (found < 0) {
+            fprintf(stderr, "unknown workload '%s'\n", item.c_str());
+            return false;
+        }
+        out->push_back(found);
+    }
+    return !out->empty();
+}
+
+bool write_file(const std::string& path, size_t size, char fill) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && (size_t)st.st_size == size) {
+        return true;
+    }
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    std::string data = "<html><body>";
+    data.append(size - data.size() - 14, fill);
+    data.append("</body></html>");
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+    return ok;
+}
+
+// The server serves <cwd>/root; GET / maps to judge.html
+bool prepare_workdir(Options* options) {
+    if (options->workdir.empty()) {
+        char tmpl[] = "/tmp/tws_matrix.XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            perror("mkdtemp");
+            return false;
+        }
+        options->workdir = tmpl;
+    } else if (mkdir(options->workdir.c_str(), 0755) != 0 && errno != EEXIST) {
+        perror(options->workdir.c_str());
+        return false;
+    }
+    std::string root = options->workdir + "/root";
+    if (mkdir(root.c_str(), 0755) != 0 && errno != EEXIST) {
+        perror(root.c_str());
+        return false;
+    }
+    return write_file(root + "/judge.html", SMALL_FILE_SIZE, 's') &&
+           write_file(root + "/large.html", LARGE_FILE_SIZE, 'l');
+}
+
+// The server runs in the work directory, so relative paths must be resolved first
+bool resolve(std::string* path) {
+    char buf[PATH_MAX];
+    if (!realpath(path->c_str(), buf)) {
+        perror(path->c_str());
+        return false;
+    }
+    *path = buf;
+    return true;
+}
+
+pid_t spawn(const std::vector<std::string>& args, const char* dir, int out_fd) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    if (dir && chdir(dir) != 0) {
+        _exit(127);
+    }
+    if (out_fd >= 0) {
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(out_fd, STDERR_FILENO);
+    }
+    std::vector<char*> argv;
+    for (const std::string& a : args) {
+        argv.push_back(const_cast<char*>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    _exit(127);
+}
+
+bool port_open(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bool ok = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return ok;
+}
+
+// Waits up to timeout_ms for `pid` to exit
+bool wait_exit(pid_t pid, int timeout_ms) {
+    int64_t deadline = now_ns() + (int64_t)timeout_ms * 1000000;
+    do {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) != 0) {
+            return true;
+        }
+        sleep_ns(10000000);
+    } while (now_ns() < deadline);
+    return false;
+}
+
+void stop_server(pid_t pid) {
+    kill(pid, SIGTERM);
+    if (!wait_exit(pid, STOP_TIMEOUT_MS)) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+    g_server_pid = 0;
+}
+
+// utime + stime of `pid` in clock ticks
+long long cpu_ticks(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    // Fields after the parenthesised command name, which may contain spaces
+    const char* p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return -1;
+    }
+    return (long long)utime + (long long)stime;
+}
+
+// Peak resident set size of `pid` in kB
+long rss_peak_kb(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+double field_after(const char* line, const char* key) {
+    const char* p = strstr(line, key);
+    return p ? atof(p + strlen(key)) : 0;
+}
+
+// Parses tws_bench's report
+bool parse_bench_output(const std::string& out, Result* r) {
+    bool have_throughput = false;
+    for (const std::string& line : split(out, '\n')) {
+        const char* s = line.c_str();
+        unsigned long long completed, st[6], connect_err, io_err, timeouts, reconnects;
+        double seconds;
+        int held, failed, closed;
+        if (sscanf(s, "%llu responses in %lf s: %lf req/s, %lf MB/s", &completed, &seconds,
+                   &r->req_per_sec, &r->mb_per_sec) == 4) {
+            have_throughput = true;
+        } else if (sscanf(s, "status: 1xx %llu 2xx %llu 3xx %llu 4xx %llu 5xx %llu other %llu", &st[1],
+                          &st[2], &st[3], &st[4], &st[5], &st[0]) == 6) {
+            r->errors += st[5] + st[0];
+        } else if (sscanf(s, "errors: connect %llu, io %llu, timeouts %llu, reconnects %llu",
+                          &connect_err, &io_err, &timeouts, &reconnects) == 4) {
+            r->errors += connect_err + io_err + timeouts;
+        } else if (strncmp(s, "latency", 7) == 0) {
+            r->p50_us = field_after(s, " p50 ");
+            r->p90_us = field_after(s, " p90 ");
+            r->p99_us = field_after(s, " p99 ");
+            r->p999_us = field_after(s, " p99.9 ");
+            r->max_us = field_after(s, " max ");
+        } else if (sscanf(s, "idle: %d held, %d failed to open, %d closed by server", &held, &failed,
+                          &closed) == 3) {
+            r->idle_closed = failed + closed;
+        }
+    }
+    return have_throughput;
+}
+
+std::string read_all(int fd) {
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) {
+            out.append(buf, n);
+        }
+    }
+    return out;
+}
+
+void run_one(const Options& options, Result* r) {
+    std::vector<std::string> server = {options.server,
+                                       "-p", std::to_string(options.port),
+                                       "-m", std::to_string(r->trig_mode),
+                                       "-a", std::to_string(r->actor_model),
+                                       "-t", std::to_string(r->thread_num),
+                                       "-s", std::to_string(r->sql_num)};
+    server.insert(server.end(), options.server_args.begin(), options.server_args.end());
+
+    if (port_open(options.port)) {
+        r->error = "port already in use";
+        return;
+    }
+    std::string log_path = options.workdir + "/server.out";
+    int log_fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    pid_t pid = spawn(server, options.workdir.c_str(), log_fd);
+    if (log_fd >= 0) {
+        close(log_fd);
+    }
+    if (pid < 0) {
+        r->error = "fork failed";
+        return;
+    }
+    g_server_pid = pid;
+
+    int64_t deadline = now_ns() + (int64_t)READY_TIMEOUT_MS * 1000000;
+    while (!port_open(options.port)) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            g_server_pid = 0;
+            r->error = "server exited, see " + log_path;
+            return;
+        }
+        if (now_ns() > deadline) {
+            stop_server(pid);
+            r->error = "server did not start listening";
+            return;
+        }
+        sleep_ns(50000000);
+    }
+
+    const Workload& w = WORKLOADS[r->workload];
+    std::vector<std::string> bench = {options.bench,
+                                      "-p", std::to_string(options.port),
+                                      "-t", std::to_string(options.bench_threads),
+                                      "-c", std::to_string(options.connections),
+                                      "-d", std::to_string(options.duration),
+                                      "-w", std::to_string(options.warmup)};
+    bench.insert(bench.end(), w.bench_args.begin(), w.bench_args.end());
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        stop_server(pid);
+        r->error = "pipe failed";
+        return;
+    }
+    pid_t bench_pid = spawn(bench, nullptr, pipefd[1]);
+    close(pipefd[1]);
+
+    // CPU is sampled over the measured interval only. tws_bench flushes its
+    // first line once the idle connections are open and the workers start.
+    std::string out;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(pipefd[0], buf, sizeof(buf))) < 0 && errno == EINTR) {
+    }
+    if (n > 0) {
+        out.append(buf, n);
+    }
+    sleep_ns((int64_t)(options.warmup * 1e9));
+    long long ticks_start = cpu_ticks(pid);
+    int64_t measure_start = now_ns();
+    out += read_all(pipefd[0]);
+    close(pipefd[0]);
+    long long ticks_end = cpu_ticks(pid);
+    int64_t measure_end = now_ns();
+    int status = 0;
+    waitpid(bench_pid, &status, 0);
+    long rss_kb = rss_peak_kb(pid);
+    stop_server(pid);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || !parse_bench_output(out, r)) {
+        r->error = "tws_bench failed: " + out.substr(0, out.find('\n'));
+        return;
+    }
+    if (ticks_start >= 0 && ticks_end >= ticks_start && measure_end > measure_start) {
+        r->cpu_cores = (double)(ticks_end - ticks_start) / sysconf(_SC_CLK_TCK) /
+                       ((measure_end - measure_start) / 1e9);
+    }
+    r->rss_peak_mb = rss_kb / 1024.0;
+    r->ok = true;
+}
+
+std::string config_name(const Result& r) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "m%d a%d t%d s%d", r.trig_mode, r.actor_model, r.thread_num, r.sql_num);
+    return buf;
+}
+
+double cpu_us_per_request(const Result& r) {
+    return r.req_per_sec > 0 ? r.cpu_cores * 1e6 / r.req_per_sec : 0;
+}
+
+void print_header() {
+    printf("%-16s %-14s %10s %8s %9s %9s %9s %9s %10s %7s %6s %8s %8s\n", "workload", "config", "req/s",
+           "MB/s", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us", "errors", "cpu", "us/req",
+           "rss_mb");
+}
+
+void print_row(const Result& r) {
+    if (!r.ok) {
+        printf("%-16s %-14s failed: %s\n", WORKLOADS[r.workload].name, config_name(r).c_str(),
+               r.error.c_str());
+        return;
+    }
+    printf("%-16s %-14s %10.1f %8.2f %9.1f %9.1f %9.1f %9.1f %10.1f %7llu %6.2f %8.1f %8.1f",
+           WORKLOADS[r.workload].name, config_name(r).c_str(), r.req_per_sec, r.mb_per_sec, r.p50_us,
+           r.p90_us, r.p99_us, r.p999_us, r.max_us, r.errors, r.cpu_cores, cpu_us_per_request(r),
+           r.rss_peak_mb);
+    if (r.idle_closed > 0) {
+        printf("  (%d idle connections lost)", r.idle_closed);
+    }
+    printf("\n");
+}
+
+void print_summary(const Options& options, const std::vector<Result>& results) {
+    printf("\nsummary: configurations by throughput, relative to the best (m trig_mode, a actor_model, "
+           "t thread_num, s sql_num)\n");
+    for (int wi : options.workloads) {
+        std::vector<const Result*> rows;
+        for (const Result& r : results) {
+            if (r.workload == wi && r.ok) {
+                rows.push_back(&r);
+            }
+        }
+        if (rows.empty()) {
+            continue;
+        }
+        std::stable_sort(rows.begin(), rows.end(), [](const Result* a, const Result* b) {
+            return a->req_per_sec > b->req_per_sec;
+        });
+        printf("%s (%s):\n", WORKLOADS[wi].name, WORKLOADS[wi].description);
+        double best = rows[0]->req_per_sec;
+        for (const Result* r : rows) {
+            printf("  %-14s %10.1f req/s %6.1f%%  p99 %9.1f us  %7.1f us cpu/req\n", config_name(*r).c_str(),
+                   r->req_per_sec, best > 0 ? r->req_per_sec * 100 / best : 0, r->p99_us,
+                   cpu_us_per_request(*r));
+        }
+    }
+}
+
+bool write_csv(const std::string& path, const std::vector<Result>& results) {
+    FILE* fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        perror(path.c_str());
+        return false;
+    }
+    fprintf(fp, "workload,trig_mode,actor_model,thread_num,sql_num,ok,req_per_sec,mb_per_sec,p50_us,"
+                "p90_us,p99_us,p999_us,max_us,errors,idle_lost,cpu_cores,cpu_us_per_req,rss_peak_mb\n");
+    for (const Result& r : results) {
+        fprintf(fp, "%s,%d,%d,%d,%d,%d,%.1f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%llu,%d,%.3f,%.2f,%.1f\n",
+                WORKLOADS[r.workload].name, r.trig_mode, r.actor_model, r.thread_num, r.sql_num, r.ok ? 1 : 0,
+                r.req_per_sec, r.mb_per_sec, r.p50_us, r.p90_us, r.p99_us, r.p999_us, r.max_us, r.errors,
+                r.idle_closed, r.cpu_cores, cpu_us_per_request(r), r.rss_peak_mb);
+    }
+    fclose(fp);
+    return true;
+}
+
+void on_signal(int sig) {
+    if (g_server_pid > 0) {
+        kill(g_server_pid, SIGTERM);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-S server] [-B tws_bench] [-m trig_modes] [-a actor_models] [-t thread_nums]\n"
+            "          [-s sql_nums] [-W workloads] [-d seconds] [-w warmup] [-c connections]\n"
+            "          [-T bench_threads] [-p port] [-x \"server args\"] [-C workdir] [-o report.csv]\n"
+            "  workloads:",
+            prog);
+    for (int i = 0; i < WORKLOAD_COUNT; ++i) {
+        fprintf(stderr, " %s", WORKLOADS[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    int opt;
+    bool ok = true;
+    while ((opt = getopt(argc, argv, "S:B:m:a:t:s:W:d:w:c:T:p:x:C:o:")) != -1) {
+        switch (opt) {
+            case 'S': options.server = optarg; break;
+            case 'B': options.bench = optarg; break;
+            case 'm': ok = parse_int_list(optarg, &options.trig_modes); break;
+            case 'a': ok = parse_int_list(optarg, &options.actor_models); break;
+            case 't': ok = parse_int_list(optarg, &options.thread_nums); break;
+            case 's': ok = parse_int_list(optarg, &options.sql_nums); break;
+            case 'W': ok = parse_workloads(optarg, &options.workloads); break;
+            case 'd': options.duration = atof(optarg); break;
+            case 'w': options.warmup = atof(optarg); break;
+            case 'c': options.connections = atoi(optarg); break;
+            case 'T': options.bench_threads = atoi(optarg); break;
+            case 'p': options.port = atoi(optarg); break;
+            case 'x': options.server_args = split(optarg, ' '); break;
+            case 'C': options.workdir = optarg; break;
+            case 'o': options.csv = optarg; break;
+            default: ok = false; break;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || options.duration <= 0 || options.warmup < 0 || options.port <= 0 ||
+        options.bench_threads <= 0 || options.connections < options.bench_threads) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!resolve(&options.server) || !resolve(&options.bench) || !prepare_workdir(&options)) {
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    // Inherited by the server, which needs a descriptor per idle connection
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    std::vector<Result> results;
+    for (int trig_mode : options.trig_modes) {
+        for (int actor_model : options.actor_models) {
+            for (int thread_num : options.thread_nums) {
+                for (int sql_num : options.sql_nums) {
+                    for (int workload : options.workloads) {
+                        Result r;
+                        r.trig_mode = trig_mode;
+                        r.actor_model = actor_model;
+                        r.thread_num = thread_num;
+                        r.sql_num = sql_num;
+                        r.workload = workload;
+                        results.push_back(r);
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%zu runs of %.1f s + %.1f s warmup, %d connections from %d threads, server in %s\n\n",
+           results.size(), options.duration, options.warmup, options.connections, options.bench_threads,
+           options.workdir.c_str());
+    print_header();
+    fflush(stdout);
+    for (Result& r : results) {
+        run_one(options, &r);
+        print_row(r);
+        fflush(stdout);
+    }
+    print_summary(options, results);
+    if (!options.csv.empty() && !write_csv(options.csv, results)) {
+        return 1;
+    }
+    return 0;
+}
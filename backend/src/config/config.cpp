@@ -4,6 +4,8 @@
 #include <getopt.h>
 #include <json/json.h>
 
+#include "../core/auth/user_store.h"
+
 Config::Config() {
     // 设置默认值
     m_port = DEFAULT_PORT;
@@ -16,11 +18,18 @@ Config::Config() {
     m_thread_num = DEFAULT_THREAD_NUM;
     m_close_log = DEFAULT_CLOSE_LOG;
     m_actor_model = DEFAULT_ACTOR_MODEL;
+    m_sql_affine = DEFAULT_SQL_AFFINE;
+    m_read_your_writes_ms = DEFAULT_READ_YOUR_WRITES_MS;
+    m_kdf_threads = DEFAULT_KDF_THREADS;
+    m_log_level = DEFAULT_LOG_LEVEL;
+    m_access_sample = DEFAULT_ACCESS_SAMPLE;
+    m_slow_request_ms = DEFAULT_SLOW_REQUEST_MS;
+    m_user_store = "mysql";
 }
 
 bool Config::parse_args(int argc, char* argv[]) {
     int opt;
-    const char* str = "p:l:m:o:s:t:c:a:";
+    const char* str = "p:l:m:o:s:t:c:a:d:r:w:k:v:g:x:u:f:";
     while ((opt = getopt(argc, argv, str)) != -1) {
         switch (opt) {
             case 'p': {
@@ -95,6 +104,87 @@ bool Config::parse_args(int argc, char* argv[]) {
                 m_actor_model = model;
                 break;
             }
+            case 'd': {
+                int affine = atoi(optarg);
+                if (!validate_sql_affine(affine)) {
+                    m_error_message = "Invalid SQL affinity option";
+                    return false;
+                }
+                m_sql_affine = affine;
+                break;
+            }
+            case 'r': {
+                std::string replicas = optarg;
+                if (!validate_sql_replicas(replicas)) {
+                    m_error_message = "Invalid SQL replica list";
+                    return false;
+                }
+                m_sql_replicas = replicas;
+                break;
+            }
+            case 'w': {
+                int window = atoi(optarg);
+                if (!validate_read_your_writes_ms(window)) {
+                    m_error_message = "Invalid read-your-writes window";
+                    return false;
+                }
+                m_read_your_writes_ms = window;
+                break;
+            }
+            case 'k': {
+                int kdf_threads = atoi(optarg);
+                if (!validate_kdf_threads(kdf_threads)) {
+                    m_error_message = "Invalid KDF thread count";
+                    return false;
+                }
+                m_kdf_threads = kdf_threads;
+                break;
+            }
+            case 'v': {
+                int log_level = atoi(optarg);
+                if (!validate_log_level(log_level)) {
+                    m_error_message = "Invalid log level";
+                    return false;
+                }
+                m_log_level = log_level;
+                break;
+            }
+            case 'g': {
+                int access_sample = atoi(optarg);
+                if (!validate_access_sample(access_sample)) {
+                    m_error_message = "Invalid access log sample rate";
+                    return false;
+                }
+                m_access_sample = access_sample;
+                break;
+            }
+            case 'x': {
+                int slow_request_ms = atoi(optarg);
+                if (!validate_slow_request_ms(slow_request_ms)) {
+                    m_error_message = "Invalid slow request threshold";
+                    return false;
+                }
+                m_slow_request_ms = slow_request_ms;
+                break;
+            }
+            case 'u': {
+                std::string user_store = optarg;
+                if (!validate_user_store(user_store)) {
+                    m_error_message = "Invalid user store";
+                    return false;
+                }
+                m_user_store = user_store;
+                break;
+            }
+            case 'f': {
+                std::string capture_file = optarg;
+                if (!validate_capture_file(capture_file)) {
+                    m_error_message = "Invalid capture file";
+                    return false;
+                }
+                m_capture_file = capture_file;
+                break;
+            }
             default:
                 m_error_message = "Unknown option";
                 return false;
@@ -126,6 +216,15 @@ bool Config::load_from_file(const std::string& filename) {
         set_thread_num(root.get("thread_num", DEFAULT_THREAD_NUM).asInt());
         set_close_log(root.get("close_log", DEFAULT_CLOSE_LOG).asInt());
         set_actor_model(root.get("actor_model", DEFAULT_ACTOR_MODEL).asInt());
+        set_sql_affine(root.get("sql_affine", DEFAULT_SQL_AFFINE).asInt());
+        set_sql_replicas(root.get("sql_replicas", "").asString());
+        set_read_your_writes_ms(root.get("read_your_writes_ms", DEFAULT_READ_YOUR_WRITES_MS).asInt());
+        set_kdf_threads(root.get("kdf_threads", DEFAULT_KDF_THREADS).asInt());
+        set_log_level(root.get("log_level", DEFAULT_LOG_LEVEL).asInt());
+        set_access_sample(root.get("access_sample", DEFAULT_ACCESS_SAMPLE).asInt());
+        set_slow_request_ms(root.get("slow_request_ms", DEFAULT_SLOW_REQUEST_MS).asInt());
+        set_user_store(root.get("user_store", "mysql").asString());
+        set_capture_file(root.get("capture_file", "").asString());
     } catch (const std::exception& e) {
         m_error_message = std::string("Error loading config: ") + e.what();
         return false;
@@ -144,6 +243,15 @@ bool Config::save_to_file(const std::string& filename) {
     root["thread_num"] = m_thread_num;
     root["close_log"] = m_close_log;
     root["actor_model"] = m_actor_model;
+    root["sql_affine"] = m_sql_affine;
+    root["sql_replicas"] = m_sql_replicas;
+    root["read_your_writes_ms"] = m_read_your_writes_ms;
+    root["kdf_threads"] = m_kdf_threads;
+    root["log_level"] = m_log_level;
+    root["access_sample"] = m_access_sample;
+    root["slow_request_ms"] = m_slow_request_ms;
+    root["user_store"] = m_user_store;
+    root["capture_file"] = m_capture_file;
 
     std::ofstream file(filename);
     if (!file.is_open()) {
@@ -164,7 +272,16 @@ bool Config::validate() const {
            validate_sql_num(m_sql_num) &&
            validate_thread_num(m_thread_num) &&
            validate_close_log(m_close_log) &&
-           validate_actor_model(m_actor_model);
+           validate_actor_model(m_actor_model) &&
+           validate_sql_affine(m_sql_affine) &&
+           validate_sql_replicas(m_sql_replicas) &&
+           validate_read_your_writes_ms(m_read_your_writes_ms) &&
+           validate_kdf_threads(m_kdf_threads) &&
+           validate_log_level(m_log_level) &&
+           validate_access_sample(m_access_sample) &&
+           validate_slow_request_ms(m_slow_request_ms) &&
+           validate_user_store(m_user_store) &&
+           validate_capture_file(m_capture_file);
 }
 
 // 参数验证函数
@@ -200,6 +317,54 @@ bool Config::validate_actor_model(int actor_model) const {
     return actor_model == 0 || actor_model == 1;
 }
 
+bool Config::validate_sql_affine(int sql_affine) const {
+    return sql_affine == 0 || sql_affine == 1;
+}
+
+bool Config::validate_sql_replicas(const std::string& sql_replicas) const {
+    std::stringstream ss(sql_replicas);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        // 端口可省略，默认3306
+        size_t colon = item.rfind(':');
+        if (item.empty() || colon == 0) {
+            return false;
+        }
+        if (colon != std::string::npos && !validate_port(atoi(item.c_str() + colon + 1))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Config::validate_read_your_writes_ms(int read_your_writes_ms) const {
+    return read_your_writes_ms >= 0 && read_your_writes_ms <= MAX_READ_YOUR_WRITES_MS;
+}
+
+bool Config::validate_kdf_threads(int kdf_threads) const {
+    return kdf_threads >= 0 && kdf_threads <= MAX_THREAD_NUM;
+}
+
+bool Config::validate_log_level(int log_level) const {
+    return log_level >= 0 && log_level <= 3;
+}
+
+bool Config::validate_access_sample(int access_sample) const {
+    return access_sample >= 0 && access_sample <= MAX_ACCESS_SAMPLE;
+}
+
+bool Config::validate_slow_request_ms(int slow_request_ms) const {
+    return slow_request_ms >= 0 && slow_request_ms <= MAX_SLOW_REQUEST_MS;
+}
+
+bool Config::validate_user_store(const std::string& user_store) const {
+    return UserStore::is_valid_spec(user_store);
+}
+
+bool Config::validate_capture_file(const std::string& capture_file) const {
+    return capture_file.size() <= MAX_PATH_LEN;
+}
+
 // 设置器函数
 void Config::set_port(int port) {
     if (validate_port(port)) {
@@ -263,4 +428,76 @@ void Config::set_actor_model(int model) {
     } else {
         throw std::invalid_argument("Invalid actor model");
     }
+}
+
+void Config::set_sql_affine(int affine) {
+    if (validate_sql_affine(affine)) {
+        m_sql_affine = affine;
+    } else {
+        throw std::invalid_argument("Invalid SQL affinity option");
+    }
+}
+
+void Config::set_sql_replicas(const std::string& replicas) {
+    if (validate_sql_replicas(replicas)) {
+        m_sql_replicas = replicas;
+    } else {
+        throw std::invalid_argument("Invalid SQL replica list");
+    }
+}
+
+void Config::set_read_your_writes_ms(int window) {
+    if (validate_read_your_writes_ms(window)) {
+        m_read_your_writes_ms = window;
+    } else {
+        throw std::invalid_argument("Invalid read-your-writes window");
+    }
+}
+
+void Config::set_kdf_threads(int kdf_threads) {
+    if (validate_kdf_threads(kdf_threads)) {
+        m_kdf_threads = kdf_threads;
+    } else {
+        throw std::invalid_argument("Invalid KDF thread count");
+    }
+}
+
+void Config::set_log_level(int log_level) {
+    if (validate_log_level(log_level)) {
+        m_log_level = log_level;
+    } else {
+        throw std::invalid_argument("Invalid log level");
+    }
+}
+
+void Config::set_access_sample(int access_sample) {
+    if (validate_access_sample(access_sample)) {
+        m_access_sample = access_sample;
+    } else {
+        throw std::invalid_argument("Invalid access log sample rate");
+    }
+}
+
+void Config::set_slow_request_ms(int slow_request_ms) {
+    if (validate_slow_request_ms(slow_request_ms)) {
+        m_slow_request_ms = slow_request_ms;
+    } else {
+        throw std::invalid_argument("Invalid slow request threshold");
+    }
+}
+
+void Config::set_user_store(const std::string& user_store) {
+    if (validate_user_store(user_store)) {
+        m_user_store = user_store;
+    } else {
+        throw std::invalid_argument("Invalid user store");
+    }
+}
+
+void Config::set_capture_file(const std::string& capture_file) {
+    if (validate_capture_file(capture_file)) {
+        m_capture_file = capture_file;
+    } else {
+        throw std::invalid_argument("Invalid capture file");
+    }
 }
\ No newline at end of file
@@ -37,6 +37,15 @@ public:
     int get_thread_num() const { return m_thread_num; }
     int get_close_log() const { return m_close_log; }
     int get_actor_model() const { return m_actor_model; }
+    int get_sql_affine() const { return m_sql_affine; }
+    const std::string& get_sql_replicas() const { return m_sql_replicas; }
+    int get_read_your_writes_ms() const { return m_read_your_writes_ms; }
+    int get_kdf_threads() const { return m_kdf_threads; }
+    int get_log_level() const { return m_log_level; }
+    int get_access_sample() const { return m_access_sample; }
+    int get_slow_request_ms() const { return m_slow_request_ms; }
+    const std::string& get_user_store() const { return m_user_store; }
+    const std::string& get_capture_file() const { return m_capture_file; }
 
     // 配置参数设置器
     void set_port(int port);
@@ -47,6 +56,15 @@ public:
     void set_thread_num(int thread_num);
     void set_close_log(int close_log);
     void set_actor_model(int actor_model);
+    void set_sql_affine(int sql_affine);
+    void set_sql_replicas(const std::string& sql_replicas);
+    void set_read_your_writes_ms(int read_your_writes_ms);
+    void set_kdf_threads(int kdf_threads);
+    void set_log_level(int log_level);
+    void set_access_sample(int access_sample);
+    void set_slow_request_ms(int slow_request_ms);
+    void set_user_store(const std::string& user_store);
+    void set_capture_file(const std::string& capture_file);
 
 private:
     // 配置参数
@@ -60,6 +78,22 @@ private:
     int m_thread_num;
     int m_close_log;
     int m_actor_model;
+    int m_sql_affine;
+    // 只读从库列表，格式 host:port[,host:port...]
+    std::string m_sql_replicas;
+    int m_read_your_writes_ms;
+    // 密码散列线程数，0表示在工作线程中直接计算
+    int m_kdf_threads;
+    // 运行期最低日志级别 0:DEBUG 1:INFO 2:WARN 3:ERROR
+    int m_log_level;
+    // 访问日志采样: 每N个请求记录一个，0表示关闭；出错的请求总是记录
+    int m_access_sample;
+    // 超过该耗时(毫秒)的请求记录完整时间线，0表示关闭
+    int m_slow_request_ms;
+    // 用户表后端: mysql，或压测用的内存实现 fake[:rows=N,latency_us=N,jitter_us=N,password=P]
+    std::string m_user_store;
+    // 抓取原始请求流量的文件，空表示关闭
+    std::string m_capture_file;
 
     // 错误信息
     std::string m_error_message = "";
@@ -73,6 +107,15 @@ private:
     bool validate_thread_num(int thread_num) const;
     bool validate_close_log(int close_log) const;
     bool validate_actor_model(int actor_model) const;
+    bool validate_sql_affine(int sql_affine) const;
+    bool validate_sql_replicas(const std::string& sql_replicas) const;
+    bool validate_read_your_writes_ms(int read_your_writes_ms) const;
+    bool validate_kdf_threads(int kdf_threads) const;
+    bool validate_log_level(int log_level) const;
+    bool validate_access_sample(int access_sample) const;
+    bool validate_slow_request_ms(int slow_request_ms) const;
+    bool validate_user_store(const std::string& user_store) const;
+    bool validate_capture_file(const std::string& capture_file) const;
 
     // 默认值
     static constexpr int DEFAULT_PORT = 9000;
@@ -83,6 +126,12 @@ private:
     static constexpr int DEFAULT_THREAD_NUM = 8;
     static constexpr int DEFAULT_CLOSE_LOG = 0;
     static constexpr int DEFAULT_ACTOR_MODEL = 0;
+    static constexpr int DEFAULT_SQL_AFFINE = 0;
+    static constexpr int DEFAULT_READ_YOUR_WRITES_MS = 0;
+    static constexpr int DEFAULT_KDF_THREADS = 2;
+    static constexpr int DEFAULT_LOG_LEVEL = 1;
+    static constexpr int DEFAULT_ACCESS_SAMPLE = 1;
+    static constexpr int DEFAULT_SLOW_REQUEST_MS = 1000;
 
     // 参数范围
     static constexpr int MIN_PORT = 1024;
@@ -91,6 +140,10 @@ private:
     static constexpr int MAX_SQL_NUM = 100;
     static constexpr int MIN_THREAD_NUM = 1;
     static constexpr int MAX_THREAD_NUM = 100;
+    static constexpr int MAX_READ_YOUR_WRITES_MS = 60000;
+    static constexpr int MAX_ACCESS_SAMPLE = 1000000;
+    static constexpr int MAX_SLOW_REQUEST_MS = 600000;
+    static constexpr size_t MAX_PATH_LEN = 255;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include "login_cache.h"
+
+#include <sys/random.h>
+#include <time.h>
+#include <tuple>
+#include <unistd.h>
+
+#include "../../utils/timer/monotonic.h"
+
+LoginCache::LoginCache()
+    : m_capacity_per_shard(0)
+    , m_positive_ttl_us(0)
+    , m_negative_ttl_us(0) {
+    if (getrandom(&m_key, sizeof(m_key), 0) != (ssize_t)sizeof(m_key)) {
+        // Without the entropy pool the key only needs to differ per process
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        m_key.k0 = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        m_key.k1 = (uint64_t)(uintptr_t)this ^ ((uint64_t)getpid() << 32);
+    }
+}
+
+LoginCache* LoginCache::get_instance() {
+    static LoginCache cache;
+    return &cache;
+}
+
+void LoginCache::init(size_t capacity, int positive_ttl_s, int negative_ttl_s) {
+    clear();
+    m_capacity_per_shard = capacity == 0 ? 0 : (capacity + SHARDS - 1) / SHARDS;
+    m_positive_ttl_us = (uint64_t)positive_ttl_s * 1000000;
+    m_negative_ttl_us = (uint64_t)negative_ttl_s * 1000000;
+}
+
+LoginCache::Shard& LoginCache::shard_for(const std::string& username) {
+    return m_shards[siphash24(m_key, username.data(), username.size()) % SHARDS];
+}
+
+uint64_t LoginCache::credential_hash(const std::string& username, const std::string& password) const {
+    // The username is mixed in so equal passwords do not produce equal entries
+    std::string input;
+    input.reserve(username.size() + 1 + password.size());
+    input.append(username);
+    input.push_back('\0');
+    input.append(password);
+    return siphash24(m_key, input.data(), input.size());
+}
+
+LoginCache::Result LoginCache::lookup(const std::string& username, const std::string& password) {
+    if (!enabled()) {
+        return MISS;
+    }
+    Shard& shard = shard_for(username);
+    uint64_t now = monotonic::coarse_now_us();
+
+    shard.lock.rdlock();
+    auto it = shard.entries.find(username);
+    if (it == shard.entries.end() || it->second.expires_us <= now) {
+        shard.lock.unlock();
+        ++shard.misses;
+        return MISS;
+    }
+    Entry& entry = it->second;
+    if (!entry.referenced.load(std::memory_order_relaxed)) {
+        entry.referenced.store(true, std::memory_order_relaxed);
+    }
+    bool positive = entry.positive;
+    uint64_t credential = entry.credential;
+    shard.lock.unlock();
+
+    if (!positive) {
+        ++shard.negative_hits;
+        return HIT_INVALID;
+    }
+    ++shard.positive_hits;
+    return credential == credential_hash(username, password) ? HIT_VALID : HIT_INVALID;
+}
+
+void LoginCache::store_positive(const std::string& username, const std::string& password) {
+    if (enabled() && m_positive_ttl_us > 0) {
+        insert(username, credential_hash(username, password), true);
+    }
+}
+
+void LoginCache::store_negative(const std::string& username) {
+    if (enabled() && m_negative_ttl_us > 0) {
+        insert(username, 0, false);
+    }
+}
+
+void LoginCache::insert(const std::string& username, uint64_t credential, bool positive) {
+    Shard& shard = shard_for(username);
+    uint64_t now = monotonic::coarse_now_us();
+    uint64_t expires = now + (positive ? m_positive_ttl_us : m_negative_ttl_us);
+
+    shard.lock.wrlock();
+    auto it = shard.entries.find(username);
+    if (it != shard.entries.end()) {
+        it->second.credential = credential;
+        it->second.expires_us = expires;
+        it->second.positive = positive;
+    } else {
+        make_room(shard, now);
+        shard.entries.emplace(std::piecewise_construct,
+                              std::forward_as_tuple(username),
+                              std::forward_as_tuple(credential, expires, positive));
+        shard.order.push_back(username);
+    }
+    shard.lock.unlock();
+    ++shard.inserts;
+}
+
+// Caller holds the shard's write lock
+void LoginCache::make_room(Shard& shard, uint64_t now) {
+    // invalidate() leaves names behind in the order queue; rebuild it before
+    // it grows far past the live entries
+    if (shard.order.size() > 2 * m_capacity_per_shard) {
+        shard.order.clear();
+        for (const auto& kv : shard.entries) {
+            shard.order.push_back(kv.first);
+        }
+    }
+
+    while (shard.entries.size() >= m_capacity_per_shard && !shard.order.empty()) {
+        std::string name = std::move(shard.order.front());
+        shard.order.pop_front();
+        auto it = shard.entries.find(name);
+        if (it == shard.entries.end()) {
+            continue;
+        }
+        // Second chance: an entry read since the last pass goes to the back
+        if (it->second.expires_us > now && it->second.referenced.load(std::memory_order_relaxed)) {
+            it->second.referenced.store(false, std::memory_order_relaxed);
+            shard.order.push_back(std::move(name));
+            continue;
+        }
+        shard.entries.erase(it);
+        ++shard.evictions;
+    }
+}
+
+void LoginCache::invalidate(const std::string& username) {
+    if (!enabled()) {
+        return;
+    }
+    Shard& shard = shard_for(username);
+    shard.lock.wrlock();
+    size_t erased = shard.entries.erase(username);
+    shard.lock.unlock();
+    if (erased) {
+        ++shard.invalidations;
+    }
+}
+
+void LoginCache::clear() {
+    for (int i = 0; i < SHARDS; ++i) {
+        m_shards[i].lock.wrlock();
+        m_shards[i].entries.clear();
+        m_shards[i].order.clear();
+        m_shards[i].lock.unlock();
+    }
+}
+
+LoginCache::Stats LoginCache::get_stats() const {
+    Stats stats = Stats();
+    for (int i = 0; i < SHARDS; ++i) {
+        const Shard& shard = m_shards[i];
+        stats.positive_hits += shard.positive_hits;
+        stats.negative_hits += shard.negative_hits;
+        stats.misses += shard.misses;
+        stats.inserts += shard.inserts;
+        stats.evictions += shard.evictions;
+        stats.invalidations += shard.invalidations;
+        shard.lock.rdlock();
+        stats.entries += shard.entries.size();
+        shard.lock.unlock();
+    }
+    return stats;
+}
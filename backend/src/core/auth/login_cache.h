@@ -0,0 +1,107 @@
+#ifndef LOGIN_CACHE_H
+#define LOGIN_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+#include "../../utils/hash/siphash.h"
+#include "../../utils/lock/locker.h"
+
+// Recent authentication outcomes keyed by username, so repeated logins for
+// hot accounts (and repeated failures for unknown ones) skip the user store.
+//
+// A positive entry holds a SipHash of the password that last verified, keyed
+// with a per-process random key; the plaintext is never kept. A negative entry
+// records that the user does not exist. The cache is split into shards, each
+// behind a read-write lock, so lookups for different or the same hot users
+// proceed in parallel. Each shard evicts with a second-chance FIFO once full.
+class LoginCache {
+public:
+    enum Result {
+        MISS = 0,
+        HIT_VALID,    // password matches the cached credential
+        HIT_INVALID   // wrong password, or the user is known not to exist
+    };
+
+    struct Stats {
+        uint64_t positive_hits;
+        uint64_t negative_hits;
+        uint64_t misses;
+        uint64_t inserts;
+        uint64_t evictions;
+        uint64_t invalidations;
+        size_t entries;
+
+        double hit_rate() const {
+            uint64_t total = positive_hits + negative_hits + misses;
+            return total ? (double)(positive_hits + negative_hits) / total : 0.0;
+        }
+    };
+
+    static LoginCache* get_instance();
+
+    // capacity == 0 disables the cache: lookup() always misses
+    void init(size_t capacity, int positive_ttl_s, int negative_ttl_s);
+    bool enabled() const { return m_capacity_per_shard > 0; }
+
+    Result lookup(const std::string& username, const std::string& password);
+    // `password` has just been verified against the user store
+    void store_positive(const std::string& username, const std::string& password);
+    // The user store has no such user
+    void store_negative(const std::string& username);
+    // Drops whatever is cached for `username` (registration, password change)
+    void invalidate(const std::string& username);
+
+    Stats get_stats() const;
+    void clear();
+
+private:
+    static const int SHARDS = 16;
+
+    struct Entry {
+        uint64_t credential;   // 0 for negative entries
+        uint64_t expires_us;
+        bool positive;
+        // Set by readers under the shared lock, cleared by the evictor
+        std::atomic<bool> referenced;
+
+        Entry(uint64_t cred, uint64_t expires, bool pos)
+            : credential(cred), expires_us(expires), positive(pos), referenced(false) {}
+    };
+
+    struct alignas(64) Shard {
+        mutable locker::RWLock lock;
+        std::unordered_map<std::string, Entry> entries;
+        // Eviction order; may hold names already removed by invalidate()
+        std::deque<std::string> order;
+
+        std::atomic<uint64_t> positive_hits{0};
+        std::atomic<uint64_t> negative_hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> inserts{0};
+        std::atomic<uint64_t> evictions{0};
+        std::atomic<uint64_t> invalidations{0};
+    };
+
+    LoginCache();
+    ~LoginCache() {}
+    LoginCache(const LoginCache&) = delete;
+    LoginCache& operator=(const LoginCache&) = delete;
+
+    Shard& shard_for(const std::string& username);
+    uint64_t credential_hash(const std::string& username, const std::string& password) const;
+    void insert(const std::string& username, uint64_t credential, bool positive);
+    void make_room(Shard& shard, uint64_t now);
+
+    Shard m_shards[SHARDS];
+    SipKey m_key;
+    size_t m_capacity_per_shard;
+    uint64_t m_positive_ttl_us;
+    uint64_t m_negative_ttl_us;
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "password_hasher.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+static const char* PREFIX = "pbkdf2_sha256$";
+static const size_t SALT_BYTES = 16;
+static const size_t HASH_BYTES = 32;
+// Queued KDF work runs below the request workers' priority
+static const int KDF_NICE = 5;
+
+static std::string to_hex(const unsigned char* data, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    std::string out(len * 2, '0');
+    for (size_t i = 0; i < len; ++i) {
+        out[2 * i] = hex[data[i] >> 4];
+        out[2 * i + 1] = hex[data[i] & 0x0f];
+    }
+    return out;
+}
+
+static bool from_hex(const std::string& text, unsigned char* out, size_t len) {
+    if (text.size() != len * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        int value = 0;
+        for (int j = 0; j < 2; ++j) {
+            char c = text[2 * i + j];
+            int digit;
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                digit = c - 'a' + 10;
+            } else {
+                return false;
+            }
+            value = value * 16 + digit;
+        }
+        out[i] = (unsigned char)value;
+    }
+    return true;
+}
+
+PasswordHasher::PasswordHasher()
+    : m_iterations(DEFAULT_ITERATIONS) {
+}
+
+PasswordHasher* PasswordHasher::get_instance() {
+    static PasswordHasher hasher;
+    return &hasher;
+}
+
+bool PasswordHasher::init(int iterations, int threads, int max_pending) {
+    m_iterations = iterations > 0 ? iterations : DEFAULT_ITERATIONS;
+    m_pool.reset();
+    if (threads <= 0) {
+        return true;
+    }
+    try {
+        m_pool.reset(new ComputePool("kdf", threads, max_pending, KDF_NICE));
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+void PasswordHasher::stop() {
+    m_pool.reset();
+}
+
+bool PasswordHasher::derive(const std::string& password, const unsigned char* salt, size_t salt_len,
+                            int iterations, unsigned char* out, size_t out_len) const {
+    return PKCS5_PBKDF2_HMAC(password.data(), (int)password.size(), salt, (int)salt_len,
+                             iterations, EVP_sha256(), (int)out_len, out) == 1;
+}
+
+std::string PasswordHasher::hash(const std::string& password) const {
+    unsigned char salt[SALT_BYTES];
+    unsigned char digest[HASH_BYTES];
+    if (RAND_bytes(salt, sizeof(salt)) != 1 ||
+        !derive(password, salt, sizeof(salt), m_iterations, digest, sizeof(digest))) {
+        return "";
+    }
+    return std::string(PREFIX) + std::to_string(m_iterations) + "$" + to_hex(salt, sizeof(salt)) +
+           "$" + to_hex(digest, sizeof(digest));
+}
+
+bool PasswordHasher::verify(const std::string& password, const std::string& stored,
+                            bool* needs_upgrade) const {
+    size_t prefix_len = strlen(PREFIX);
+    if (stored.compare(0, prefix_len, PREFIX) != 0) {
+        // Legacy plaintext row
+        bool ok = stored.size() == password.size() &&
+                  CRYPTO_memcmp(stored.data(), password.data(), stored.size()) == 0;
+        if (needs_upgrade) {
+            *needs_upgrade = ok;
+        }
+        return ok;
+    }
+
+    size_t iter_end = stored.find('$', prefix_len);
+    size_t salt_end = iter_end == std::string::npos ? iter_end : stored.find('$', iter_end + 1);
+    if (salt_end == std::string::npos) {
+        return false;
+    }
+    int iterations = atoi(stored.c_str() + prefix_len);
+    unsigned char salt[SALT_BYTES];
+    unsigned char expected[HASH_BYTES];
+    unsigned char digest[HASH_BYTES];
+    if (iterations <= 0 ||
+        !from_hex(stored.substr(iter_end + 1, salt_end - iter_end - 1), salt, sizeof(salt)) ||
+        !from_hex(stored.substr(salt_end + 1), expected, sizeof(expected)) ||
+        !derive(password, salt, sizeof(salt), iterations, digest, sizeof(digest))) {
+        return false;
+    }
+    bool ok = CRYPTO_memcmp(digest, expected, sizeof(digest)) == 0;
+    if (needs_upgrade) {
+        *needs_upgrade = ok && iterations < m_iterations;
+    }
+    return ok;
+}
+
+bool PasswordHasher::hash_async(const std::string& password, HashCallback cb) {
+    if (!m_pool) {
+        cb(hash(password));
+        return true;
+    }
+    return m_pool->submit([this, password, cb]() {
+        cb(hash(password));
+    });
+}
+
+bool PasswordHasher::verify_async(const std::string& password, const std::string& stored, VerifyCallback cb) {
+    auto task = [this, password, stored, cb]() {
+        bool needs_upgrade = false;
+        bool ok = verify(password, stored, &needs_upgrade);
+        // Still on the KDF thread, so re-hashing here costs no request worker
+        cb(ok, needs_upgrade ? hash(password) : std::string());
+    };
+    if (!m_pool) {
+        task();
+        return true;
+    }
+    return m_pool->submit(task);
+}
@@ -0,0 +1,58 @@
+#ifndef PASSWORD_HASHER_H
+#define PASSWORD_HASHER_H
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "../../utils/threadpool/compute_pool.h"
+
+// Salted PBKDF2-HMAC-SHA256 password hashing. Stored values look like
+//   pbkdf2_sha256$<iterations>$<salt hex>$<hash hex>
+// (about 120 characters, so user.passwd must be at least VARCHAR(128)).
+// Values without that prefix are legacy plaintext rows: they still verify,
+// and verification reports them for re-hashing.
+//
+// The *_async variants run on a dedicated ComputePool and invoke the
+// callback on one of its threads; they return false when the pool's queue
+// is full so the caller can answer 503 instead of piling up work.
+class PasswordHasher {
+public:
+    typedef std::function<void(const std::string& encoded)> HashCallback;
+    // `upgraded` is non-empty when the stored value should be replaced by it
+    typedef std::function<void(bool ok, const std::string& upgraded)> VerifyCallback;
+
+    static const int DEFAULT_ITERATIONS = 100000;
+
+    static PasswordHasher* get_instance();
+
+    // threads == 0 keeps all hashing on the caller's thread
+    bool init(int iterations, int threads, int max_pending);
+    void stop();
+    bool is_async() const { return m_pool != nullptr; }
+    const ComputePool* get_pool() const { return m_pool.get(); }
+
+    // Returns an empty string if no salt could be generated
+    std::string hash(const std::string& password) const;
+    // `needs_upgrade` is set for plaintext rows and rows hashed with fewer
+    // iterations than currently configured
+    bool verify(const std::string& password, const std::string& stored,
+                bool* needs_upgrade = nullptr) const;
+
+    bool hash_async(const std::string& password, HashCallback cb);
+    bool verify_async(const std::string& password, const std::string& stored, VerifyCallback cb);
+
+private:
+    PasswordHasher();
+    ~PasswordHasher() {}
+    PasswordHasher(const PasswordHasher&) = delete;
+    PasswordHasher& operator=(const PasswordHasher&) = delete;
+
+    bool derive(const std::string& password, const unsigned char* salt, size_t salt_len,
+                int iterations, unsigned char* out, size_t out_len) const;
+
+    int m_iterations;
+    std::unique_ptr<ComputePool> m_pool;
+};
+
+#endif
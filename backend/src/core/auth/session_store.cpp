@@ -0,0 +1,360 @@
+#include "session_store.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../../utils/log/log.h"
+
+static const char* SNAPSHOT_MAGIC = "tws-sessions 1";
+
+static bool is_token(const std::string& token) {
+    if (token.size() != SessionStore::TOKEN_BYTES * 2) {
+        return false;
+    }
+    for (char c : token) {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Compares without an early exit so response time does not reveal how many
+// leading characters of a guessed token were right
+static bool equal_tokens(const std::string& a, const std::string& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        diff |= (unsigned char)(a[i] ^ b[i]);
+    }
+    return diff == 0;
+}
+
+SessionStore::SessionStore()
+    : m_ttl_s(0)
+    , m_dirty(false)
+    , m_snapshot_seq(0)
+    , m_written_seq(0)
+    , m_has_pending(false)
+    , m_pending_seq(0)
+    , m_stop(false)
+    , m_thread_running(false) {
+    if (getrandom(&m_key, sizeof(m_key), 0) != (ssize_t)sizeof(m_key)) {
+        m_key.k0 = (uint64_t)time(nullptr);
+        m_key.k1 = (uint64_t)(uintptr_t)this ^ ((uint64_t)getpid() << 32);
+    }
+}
+
+// A write still queued here is dropped: shutdown saves synchronously first
+SessionStore::~SessionStore() {
+    m_pending_lock.lock();
+    m_stop = true;
+    m_pending_cond.signal();
+    m_pending_lock.unlock();
+    if (m_thread_running) {
+        pthread_join(m_thread, nullptr);
+    }
+}
+
+SessionStore* SessionStore::get_instance() {
+    static SessionStore store;
+    return &store;
+}
+
+void SessionStore::init(int ttl_s) {
+    m_ttl_s = ttl_s;
+}
+
+uint64_t SessionStore::key_of(const std::string& token) const {
+    return siphash24(m_key, token.data(), token.size());
+}
+
+std::string SessionStore::create(const std::string& username) {
+    unsigned char raw[TOKEN_BYTES];
+    if (getrandom(raw, sizeof(raw), 0) != (ssize_t)sizeof(raw)) {
+        return "";
+    }
+    static const char hex[] = "0123456789abcdef";
+    std::string token(TOKEN_BYTES * 2, '0');
+    for (int i = 0; i < TOKEN_BYTES; ++i) {
+        token[2 * i] = hex[raw[i] >> 4];
+        token[2 * i + 1] = hex[raw[i] & 0x0f];
+    }
+    if (!insert(token, username, time(nullptr) + m_ttl_s)) {
+        return "";
+    }
+    return token;
+}
+
+bool SessionStore::insert(const std::string& token, const std::string& username, time_t expires) {
+    uint64_t key = key_of(token);
+    Shard& shard = m_shards[key % SHARDS];
+
+    shard.lock.wrlock();
+    bool inserted = shard.sessions.find(key) == shard.sessions.end();
+    if (inserted) {
+        Session& session = shard.sessions[key];
+        session.token = token;
+        session.username = username;
+        session.expires = expires;
+        Expiry item = {key, expires};
+        shard.expiry.push_back(item);
+    }
+    shard.lock.unlock();
+
+    if (inserted) {
+        m_dirty = true;
+    }
+    return inserted;
+}
+
+bool SessionStore::validate(const std::string& token, std::string* username) {
+    if (!is_token(token)) {
+        return false;
+    }
+    uint64_t key = key_of(token);
+    Shard& shard = m_shards[key % SHARDS];
+    time_t now = time(nullptr);
+
+    bool ok = false;
+    shard.lock.rdlock();
+    auto it = shard.sessions.find(key);
+    if (it != shard.sessions.end() && it->second.expires > now &&
+        equal_tokens(it->second.token, token)) {
+        ok = true;
+        if (username) {
+            *username = it->second.username;
+        }
+    }
+    shard.lock.unlock();
+    return ok;
+}
+
+void SessionStore::revoke(const std::string& token) {
+    if (!is_token(token)) {
+        return;
+    }
+    uint64_t key = key_of(token);
+    Shard& shard = m_shards[key % SHARDS];
+
+    shard.lock.wrlock();
+    auto it = shard.sessions.find(key);
+    bool erased = it != shard.sessions.end() && equal_tokens(it->second.token, token);
+    if (erased) {
+        // The expiry queue entry is skipped when it reaches the front
+        shard.sessions.erase(it);
+    }
+    shard.lock.unlock();
+
+    if (erased) {
+        m_dirty = true;
+    }
+}
+
+size_t SessionStore::expire(time_t now) {
+    size_t removed = 0;
+    for (int i = 0; i < SHARDS; ++i) {
+        Shard& shard = m_shards[i];
+        shard.lock.wrlock();
+        while (!shard.expiry.empty() && shard.expiry.front().expires <= now) {
+            Expiry item = shard.expiry.front();
+            shard.expiry.pop_front();
+            auto it = shard.sessions.find(item.key);
+            if (it != shard.sessions.end() && it->second.expires == item.expires) {
+                shard.sessions.erase(it);
+                ++removed;
+            }
+        }
+        shard.lock.unlock();
+    }
+    if (removed) {
+        m_dirty = true;
+    }
+    return removed;
+}
+
+size_t SessionStore::size() const {
+    size_t total = 0;
+    for (int i = 0; i < SHARDS; ++i) {
+        m_shards[i].lock.rdlock();
+        total += m_shards[i].sessions.size();
+        m_shards[i].lock.unlock();
+    }
+    return total;
+}
+
+std::string SessionStore::collect() const {
+    std::string data = SNAPSHOT_MAGIC;
+    data += '\n';
+    time_t now = time(nullptr);
+    char expires[32];
+    for (int i = 0; i < SHARDS; ++i) {
+        const Shard& shard = m_shards[i];
+        shard.lock.rdlock();
+        for (const auto& kv : shard.sessions) {
+            const Session& session = kv.second;
+            if (session.expires <= now || session.username.find('\n') != std::string::npos) {
+                continue;
+            }
+            snprintf(expires, sizeof(expires), " %lld ", (long long)session.expires);
+            data += session.token;
+            data += expires;
+            data += session.username;
+            data += '\n';
+        }
+        shard.lock.unlock();
+    }
+    return data;
+}
+
+bool SessionStore::write_file(const std::string& path, const std::string& data, uint64_t seq) {
+    locker::LockGuard guard(m_write_lock);
+    if (seq < m_written_seq) {
+        return true;
+    }
+
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = true;
+    size_t off = 0;
+    while (ok && off < data.size()) {
+        ssize_t n = write(fd, data.data() + off, data.size() - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = n > 0;
+        off += ok ? (size_t)n : 0;
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        int err = errno;
+        unlink(tmp.c_str());
+        errno = err;
+        return false;
+    }
+    m_written_seq = seq;
+    return true;
+}
+
+bool SessionStore::snapshot(const std::string& path) {
+    if (!m_dirty.exchange(false)) {
+        return true;
+    }
+    uint64_t seq = ++m_snapshot_seq;
+    if (!write_file(path, collect(), seq)) {
+        m_dirty = true;
+        return false;
+    }
+    return true;
+}
+
+void SessionStore::snapshot_async(const std::string& path) {
+    if (!m_dirty.exchange(false)) {
+        return;
+    }
+    uint64_t seq = ++m_snapshot_seq;
+    std::string data = collect();
+
+    locker::LockGuard guard(m_pending_lock);
+    if (!m_thread_running) {
+        if (pthread_create(&m_thread, nullptr, writer_thread, this) != 0) {
+            LOG_ERROR("%s", "Failed to start session snapshot writer");
+            m_dirty = true;
+            return;
+        }
+        m_thread_running = true;
+    }
+    m_pending_path = path;
+    m_pending_data.swap(data);
+    m_pending_seq = seq;
+    m_has_pending = true;
+    m_pending_cond.signal();
+}
+
+void* SessionStore::writer_thread(void* arg) {
+    static_cast<SessionStore*>(arg)->run_writer();
+    return nullptr;
+}
+
+void SessionStore::run_writer() {
+    while (true) {
+        m_pending_lock.lock();
+        while (!m_has_pending && !m_stop) {
+            m_pending_cond.wait(m_pending_lock);
+        }
+        if (m_stop) {
+            m_pending_lock.unlock();
+            return;
+        }
+        std::string path, data;
+        path.swap(m_pending_path);
+        data.swap(m_pending_data);
+        uint64_t seq = m_pending_seq;
+        m_has_pending = false;
+        m_pending_lock.unlock();
+
+        if (!write_file(path, data, seq)) {
+            LOG_ERROR("Failed to write session snapshot %s, errno is:%d", path.c_str(), errno);
+            m_dirty = true;
+        }
+    }
+}
+
+int SessionStore::restore(const std::string& path) {
+    FILE* fp = fopen(path.c_str(), "r");
+    if (!fp) {
+        return 0;
+    }
+
+    char line[1024];
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    std::vector<Session> loaded;
+    time_t now = time(nullptr);
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        char* space1 = strchr(line, ' ');
+        char* space2 = space1 ? strchr(space1 + 1, ' ') : nullptr;
+        if (!space2) {
+            continue;
+        }
+        Session session;
+        session.token.assign(line, space1 - line);
+        session.expires = (time_t)atoll(space1 + 1);
+        session.username = space2 + 1;
+        if (is_token(session.token) && session.expires > now) {
+            loaded.push_back(session);
+        }
+    }
+    fclose(fp);
+
+    // Keep each shard's expiry queue ordered
+    std::sort(loaded.begin(), loaded.end(), [](const Session& a, const Session& b) {
+        return a.expires < b.expires;
+    });
+    int count = 0;
+    for (const Session& session : loaded) {
+        if (insert(session.token, session.username, session.expires)) {
+            ++count;
+        }
+    }
+    // What was just read is what is on disk
+    m_dirty = false;
+    return count;
+}
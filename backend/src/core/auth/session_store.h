@@ -0,0 +1,112 @@
+#ifndef SESSION_STORE_H
+#define SESSION_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <pthread.h>
+
+#include "../../utils/hash/siphash.h"
+#include "../../utils/lock/locker.h"
+
+// In-memory login sessions. login issues a random bearer token, and later
+// requests present it through an "Authorization: Bearer" header or the
+// "session" cookie; validate() is one hash lookup plus a constant-time compare,
+// so authenticated APIs never touch the credential store.
+//
+// Sessions have a fixed lifetime, so each shard's issue order is also its
+// expiry order and expire() (driven by the server's SIGALRM tick) only looks at
+// the front of each queue. snapshot()/restore() keep sessions across restarts.
+class SessionStore {
+public:
+    static const int TOKEN_BYTES = 32;   // hex encoded, 64 characters on the wire
+
+    static SessionStore* get_instance();
+
+    void init(int ttl_s);
+    int get_ttl() const { return m_ttl_s; }
+
+    // Returns an empty string if no randomness was available
+    std::string create(const std::string& username);
+    bool validate(const std::string& token, std::string* username = nullptr);
+    void revoke(const std::string& token);
+    // Drops sessions whose lifetime ended before `now`; returns how many
+    size_t expire(time_t now);
+
+    // Writes live sessions to `path` (atomically, mode 0600) if anything changed
+    // since the last snapshot. Tokens are bearer credentials, so the file must
+    // stay private to the server.
+    bool snapshot(const std::string& path);
+    // Like snapshot(), but only copying the sessions happens on the calling
+    // thread; a background writer formats, fsyncs and renames the file so the
+    // event loop never waits on the disk. Failures are logged and leave the
+    // store dirty, so the next snapshot retries.
+    void snapshot_async(const std::string& path);
+    // Loads sessions saved by snapshot(), skipping expired ones; returns how many
+    int restore(const std::string& path);
+
+    size_t size() const;
+
+private:
+    static const int SHARDS = 16;
+
+    struct Session {
+        std::string token;
+        std::string username;
+        time_t expires;
+    };
+
+    struct Expiry {
+        uint64_t key;
+        time_t expires;
+    };
+
+    struct alignas(64) Shard {
+        mutable locker::RWLock lock;
+        // Keyed by SipHash of the token; the full token is compared on lookup
+        std::unordered_map<uint64_t, Session> sessions;
+        std::deque<Expiry> expiry;
+    };
+
+    SessionStore();
+    ~SessionStore();
+    SessionStore(const SessionStore&) = delete;
+    SessionStore& operator=(const SessionStore&) = delete;
+
+    uint64_t key_of(const std::string& token) const;
+    bool insert(const std::string& token, const std::string& username, time_t expires);
+    // Formats the live sessions, one shard lock at a time
+    std::string collect() const;
+    // Returns true without writing if a newer snapshot is already on disk
+    bool write_file(const std::string& path, const std::string& data, uint64_t seq);
+    static void* writer_thread(void* arg);
+    void run_writer();
+
+    Shard m_shards[SHARDS];
+    SipKey m_key;
+    int m_ttl_s;
+    std::atomic<bool> m_dirty;
+
+    // Snapshots are numbered when copied, so a slow background write can
+    // never replace a newer file written synchronously at shutdown
+    std::atomic<uint64_t> m_snapshot_seq;
+    locker::Mutex m_write_lock;
+    uint64_t m_written_seq;
+
+    // At most one write is queued; a newer copy replaces it
+    locker::Mutex m_pending_lock;
+    locker::ConditionVariable m_pending_cond;
+    bool m_has_pending;
+    std::string m_pending_path;
+    std::string m_pending_data;
+    uint64_t m_pending_seq;
+    bool m_stop;
+    pthread_t m_thread;
+    bool m_thread_running;
+};
+
+#endif
@@ -0,0 +1,423 @@
+#include "user_store.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <stdexcept>
+
+#include "../../third_party/async_sql.h"
+#include "../../third_party/sql_connection_pool.h"
+#include "../../utils/log/log.h"
+#include "../../utils/timer/monotonic.h"
+#include "password_hasher.h"
+
+UserStore* UserStore::create(const std::string& spec, ConnectionPool* pool) {
+    if (spec == "mysql") {
+        return new MySqlUserStore(pool);
+    }
+    FakeUserStore::Options options;
+    if (!FakeUserStore::parse_options(spec, &options)) {
+        return nullptr;
+    }
+    return new FakeUserStore(options);
+}
+
+bool UserStore::is_valid_spec(const std::string& spec) {
+    FakeUserStore::Options options;
+    return spec == "mysql" || FakeUserStore::parse_options(spec, &options);
+}
+
+// ---- MySqlUserStore ----
+
+// Escapes `value` for a single-quoted literal on `conn`. The client library
+// follows the connection's charset (so a multibyte lead byte cannot swallow
+// the backslash) and its sql_mode (NO_BACKSLASH_ESCAPES doubles the quote).
+static bool escape_sql(MYSQL* conn, const std::string& value, std::string* out) {
+    out->resize(value.size() * 2 + 1);
+    unsigned long len = mysql_real_escape_string_quote(conn, &(*out)[0], value.data(), value.size(), '\'');
+    if (len == (unsigned long)-1) {
+        LOG_ERROR("escape error:%s", mysql_error(conn));
+        return false;
+    }
+    out->resize(len);
+    return true;
+}
+
+// Empty on failure, which the async executor treats as a failed query
+static std::string build_insert_user(MYSQL* conn, const std::string& username, const std::string& stored) {
+    std::string name, passwd;
+    if (!escape_sql(conn, username, &name) || !escape_sql(conn, stored, &passwd)) {
+        return "";
+    }
+    return "INSERT INTO user(username, passwd) VALUES('" + name + "', '" + passwd + "')";
+}
+
+static std::string build_update_user(MYSQL* conn, const std::string& username, const std::string& stored) {
+    std::string name, passwd;
+    if (!escape_sql(conn, username, &name) || !escape_sql(conn, stored, &passwd)) {
+        return "";
+    }
+    return "UPDATE user SET passwd='" + passwd + "' WHERE username='" + name + "'";
+}
+
+bool MySqlUserStore::load_all(const RowCallback& fn) {
+    // A full read-only scan, so a replica can serve it
+    MYSQL* mysql = nullptr;
+    ConnectionRAII mysqlcon(&mysql, m_pool, ConnectionPool::Route::READ);
+    if (!mysql) {
+        LOG_ERROR("%s", "load_all: no database connection available");
+        return false;
+    }
+
+    if (mysql_query(mysql, "SELECT username, passwd FROM user")) {
+        LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
+        return false;
+    }
+
+    MYSQL_RES* result = mysql_store_result(mysql);
+    if (!result) {
+        return false;
+    }
+
+    while (MYSQL_ROW row = mysql_fetch_row(result)) {
+        fn(row[0], row[1]);
+    }
+    mysql_free_result(result);
+    return true;
+}
+
+UserStore::Status MySqlUserStore::find(const std::string& username, std::string* stored) {
+    MYSQL* mysql = nullptr;
+    ConnectionRAII mysqlcon(&mysql, m_pool, ConnectionPool::Route::READ, username);
+    if (!mysql) {
+        return UNAVAILABLE;
+    }
+    std::string name;
+    if (!escape_sql(mysql, username, &name)) {
+        return FAILED;
+    }
+    std::string sql_select = "SELECT passwd FROM user WHERE username='" + name + "' LIMIT 1";
+    if (mysql_query(mysql, sql_select.c_str())) {
+        LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
+        return UNAVAILABLE;
+    }
+    MYSQL_RES* result = mysql_store_result(mysql);
+    if (!result) {
+        return FAILED;
+    }
+    MYSQL_ROW row = mysql_fetch_row(result);
+    *stored = (row && row[0]) ? row[0] : "";
+    mysql_free_result(result);
+    return row ? OK : NOT_FOUND;
+}
+
+UserStore::Status MySqlUserStore::insert(const std::string& username, const std::string& stored) {
+    MYSQL* mysql = nullptr;
+    ConnectionRAII mysqlcon(&mysql, m_pool);
+    if (!mysql) {
+        return UNAVAILABLE;
+    }
+
+    std::string sql_insert = build_insert_user(mysql, username, stored);
+    if (sql_insert.empty()) {
+        return FAILED;
+    }
+    if (mysql_query(mysql, sql_insert.c_str())) {
+        LOG_ERROR("INSERT error:%s\n", mysql_error(mysql));
+        return FAILED;
+    }
+    m_pool->note_write(username);
+    return OK;
+}
+
+bool MySqlUserStore::insert_async(const std::string& username, const std::string& stored, Callback cb) {
+    AsyncSqlExecutor* executor = AsyncSqlExecutor::get_instance();
+    if (!executor->is_running()) {
+        return false;
+    }
+    ConnectionPool* pool = m_pool;
+    return executor->submit(
+        [username, stored](MYSQL* conn) { return build_insert_user(conn, username, stored); },
+        [pool, username, cb](const AsyncSqlResult& res) {
+            if (res.ok) {
+                pool->note_write(username);
+            }
+            cb(res.ok ? OK : (res.timed_out ? UNAVAILABLE : FAILED));
+        });
+}
+
+void MySqlUserStore::update(const std::string& username, const std::string& stored) {
+    // Skipped while the executor is down
+    AsyncSqlExecutor* executor = AsyncSqlExecutor::get_instance();
+    AsyncSqlBuilder build = [username, stored](MYSQL* conn) {
+        return build_update_user(conn, username, stored);
+    };
+    if (executor->is_running() && executor->submit(build, [](const AsyncSqlResult&) {})) {
+        m_pool->note_write(username);
+    }
+}
+
+// ---- FakeUserStore ----
+
+static const char SYNTHETIC_PREFIX[] = "bench";
+
+bool FakeUserStore::parse_options(const std::string& spec, Options* options) {
+    if (spec.compare(0, 4, "fake") != 0) {
+        return false;
+    }
+    if (spec.size() == 4) {
+        return true;
+    }
+    if (spec[4] != ':') {
+        return false;
+    }
+    size_t begin = 5;
+    while (begin <= spec.size()) {
+        size_t end = spec.find(',', begin);
+        if (end == std::string::npos) {
+            end = spec.size();
+        }
+        std::string item = spec.substr(begin, end - begin);
+        size_t eq = item.find('=');
+        if (eq == std::string::npos || eq == 0) {
+            return false;
+        }
+        std::string key = item.substr(0, eq);
+        std::string value = item.substr(eq + 1);
+        if (key == "password") {
+            if (value.empty()) {
+                return false;
+            }
+            options->password = value;
+        } else {
+            char* rest = nullptr;
+            errno = 0;
+            long number = strtol(value.c_str(), &rest, 10);
+            if (value.empty() || *rest != '\0' || errno != 0 || number < 0) {
+                return false;
+            }
+            if (key == "rows") {
+                options->rows = number;
+            } else if (key == "latency_us" && number <= 10000000) {
+                options->latency_us = (int)number;
+            } else if (key == "jitter_us" && number <= 10000000) {
+                options->jitter_us = (int)number;
+            } else {
+                return false;
+            }
+        }
+        begin = end + 1;
+    }
+    return true;
+}
+
+FakeUserStore::FakeUserStore(const Options& options)
+    : m_options(options)
+    , m_stop(false)
+    , m_thread_running(false) {
+    if (m_options.rows > 0) {
+        m_synthetic_stored = PasswordHasher::get_instance()->hash(m_options.password);
+    }
+    if (pthread_create(&m_thread, nullptr, delay_thread, this) != 0) {
+        throw std::runtime_error("Failed to start fake user store thread");
+    }
+    m_thread_running = true;
+}
+
+FakeUserStore::~FakeUserStore() {
+    m_delay_lock.lock();
+    m_stop = true;
+    m_delay_cond.signal();
+    m_delay_lock.unlock();
+    if (m_thread_running) {
+        pthread_join(m_thread, nullptr);
+    }
+}
+
+FakeUserStore::Shard& FakeUserStore::shard_for(const std::string& username) {
+    return m_shards[std::hash<std::string>()(username) % SHARDS];
+}
+
+bool FakeUserStore::is_synthetic(const std::string& username) const {
+    size_t prefix = sizeof(SYNTHETIC_PREFIX) - 1;
+    if (username.size() <= prefix || username.size() > prefix + 18 ||
+        username.compare(0, prefix, SYNTHETIC_PREFIX) != 0) {
+        return false;
+    }
+    // No leading zeros, so each row has exactly one name
+    if (username[prefix] == '0' && username.size() > prefix + 1) {
+        return false;
+    }
+    long index = 0;
+    for (size_t i = prefix; i < username.size(); ++i) {
+        if (username[i] < '0' || username[i] > '9') {
+            return false;
+        }
+        index = index * 10 + (username[i] - '0');
+    }
+    return index < m_options.rows;
+}
+
+UserStore::Status FakeUserStore::do_find(const std::string& username, std::string* stored) {
+    Shard& shard = shard_for(username);
+    shard.lock.rdlock();
+    auto it = shard.users.find(username);
+    bool found = it != shard.users.end();
+    if (found) {
+        *stored = it->second;
+    }
+    shard.lock.unlock();
+    if (found) {
+        return OK;
+    }
+    if (is_synthetic(username)) {
+        *stored = m_synthetic_stored;
+        return OK;
+    }
+    return NOT_FOUND;
+}
+
+UserStore::Status FakeUserStore::do_insert(const std::string& username, const std::string& stored) {
+    if (is_synthetic(username)) {
+        return FAILED;
+    }
+    Shard& shard = shard_for(username);
+    shard.lock.wrlock();
+    bool inserted = shard.users.emplace(username, stored).second;
+    shard.lock.unlock();
+    return inserted ? OK : FAILED;
+}
+
+int64_t FakeUserStore::next_delay_us() {
+    if (m_options.jitter_us == 0) {
+        return m_options.latency_us;
+    }
+    // xorshift64, seeded per thread in creation order
+    static std::atomic<uint64_t> next_seed(1);
+    thread_local uint64_t state = 0x9e3779b97f4a7c15ULL * next_seed.fetch_add(1);
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return m_options.latency_us + (int64_t)(state % ((uint64_t)m_options.jitter_us + 1));
+}
+
+void FakeUserStore::sleep_latency() {
+    int64_t delay_us = next_delay_us();
+    if (delay_us <= 0) {
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = delay_us / 1000000;
+    ts.tv_nsec = (delay_us % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+bool FakeUserStore::schedule(std::function<void()> task) {
+    int64_t due_us = monotonic::now_us() + next_delay_us();
+    m_delay_lock.lock();
+    if (m_stop || m_delayed.size() >= MAX_PENDING) {
+        m_delay_lock.unlock();
+        return false;
+    }
+    bool earliest = m_delayed.empty() || due_us < m_delayed.begin()->first;
+    m_delayed.emplace(due_us, std::move(task));
+    if (earliest) {
+        m_delay_cond.signal();
+    }
+    m_delay_lock.unlock();
+    return true;
+}
+
+void* FakeUserStore::delay_thread(void* arg) {
+    static_cast<FakeUserStore*>(arg)->run_delayed();
+    return nullptr;
+}
+
+void FakeUserStore::run_delayed() {
+    m_delay_lock.lock();
+    while (!m_stop) {
+        if (m_delayed.empty()) {
+            m_delay_cond.wait(m_delay_lock);
+            continue;
+        }
+        int64_t due_us = m_delayed.begin()->first;
+        if (due_us > monotonic::now_us()) {
+            // The condition variable waits on CLOCK_REALTIME
+            struct timespec abstime;
+            clock_gettime(CLOCK_REALTIME, &abstime);
+            int64_t wait_us = due_us - monotonic::now_us();
+            abstime.tv_sec += wait_us / 1000000;
+            abstime.tv_nsec += (wait_us % 1000000) * 1000;
+            if (abstime.tv_nsec >= 1000000000) {
+                abstime.tv_sec++;
+                abstime.tv_nsec -= 1000000000;
+            }
+            m_delay_cond.timed_wait(m_delay_lock, &abstime);
+            continue;
+        }
+        std::function<void()> task = std::move(m_delayed.begin()->second);
+        m_delayed.erase(m_delayed.begin());
+        m_delay_lock.unlock();
+        task();
+        m_delay_lock.lock();
+    }
+    m_delay_lock.unlock();
+}
+
+bool FakeUserStore::load_all(const RowCallback& fn) {
+    sleep_latency();
+    std::string name = SYNTHETIC_PREFIX;
+    size_t prefix = name.size();
+    for (long i = 0; i < m_options.rows; ++i) {
+        name.resize(prefix);
+        name += std::to_string(i);
+        std::string stored;
+        // Inserted and updated rows shadow the synthetic ones
+        Shard& shard = shard_for(name);
+        shard.lock.rdlock();
+        auto it = shard.users.find(name);
+        bool found = it != shard.users.end();
+        if (found) {
+            stored = it->second;
+        }
+        shard.lock.unlock();
+        fn(name, found ? stored : m_synthetic_stored);
+    }
+    for (Shard& shard : m_shards) {
+        shard.lock.rdlock();
+        for (const auto& user : shard.users) {
+            if (!is_synthetic(user.first)) {
+                fn(user.first, user.second);
+            }
+        }
+        shard.lock.unlock();
+    }
+    return true;
+}
+
+UserStore::Status FakeUserStore::find(const std::string& username, std::string* stored) {
+    sleep_latency();
+    return do_find(username, stored);
+}
+
+UserStore::Status FakeUserStore::insert(const std::string& username, const std::string& stored) {
+    sleep_latency();
+    return do_insert(username, stored);
+}
+
+bool FakeUserStore::insert_async(const std::string& username, const std::string& stored, Callback cb) {
+    return schedule([this, username, stored, cb]() {
+        cb(do_insert(username, stored));
+    });
+}
+
+void FakeUserStore::update(const std::string& username, const std::string& stored) {
+    schedule([this, username, stored]() {
+        Shard& shard = shard_for(username);
+        shard.lock.wrlock();
+        shard.users[username] = stored;
+        shard.lock.unlock();
+    });
+}
@@ -0,0 +1,142 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#include "../../utils/lock/locker.h"
+
+class ConnectionPool;
+
+// Persistent user table behind login and registration: username -> stored
+// password (a PasswordHasher value, or plaintext for legacy rows).
+//
+// MySqlUserStore is the production backend. FakeUserStore keeps users in
+// memory and adds a configurable latency to every call, so the auth
+// endpoints can be benchmarked without a database. The backend is chosen
+// with the user_store option:
+//
+//   mysql
+//   fake[:rows=N,latency_us=N,jitter_us=N,password=P]
+class UserStore {
+public:
+    enum Status {
+        OK = 0,
+        NOT_FOUND,
+        FAILED,       // the store rejected the request (duplicate user, query error)
+        UNAVAILABLE   // no connection, or the store did not answer in time
+    };
+
+    typedef std::function<void(Status status)> Callback;
+    typedef std::function<void(const std::string& username, const std::string& stored)> RowCallback;
+
+    // Returns nullptr if `spec` is not a valid user_store value
+    static UserStore* create(const std::string& spec, ConnectionPool* pool);
+    static bool is_valid_spec(const std::string& spec);
+
+    virtual ~UserStore() {}
+
+    virtual const char* name() const = 0;
+    // Calls `fn` for every user, to fill the in-memory user map at startup
+    virtual bool load_all(const RowCallback& fn) = 0;
+    virtual Status find(const std::string& username, std::string* stored) = 0;
+    virtual Status insert(const std::string& username, const std::string& stored) = 0;
+    // Runs `cb` on the store's own thread once the insert finished. Never
+    // blocks, so it is safe on a KDF thread; returns false when the insert
+    // could not be queued, in which case `cb` is never invoked.
+    virtual bool insert_async(const std::string& username, const std::string& stored, Callback cb) = 0;
+    // Best effort and non-blocking: a lost update is redone on the next login
+    virtual void update(const std::string& username, const std::string& stored) = 0;
+};
+
+// User table in MySQL. Lookups may go to a read replica; inserts run on
+// AsyncSqlExecutor when it is running.
+class MySqlUserStore : public UserStore {
+public:
+    explicit MySqlUserStore(ConnectionPool* pool) : m_pool(pool) {}
+
+    const char* name() const override { return "mysql"; }
+    bool load_all(const RowCallback& fn) override;
+    Status find(const std::string& username, std::string* stored) override;
+    Status insert(const std::string& username, const std::string& stored) override;
+    bool insert_async(const std::string& username, const std::string& stored, Callback cb) override;
+    void update(const std::string& username, const std::string& stored) override;
+
+private:
+    ConnectionPool* m_pool;
+};
+
+// In-process stand-in for MySqlUserStore.
+//
+// Every call takes latency_us plus a uniform 0..jitter_us extra: find(),
+// insert() and load_all() sleep on the calling thread like a blocking query,
+// insert_async() and update() complete on a delay thread like the async
+// executor. Jitter comes from a fixed-seed generator per thread, so runs are
+// repeatable.
+//
+// `rows` synthetic users bench0 ... bench<rows-1> with password `password`
+// (tws_bench's defaults) exist from the start. They share one hash and are
+// generated on demand, so millions of rows cost no memory until load_all()
+// copies them into the server's user map.
+class FakeUserStore : public UserStore {
+public:
+    struct Options {
+        long rows = 0;
+        int latency_us = 0;
+        int jitter_us = 0;
+        std::string password = "benchpass";
+    };
+
+    // Accepts "fake" and "fake:key=value,..."
+    static bool parse_options(const std::string& spec, Options* options);
+
+    explicit FakeUserStore(const Options& options);
+    ~FakeUserStore() override;
+
+    const char* name() const override { return "fake"; }
+    bool load_all(const RowCallback& fn) override;
+    Status find(const std::string& username, std::string* stored) override;
+    Status insert(const std::string& username, const std::string& stored) override;
+    bool insert_async(const std::string& username, const std::string& stored, Callback cb) override;
+    void update(const std::string& username, const std::string& stored) override;
+
+private:
+    static const int SHARDS = 16;
+    static const size_t MAX_PENDING = 4096;
+
+    struct Shard {
+        mutable locker::RWLock lock;
+        std::unordered_map<std::string, std::string> users;
+    };
+
+    Shard& shard_for(const std::string& username);
+    bool is_synthetic(const std::string& username) const;
+    // Lookup and insert without the injected latency
+    Status do_find(const std::string& username, std::string* stored);
+    Status do_insert(const std::string& username, const std::string& stored);
+    int64_t next_delay_us();
+    void sleep_latency();
+    bool schedule(std::function<void()> task);
+
+    static void* delay_thread(void* arg);
+    void run_delayed();
+
+    Options m_options;
+    // Hash shared by all synthetic users
+    std::string m_synthetic_stored;
+    Shard m_shards[SHARDS];
+
+    // Deferred completions, ordered by due time (monotonic us)
+    locker::Mutex m_delay_lock;
+    locker::ConditionVariable m_delay_cond;
+    std::multimap<int64_t, std::function<void()>> m_delayed;
+    bool m_stop;
+    pthread_t m_thread;
+    bool m_thread_running;
+};
+
+#endif
@@ -1,9 +1,14 @@
 #include "http_conn.h"
 
-#include <mysql/mysql.h>
+#include <sys/eventfd.h>
 #include <fstream>
 #include <json/json.h>
 
+#include "../auth/login_cache.h"
+#include "../auth/session_store.h"
+#include "../auth/password_hasher.h"
+#include "../auth/user_store.h"
+
 // 定义http响应的一些状态信息
 const char *ok_200_title = "OK";
 const char *error_400_title = "Bad Request";
@@ -29,12 +34,42 @@ const char *error_504_form = "The server was acting as a gateway or proxy and di
 const char *error_505_title = "HTTP Version Not Supported";
 const char *error_505_form = "The server does not support the HTTP protocol version used in the request.\n";
 
-locker::Mutex m_lock;
+locker::Mutex m_lock("http_users");
 map<string, string> users;
 
-int HttpConn::m_user_count = 0;
+locker::Mutex m_completion_lock("http_completions");
+std::vector<HttpConn::Completion> HttpConn::m_completions;
+int HttpConn::m_completion_fd = -1;
+
+std::atomic<int> HttpConn::m_user_count(0);
+int64_t HttpConn::m_slow_request_us = 0;
+UserStore* HttpConn::m_user_store = nullptr;
+std::atomic<uint64_t> HttpConn::m_capture_seq(0);
 int HttpConn::m_epollfd = -1;
 
+// 请求各阶段耗时和响应统计，由/metrics导出
+static metrics::Registry* const registry = metrics::Registry::get_instance();
+static metrics::Histogram* const read_seconds = registry->histogram(
+    "tws_request_read_seconds", "Time from the first byte of a request until it was read");
+static metrics::Histogram* const parse_seconds = registry->histogram(
+    "tws_request_parse_seconds", "Time spent parsing the request line and headers");
+static metrics::Histogram* const handle_seconds = registry->histogram(
+    "tws_request_handle_seconds", "Time from a parsed request to a ready response, async waits included");
+static metrics::Histogram* const write_seconds = registry->histogram(
+    "tws_response_write_seconds", "Time from a ready response until its last byte was sent");
+static metrics::Histogram* const request_seconds = registry->histogram(
+    "tws_request_duration_seconds", "Time from the first byte of a request until its last response byte");
+static metrics::Counter* const response_bytes = registry->counter(
+    "tws_response_bytes_total", "Response bytes sent");
+static metrics::Counter* const responses[] = {
+    registry->counter("tws_responses_total", "Finished requests by status class", "code=\"none\""),
+    registry->counter("tws_responses_total", "Finished requests by status class", "code=\"1xx\""),
+    registry->counter("tws_responses_total", "Finished requests by status class", "code=\"2xx\""),
+    registry->counter("tws_responses_total", "Finished requests by status class", "code=\"3xx\""),
+    registry->counter("tws_responses_total", "Finished requests by status class", "code=\"4xx\""),
+    registry->counter("tws_responses_total", "Finished requests by status class", "code=\"5xx\"")
+};
+
 // 设置文件描述符非阻塞
 int set_non_blocking(int fd) {
     int old_option = fcntl(fd, F_GETFL);
@@ -78,69 +113,80 @@ void mod_fd(int epollfd, int fd, int ev, int TRIGMode) {
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
-void HttpConn::init_mysql_result(ConnectionPool* connPool) {
-    MYSQL* mysql = nullptr;
-    ConnectionRAII mysqlcon(&mysql, connPool);
-
-    if (mysql_query(mysql, "SELECT username, passwd FROM user")) {
-        LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
-    }
-
-    MYSQL_RES* result = mysql_store_result(mysql);
-    int num_fields = mysql_num_fields(result);
-    MYSQL_FIELD* fields = mysql_fetch_fields(result);
-
-    while (MYSQL_ROW row = mysql_fetch_row(result)) {
-        string temp1(row[0]);
-        string temp2(row[1]);
-        users[temp1] = temp2;
+void HttpConn::init_user_store(UserStore* store) {
+    m_user_store = store;
+    size_t loaded = 0;
+    bool ok = store->load_all([&loaded](const string& username, const string& stored) {
+        users[username] = stored;
+        ++loaded;
+    });
+    if (ok) {
+        LOG_INFO("Loaded %zu users from the %s user store", loaded, store->name());
     }
 }
 
-bool HttpConn::verify_user(const string& username, const string& password) {
-    if (users.find(username) == users.end()) {
-        return false;
+HttpConn::AUTH_STATUS HttpConn::lookup_user(const string& username, string* stored) {
+    m_lock.lock();
+    auto it = users.find(username);
+    bool found = it != users.end();
+    if (found) {
+        *stored = it->second;
     }
-    return users[username] == password;
-}
-
-bool HttpConn::register_user(const string& username, const string& password) {
-    if (users.find(username) != users.end()) {
-        return false;
+    m_lock.unlock();
+    if (found) {
+        return AUTH_OK;
     }
 
-    MYSQL* mysql = nullptr;
-    ConnectionRAII mysqlcon(&mysql, m_connPool);
+    // 本地没有该用户（可能由其他实例注册），到用户表查询
+    switch (m_user_store->find(username, stored)) {
+        case UserStore::OK:
+            break;
+        case UserStore::NOT_FOUND:
+            LoginCache::get_instance()->store_negative(username);
+            return AUTH_DENIED;
+        case UserStore::UNAVAILABLE:
+            return AUTH_UNAVAILABLE;
+        default:
+            return AUTH_DENIED;
+    }
 
-    char sql_insert[200];
-    sprintf(sql_insert, "INSERT INTO user(username, passwd) VALUES('%s', '%s')", 
-            username.c_str(), password.c_str());
+    m_lock.lock();
+    users[username] = *stored;
+    m_lock.unlock();
+    return AUTH_OK;
+}
 
-    if (mysql_query(mysql, sql_insert)) {
-        LOG_ERROR("INSERT error:%s\n", mysql_error(mysql));
-        return false;
-    }
+void HttpConn::upgrade_password(const string& username, const string& encoded) {
+    m_lock.lock();
+    users[username] = encoded;
+    m_lock.unlock();
 
-    users[username] = password;
-    return true;
+    // 写回失败时下次登录再升级
+    m_user_store->update(username, encoded);
 }
 
 void HttpConn::init(int sockfd, const sockaddr_in& addr, char* root, int TRIGMode, int close_log, string user, string passWord, string sqlname) {
     m_sockfd = sockfd;
     m_address = addr;
+    // 注册前先设置触发模式，否则连接会按上一个使用者（或未初始化）的模式注册
+    m_TRIGMode = TRIGMode;
     add_fd(m_epollfd, sockfd, true, m_TRIGMode);
     m_user_count++;
 
     doc_root = root;
-    m_TRIGMode = TRIGMode;
     m_close_log = close_log;
     m_connPool = ConnectionPool::get_instance();
+    ++m_conn_gen;
 
     strcpy(sql_user, user.c_str());
     strcpy(sql_passWord, passWord.c_str());
     strcpy(sql_name, sqlname.c_str());
 
     init();
+    mark(TS_ACCEPTED);
+    m_capture_id = ++m_capture_seq;
+    capture_event(capture::OPEN);
+    TWS_PROBE3(accept, sockfd, addr.sin_addr.s_addr, ntohs(addr.sin_port));
 }
 
 void HttpConn::init() {
@@ -150,6 +196,7 @@ void HttpConn::init() {
     m_version = 0;
     m_content_length = 0;
     m_host = 0;
+    m_session_token = 0;
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
@@ -161,6 +208,10 @@ void HttpConn::init() {
     m_string = 0;
     bytes_to_send = 0;
     bytes_have_send = 0;
+    memset(m_ts, 0, sizeof(m_ts));
+    m_route = accesslog::ROUTE_OTHER;
+    m_status = 0;
+    m_body.clear();
     memset(m_read_buf, '\0', READ_BUFFER_SIZE);
     memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
     memset(m_real_file, '\0', FILENAME_LEN);
@@ -179,14 +230,23 @@ bool HttpConn::read_once() {
         return false;
     }
     int bytes_read = 0;
+    if (m_ts[TS_FIRST_BYTE] == 0) {
+        mark(TS_FIRST_BYTE);
+    }
 
     if (m_TRIGMode == 0) {
         bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        TWS_PROBE2(read, m_sockfd, bytes_read);
         m_read_idx += bytes_read;
 
         if (bytes_read <= 0) {
+            if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                capture_event(capture::CLOSE);
+            }
             return false;
         }
+        capture_event(capture::DATA, m_read_buf + m_read_idx - bytes_read, bytes_read);
+        mark(TS_READ);
         return true;
     } else {
         while (true) {
@@ -194,16 +254,40 @@ bool HttpConn::read_once() {
             if (bytes_read == -1) {
                 if (errno == EAGAIN || errno == EWOULDBLOCK)
                     break;
+                TWS_PROBE2(read, m_sockfd, bytes_read);
+                capture_event(capture::CLOSE);
                 return false;
-            } else if (bytes_read == 0) {
+            }
+            TWS_PROBE2(read, m_sockfd, bytes_read);
+            if (bytes_read == 0) {
+                capture_event(capture::CLOSE);
                 return false;
             }
+            capture_event(capture::DATA, m_read_buf + m_read_idx, bytes_read);
             m_read_idx += bytes_read;
         }
+        mark(TS_READ);
         return true;
     }
 }
 
+bool HttpConn::is_metrics_request() const {
+    static const char prefix[] = "GET /metrics ";
+    return m_read_idx > (int)sizeof(prefix) && memcmp(m_read_buf, prefix, sizeof(prefix) - 1) == 0 &&
+           memmem(m_read_buf, m_read_idx, "\r\n\r\n", 4) != nullptr;
+}
+
+bool HttpConn::peek_metrics_request() const {
+    static const char prefix[] = "GET /metrics ";
+    const size_t len = sizeof(prefix) - 1;
+    // 上次只读到部分请求时，请求行已在缓冲区中
+    if (m_read_idx > 0) {
+        return m_read_idx >= (int)len && memcmp(m_read_buf, prefix, len) == 0;
+    }
+    char buf[sizeof(prefix) - 1];
+    return recv(m_sockfd, buf, len, MSG_PEEK | MSG_DONTWAIT) == (ssize_t)len && memcmp(buf, prefix, len) == 0;
+}
+
 bool HttpConn::write() {
     int temp = 0;
     int newadd = 0;
@@ -222,15 +306,19 @@ bool HttpConn::write() {
                 mod_fd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode);
                 return true;
             }
+            finish_request();
             unmap();
             return false;
         }
 
         bytes_have_send += temp;
         bytes_to_send -= temp;
+        if (bytes_to_send > 0) {
+            TWS_PROBE3(write, m_sockfd, temp, bytes_to_send);
+        }
         if (bytes_have_send >= m_iv[0].iov_len) {
             m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
+            m_iv[1].iov_base = response_body() + (bytes_have_send - m_write_idx);
             m_iv[1].iov_len = bytes_to_send;
         } else {
             m_iv[0].iov_base = m_write_buf + bytes_have_send;
@@ -238,6 +326,7 @@ bool HttpConn::write() {
         }
 
         if (bytes_to_send <= 0) {
+            finish_request();
             unmap();
             mod_fd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode);
 
@@ -252,20 +341,152 @@ bool HttpConn::write() {
 }
 
 void HttpConn::process() {
+    mark(TS_DEQUEUED);
     HTTP_CODE read_ret = process_read();
+    TWS_PROBE2(parse, m_sockfd, (int)read_ret);
+    // 处理函数在本线程上用过数据库连接时补上对应的时间点
+    note_db_marks(ConnectionRAII::thread_marks());
     if (read_ret == NO_REQUEST) {
         mod_fd(m_epollfd, m_sockfd, EPOLLIN, m_TRIGMode);
         return;
     }
-    bool write_ret = process_write(read_ret);
+    // 请求已挂起，由异步回调调用complete_request()，socket保持EPOLLONESHOT未激活
+    if (read_ret == ASYNC_REQUEST) {
+        return;
+    }
+    complete_request(read_ret);
+}
+
+void HttpConn::complete_request(HTTP_CODE ret) {
+    bool write_ret = process_write(ret);
+    mark(TS_READY);
+    // 所有响应都以"HTTP/1.1 "开头，状态码紧随其后
+    if (write_ret && m_write_idx > 9) {
+        m_status = atoi(m_write_buf + 9);
+    }
     if (!write_ret) {
+        finish_request();
         close_conn();
     }
     mod_fd(m_epollfd, m_sockfd, EPOLLOUT, m_TRIGMode);
 }
 
+void HttpConn::note_db_marks(const ConnectionRAII::ThreadMarks& db) {
+    // 早于本次请求解析完成的时间点属于该线程处理过的其他请求
+    if (m_ts[TS_PARSED] && db.acquire_start_us >= (uint64_t)m_ts[TS_PARSED]) {
+        m_ts[TS_DB_REQUESTED] = db.acquire_start_us;
+        m_ts[TS_DB_ACQUIRED] = db.acquired_us;
+        m_ts[TS_DB_RELEASED] = db.released_us;
+    }
+}
+
+int HttpConn::init_completions() {
+    m_completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return m_completion_fd;
+}
+
+void HttpConn::post_completion(unsigned gen, std::function<HTTP_CODE()> reply) {
+    Completion completion = {this, gen, std::move(reply)};
+    m_completion_lock.lock();
+    m_completions.push_back(std::move(completion));
+    m_completion_lock.unlock();
+    uint64_t one = 1;
+    ssize_t ret = ::write(m_completion_fd, &one, sizeof(one));
+    (void)ret;
+}
+
+void HttpConn::run_completions() {
+    uint64_t count;
+    while (::read(m_completion_fd, &count, sizeof(count)) > 0) {
+    }
+    std::vector<Completion> ready;
+    m_completion_lock.lock();
+    ready.swap(m_completions);
+    m_completion_lock.unlock();
+    for (Completion& completion : ready) {
+        // 连接已关闭或已在服务新的客户端，结果作废
+        if (completion.conn->m_conn_gen != completion.gen) {
+            continue;
+        }
+        completion.conn->complete_request(completion.reply());
+    }
+}
+
+void HttpConn::finish_request() {
+    mark(TS_WRITTEN);
+    uint32_t total_us = accesslog::elapsed_us(m_ts[TS_FIRST_BYTE], m_ts[TS_WRITTEN]);
+    read_seconds->observe(accesslog::elapsed_us(m_ts[TS_FIRST_BYTE], m_ts[TS_READ]));
+    parse_seconds->observe(accesslog::elapsed_us(m_ts[TS_DEQUEUED], m_ts[TS_PARSED]));
+    handle_seconds->observe(accesslog::elapsed_us(m_ts[TS_PARSED], m_ts[TS_READY]));
+    write_seconds->observe(accesslog::elapsed_us(m_ts[TS_READY], m_ts[TS_WRITTEN]));
+    request_seconds->observe(total_us);
+    TWS_PROBE4(response, m_sockfd, m_status, bytes_have_send, (uint64_t)total_us * 1000);
+    response_bytes->inc(bytes_have_send);
+    responses[m_status >= 100 && m_status < 600 ? m_status / 100 : 0]->inc();
+    if (m_slow_request_us > 0 && total_us >= m_slow_request_us) {
+        trace_slow_request(total_us);
+    }
+
+    Log* log = Log::get_instance();
+    int sample = log->sample_access(m_status);
+    if (sample == 0) {
+        return;
+    }
+    accesslog::AccessRecord record;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record.total_us = total_us;
+    record.time_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - record.total_us;
+    record.client_ip = m_address.sin_addr.s_addr;
+    record.client_port = ntohs(m_address.sin_port);
+    record.method = (uint8_t)m_method;
+    record.route = m_route;
+    record.status = (uint16_t)m_status;
+    record.sample = (uint16_t)(sample > UINT16_MAX ? UINT16_MAX : sample);
+    record.bytes = (uint32_t)bytes_have_send;
+    record.stage_us[accesslog::STAGE_READ] = accesslog::elapsed_us(m_ts[TS_FIRST_BYTE], m_ts[TS_READ]);
+    record.stage_us[accesslog::STAGE_QUEUE] = accesslog::elapsed_us(m_ts[TS_READ], m_ts[TS_DEQUEUED]);
+    record.stage_us[accesslog::STAGE_PROCESS] = accesslog::elapsed_us(m_ts[TS_DEQUEUED], m_ts[TS_READY]);
+    record.stage_us[accesslog::STAGE_WRITE] = accesslog::elapsed_us(m_ts[TS_READY], m_ts[TS_WRITTEN]);
+    record.reserved = 0;
+    log->write_access(record);
+}
+
+void HttpConn::trace_slow_request(int64_t total_us) {
+    static const char* const names[TS_COUNT] = {
+        "accepted", "first_byte", "read", "dequeued", "parsed",
+        "db_requested", "db_acquired", "db_released", "ready", "written"
+    };
+    // 每个经过的时间点相对上一个的增量
+    char timeline[512];
+    int len = 0;
+    int64_t prev = 0;
+    for (int i = 0; i < TS_COUNT && len < (int)sizeof(timeline); ++i) {
+        if (m_ts[i] == 0) {
+            continue;
+        }
+        len += snprintf(timeline + len, sizeof(timeline) - len, prev ? " %s +%lldus" : "%s",
+                        names[i], (long long)(m_ts[i] - prev));
+        prev = m_ts[i];
+    }
+    char ip[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &m_address.sin_addr, ip, sizeof(ip))) {
+        ip[0] = '\0';
+    }
+    LOG_WARN("slow request %s:%d %s %.64s status=%d bytes=%d total=%lldus: %s", ip,
+             ntohs(m_address.sin_port), accesslog::METHOD_NAMES[m_method], m_url ? m_url : "-",
+             m_status, bytes_have_send, (long long)total_us, timeline);
+}
+
+void HttpConn::set_slow_request_ms(int ms) {
+    m_slow_request_us = ms > 0 ? (int64_t)ms * 1000 : 0;
+}
+
 HttpConn::HttpConn() {
     m_sockfd = -1;
+    m_TRIGMode = 0;
+    m_conn_gen = 0;
+    m_capture_id = 0;
     m_state = 0;
     timer_flag = 0;
     improv = 0;
@@ -283,7 +504,7 @@ HttpConn::HTTP_CODE HttpConn::process_read() {
     while ((m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) || ((line_status = parse_line()) == LINE_OK)) {
         text = get_line();
         m_start_line = m_checked_idx;
-        LOG_INFO("%s", text);
+        LOG_DEBUG("%s", text);
         switch (m_check_state) {
             case CHECK_STATE_REQUESTLINE: {
                 ret = parse_request_line(text);
@@ -296,14 +517,15 @@ HttpConn::HTTP_CODE HttpConn::process_read() {
                 if (ret == BAD_REQUEST)
                     return BAD_REQUEST;
                 else if (ret == GET_REQUEST) {
-                    return do_request();
+                    return dispatch_request();
                 }
                 break;
             }
             case CHECK_STATE_CONTENT: {
                 ret = parse_content(text);
-                if (ret == GET_REQUEST)
-                    return do_request();
+                if (ret == GET_REQUEST) {
+                    return dispatch_request();
+                }
                 line_status = LINE_OPEN;
                 break;
             }
@@ -354,7 +576,27 @@ bool HttpConn::process_write(HTTP_CODE ret) {
                 if (!add_content(ok_string))
                     return false;
             }
+            break;
         }
+        case SERVICE_UNAVAILABLE: {
+            add_status_line(503, error_503_title);
+            add_headers(strlen(error_503_form));
+            if (!add_content(error_503_form))
+                return false;
+            break;
+        }
+        // API处理函数已自行写好状态行、头部和JSON正文，/metrics的正文在m_body中
+        case GET_REQUEST:
+            if (!m_body.empty()) {
+                m_iv[0].iov_base = m_write_buf;
+                m_iv[0].iov_len = m_write_idx;
+                m_iv[1].iov_base = &m_body[0];
+                m_iv[1].iov_len = m_body.size();
+                m_iv_count = 2;
+                bytes_to_send = m_write_idx + m_body.size();
+                return true;
+            }
+            break;
         default:
             return false;
     }
@@ -449,8 +691,31 @@ HttpConn::HTTP_CODE HttpConn::parse_headers(char* text) {
         text += 5;
         text += strspn(text, " \t");
         m_host = text;
+    } else if (strncasecmp(text, "Authorization:", 14) == 0) {
+        text += 14;
+        text += strspn(text, " \t");
+        if (strncasecmp(text, "Bearer ", 7) == 0) {
+            text += 7;
+            text += strspn(text, " \t");
+            m_session_token = text;
+        }
+    } else if (strncasecmp(text, "Cookie:", 7) == 0) {
+        text += 7;
+        // Authorization 头优先
+        while (*text != '\0' && !m_session_token) {
+            text += strspn(text, " \t;");
+            char* end = text + strcspn(text, ";");
+            if (strncmp(text, "session=", 8) == 0) {
+                if (*end != '\0') {
+                    *end = '\0';
+                }
+                m_session_token = text + 8;
+                break;
+            }
+            text = end;
+        }
     } else {
-        LOG_INFO("oop!unknow header: %s", text);
+        LOG_DEBUG("oop!unknow header: %s", text);
     }
     return NO_REQUEST;
 }
@@ -464,16 +729,36 @@ HttpConn::HTTP_CODE HttpConn::parse_content(char* text) {
     return NO_REQUEST;
 }
 
+HttpConn::HTTP_CODE HttpConn::dispatch_request() {
+    mark(TS_PARSED);
+    HTTP_CODE ret = do_request();
+    TWS_PROBE3(route, m_sockfd, (int)m_method, (int)m_route);
+    return ret;
+}
+
 HttpConn::HTTP_CODE HttpConn::do_request() {
     strcpy(m_real_file, doc_root);
     int len = strlen(doc_root);
 
+    if (strcmp(m_url, "/metrics") == 0 && m_method == GET) {
+        m_route = accesslog::ROUTE_METRICS;
+        return serve_metrics();
+    }
+
     // 处理API请求
     if (strncmp(m_url, "/api/", 5) == 0) {
         if (strncmp(m_url + 5, "login", 5) == 0 && m_method == POST) {
+            m_route = accesslog::ROUTE_API_LOGIN;
             return handle_login();
         } else if (strncmp(m_url + 5, "register", 8) == 0 && m_method == POST) {
+            m_route = accesslog::ROUTE_API_REGISTER;
             return handle_register();
+        } else if (strcmp(m_url + 5, "session") == 0 && m_method == GET) {
+            m_route = accesslog::ROUTE_API_SESSION;
+            return handle_session();
+        } else if (strcmp(m_url + 5, "logout") == 0 && m_method == POST) {
+            m_route = accesslog::ROUTE_API_LOGOUT;
+            return handle_logout();
         }
     }
 
@@ -498,35 +783,53 @@ HttpConn::HTTP_CODE HttpConn::do_request() {
             password[j] = m_string[i];
         password[j] = '\0';
 
+        HttpConn* self = this;
+        unsigned gen = m_conn_gen;
+        string user_name(name);
+        string user_password(password);
         if (*(p + 1) == '3') {
-            char* sql_insert = (char*)malloc(sizeof(char) * 200);
-            strcpy(sql_insert, "INSERT INTO user(username, passwd) VALUES(");
-            strcat(sql_insert, "'");
-            strcat(sql_insert, name);
-            strcat(sql_insert, "', '");
-            strcat(sql_insert, password);
-            strcat(sql_insert, "')");
-
-            if (users.find(name) == users.end()) {
-                m_lock.lock();
-                int res = mysql_query(mysql, sql_insert);
-                users.insert(pair<string, string>(name, password));
-                m_lock.unlock();
-
-                if (!res)
-                    strcpy(m_url, "/log.html");
-                else
-                    strcpy(m_url, "/registerError.html");
-            } else
-                strcpy(m_url, "/registerError.html");
+            m_route = accesslog::ROUTE_FORM_REGISTER;
+            m_lock.lock();
+            bool exists = users.find(user_name) != users.end();
+            m_lock.unlock();
+            if (exists)
+                return serve_page("/registerError.html");
+
+            // 散列在计算线程池中完成，随后与/api/register一样异步插入数据库
+            bool queued = PasswordHasher::get_instance()->hash_async(user_password,
+                [self, gen, user_name, user_password](const string& encoded) {
+                    if (encoded.empty()) {
+                        self->post_completion(gen, [self]() { return self->reply_register(AUTH_UNAVAILABLE); });
+                        return;
+                    }
+                    self->insert_user(gen, user_name, user_password, encoded);
+                });
+            return queued ? ASYNC_REQUEST : SERVICE_UNAVAILABLE;
         } else if (*(p + 1) == '2') {
-            if (users.find(name) != users.end() && users[name] == password)
-                strcpy(m_url, "/welcome.html");
-            else
-                strcpy(m_url, "/logError.html");
+            m_route = accesslog::ROUTE_FORM_LOGIN;
+            string stored;
+            m_lock.lock();
+            auto it = users.find(user_name);
+            bool found = it != users.end();
+            if (found)
+                stored = it->second;
+            m_lock.unlock();
+            if (!found)
+                return serve_page("/logError.html");
+
+            bool queued = PasswordHasher::get_instance()->verify_async(user_password, stored,
+                [self, gen, user_name](bool ok, const string& upgraded) {
+                    if (!upgraded.empty())
+                        self->upgrade_password(user_name, upgraded);
+                    self->post_completion(gen, [self, ok]() {
+                        return self->serve_page(ok ? "/welcome.html" : "/logError.html");
+                    });
+                });
+            return queued ? ASYNC_REQUEST : SERVICE_UNAVAILABLE;
         }
     }
 
+    m_route = accesslog::ROUTE_STATIC;
     if (*(p + 1) == '0') {
         char* m_url_real = (char*)malloc(sizeof(char) * 200);
         strcpy(m_url_real, "/register.html");
@@ -555,6 +858,26 @@ HttpConn::HTTP_CODE HttpConn::do_request() {
     } else
         strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
 
+    return map_file();
+}
+
+HttpConn::HTTP_CODE HttpConn::serve_page(const char* page) {
+    strcpy(m_real_file, doc_root);
+    int len = strlen(doc_root);
+    strncpy(m_real_file + len, page, FILENAME_LEN - len - 1);
+    return map_file();
+}
+
+HttpConn::HTTP_CODE HttpConn::serve_metrics() {
+    m_body.clear();
+    metrics::Registry::get_instance()->render(&m_body);
+    add_status_line(200, ok_200_title);
+    add_response("Content-Type:%s\r\n", "text/plain; version=0.0.4");
+    add_headers(m_body.size());
+    return GET_REQUEST;
+}
+
+HttpConn::HTTP_CODE HttpConn::map_file() {
     if (stat(m_real_file, &m_file_stat) < 0)
         return NO_RESOURCE;
 
@@ -580,35 +903,102 @@ HttpConn::HTTP_CODE HttpConn::handle_login() {
     string username = root["username"].asString();
     string password = root["password"].asString();
 
-    if (verify_user(username, password)) {
-        // 生成token（这里简单使用用户名作为token）
-        string token = username;
-        
-        Json::Value response;
+    // 先查登录结果缓存，热点账号和重复的无效用户名不再加全局锁、访问数据库或计算散列
+    switch (LoginCache::get_instance()->lookup(username, password)) {
+        case LoginCache::HIT_VALID:
+            return reply_login(AUTH_OK, username);
+        case LoginCache::HIT_INVALID:
+            return reply_login(AUTH_DENIED, username);
+        default:
+            break;
+    }
+
+    string stored;
+    AUTH_STATUS status = lookup_user(username, &stored);
+    if (status != AUTH_OK) {
+        return reply_login(status, username);
+    }
+
+    // 密码校验在独立的计算线程池中进行，工作线程不被KDF占用
+    HttpConn* self = this;
+    unsigned gen = m_conn_gen;
+    bool queued = PasswordHasher::get_instance()->verify_async(password, stored,
+        [self, gen, username, password](bool ok, const string& upgraded) {
+            if (ok) {
+                LoginCache::get_instance()->store_positive(username, password);
+            }
+            if (!upgraded.empty()) {
+                self->upgrade_password(username, upgraded);
+            }
+            self->post_completion(gen, [self, ok, username]() {
+                return self->reply_login(ok ? AUTH_OK : AUTH_DENIED, username);
+            });
+        });
+    if (!queued) {
+        return reply_login(AUTH_UNAVAILABLE, username);
+    }
+    return ASYNC_REQUEST;
+}
+
+HttpConn::HTTP_CODE HttpConn::reply_login(AUTH_STATUS status, const string& username) {
+    Json::Value response;
+    if (status == AUTH_OK) {
+        // 生成随机会话令牌，后续请求凭令牌认证而不再校验密码
+        SessionStore* sessions = SessionStore::get_instance();
+        string token = sessions->create(username);
+        if (token.empty()) {
+            response["success"] = false;
+            response["message"] = "Service temporarily unavailable";
+            return reply_json("HTTP/1.1 503 Service Unavailable\r\n", response);
+        }
+
         response["success"] = true;
         response["message"] = "Login successful";
         response["token"] = token;
-
-        Json::FastWriter writer;
-        string response_str = writer.write(response);
-        
-        add_response("HTTP/1.1 200 OK\r\n");
-        add_headers(response_str.length());
-        add_content(response_str.c_str());
-        return GET_REQUEST;
+        response["expires_in"] = sessions->get_ttl();
+        string cookie = "Set-Cookie:session=" + token + "; Max-Age=" + std::to_string(sessions->get_ttl()) +
+                        "; Path=/; HttpOnly; SameSite=Strict\r\n";
+        return reply_json("HTTP/1.1 200 OK\r\n", response, cookie);
+    } else if (status == AUTH_UNAVAILABLE) {
+        response["success"] = false;
+        response["message"] = "Service temporarily unavailable";
+        return reply_json("HTTP/1.1 503 Service Unavailable\r\n", response);
     } else {
-        Json::Value response;
         response["success"] = false;
         response["message"] = "Invalid username or password";
+        return reply_json("HTTP/1.1 401 Unauthorized\r\n", response);
+    }
+}
 
-        Json::FastWriter writer;
-        string response_str = writer.write(response);
-        
-        add_response("HTTP/1.1 401 Unauthorized\r\n");
-        add_headers(response_str.length());
-        add_content(response_str.c_str());
-        return GET_REQUEST;
+bool HttpConn::authenticate(std::string* username) {
+    if (!m_session_token) {
+        return false;
+    }
+    return SessionStore::get_instance()->validate(m_session_token, username);
+}
+
+HttpConn::HTTP_CODE HttpConn::handle_session() {
+    Json::Value response;
+    string username;
+    if (!authenticate(&username)) {
+        response["success"] = false;
+        response["message"] = "Not logged in";
+        return reply_json("HTTP/1.1 401 Unauthorized\r\n", response);
     }
+    response["success"] = true;
+    response["username"] = username;
+    return reply_json("HTTP/1.1 200 OK\r\n", response);
+}
+
+HttpConn::HTTP_CODE HttpConn::handle_logout() {
+    if (m_session_token) {
+        SessionStore::get_instance()->revoke(m_session_token);
+    }
+    Json::Value response;
+    response["success"] = true;
+    response["message"] = "Logged out";
+    return reply_json("HTTP/1.1 200 OK\r\n", response,
+                      "Set-Cookie:session=; Max-Age=0; Path=/; HttpOnly; SameSite=Strict\r\n");
 }
 
 HttpConn::HTTP_CODE HttpConn::handle_register() {
@@ -621,31 +1011,102 @@ HttpConn::HTTP_CODE HttpConn::handle_register() {
     string username = root["username"].asString();
     string password = root["password"].asString();
 
-    if (register_user(username, password)) {
-        Json::Value response;
+    m_lock.lock();
+    bool exists = users.find(username) != users.end();
+    m_lock.unlock();
+    if (exists) {
+        return reply_register(AUTH_DENIED);
+    }
+
+    // 先在计算线程池中生成加盐散列，再插入数据库
+    HttpConn* self = this;
+    unsigned gen = m_conn_gen;
+    bool queued = PasswordHasher::get_instance()->hash_async(password,
+        [self, gen, username, password](const string& encoded) {
+            if (encoded.empty()) {
+                self->post_completion(gen, [self]() { return self->reply_register(AUTH_UNAVAILABLE); });
+                return;
+            }
+            self->insert_user(gen, username, password, encoded);
+        });
+    if (!queued) {
+        return reply_register(AUTH_UNAVAILABLE);
+    }
+    return ASYNC_REQUEST;
+}
+
+void HttpConn::insert_user(unsigned gen, const string& username, const string& password, const string& encoded) {
+    // 异步插入：用户表在自己的线程中回调，计算线程不等待数据库
+    HttpConn* self = this;
+    bool queued = m_user_store->insert_async(username, encoded,
+        [self, gen, username, password, encoded](UserStore::Status status) {
+            if (status == UserStore::OK) {
+                m_lock.lock();
+                users[username] = encoded;
+                m_lock.unlock();
+                // 刚注册的用户通常马上登录，直接缓存成功结果(替换可能存在的"用户不存在")
+                LoginCache::get_instance()->invalidate(username);
+                LoginCache::get_instance()->store_positive(username, password);
+            }
+            // 插入所用连接的时间点只在回调线程上可见，随结果一起交回主线程
+            ConnectionRAII::ThreadMarks db = ConnectionRAII::thread_marks();
+            self->post_completion(gen, [self, status, db]() {
+                self->note_db_marks(db);
+                if (status == UserStore::OK) {
+                    return self->reply_register(AUTH_OK);
+                } else if (status == UserStore::UNAVAILABLE) {
+                    return self->reply_register(AUTH_UNAVAILABLE);
+                } else if (self->m_route == accesslog::ROUTE_FORM_REGISTER) {
+                    return self->reply_register(AUTH_DENIED);
+                }
+                Json::Value response;
+                response["success"] = false;
+                response["message"] = "Registration failed";
+                return self->reply_json("HTTP/1.1 500 Internal Error\r\n", response);
+            });
+        });
+    // 插入队列已满或执行器未运行，不在计算线程上退回阻塞插入
+    if (!queued) {
+        post_completion(gen, [self]() { return self->reply_register(AUTH_UNAVAILABLE); });
+    }
+}
+
+HttpConn::HTTP_CODE HttpConn::reply_register(AUTH_STATUS status) {
+    // 表单注册(/3CGISQL.cgi)返回页面，/api/register返回JSON
+    if (m_route == accesslog::ROUTE_FORM_REGISTER) {
+        if (status == AUTH_UNAVAILABLE) {
+            return SERVICE_UNAVAILABLE;
+        }
+        return serve_page(status == AUTH_OK ? "/log.html" : "/registerError.html");
+    }
+    Json::Value response;
+    if (status == AUTH_OK) {
         response["success"] = true;
         response["message"] = "Registration successful";
-
-        Json::FastWriter writer;
-        string response_str = writer.write(response);
-        
-        add_response("HTTP/1.1 200 OK\r\n");
-        add_headers(response_str.length());
-        add_content(response_str.c_str());
-        return GET_REQUEST;
+        return reply_json("HTTP/1.1 200 OK\r\n", response);
+    } else if (status == AUTH_UNAVAILABLE) {
+        response["success"] = false;
+        response["message"] = "Service temporarily unavailable";
+        return reply_json("HTTP/1.1 503 Service Unavailable\r\n", response);
     } else {
-        Json::Value response;
         response["success"] = false;
         response["message"] = "Username already exists";
+        return reply_json("HTTP/1.1 400 Bad Request\r\n", response);
+    }
+}
 
-        Json::FastWriter writer;
-        string response_str = writer.write(response);
-        
-        add_response("HTTP/1.1 400 Bad Request\r\n");
-        add_headers(response_str.length());
-        add_content(response_str.c_str());
-        return GET_REQUEST;
+HttpConn::HTTP_CODE HttpConn::reply_json(const char* status_line, const Json::Value& body,
+                                         const std::string& extra_headers) {
+    Json::FastWriter writer;
+    string response_str = writer.write(body);
+
+    add_response("%s", status_line);
+    if (!extra_headers.empty()) {
+        add_response("%s", extra_headers.c_str());
     }
+    add_headers(response_str.length());
+    add_content(response_str.c_str());
+    return GET_REQUEST;
 }
 
 void HttpConn::unmap() {
@@ -667,7 +1128,7 @@ bool HttpConn::add_response(const char* format, ...) {
     }
     m_write_idx += len;
     va_end(arg_list);
-    LOG_INFO("request:%s", m_write_buf);
+    LOG_DEBUG("request:%s", m_write_buf);
     return true;
 }
 
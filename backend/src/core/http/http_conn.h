@@ -20,6 +20,10 @@
 #include <sys/wait.h>
 #include <sys/uio.h>
 #include <map>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <json/json.h>
 
 #include "../../utils/lock/locker.h"
 #include "../../third_party/sql_connection_pool.h"
@@ -27,8 +31,12 @@
 #include "../../utils/log/log.h"
 #include "../../utils/block_queue/block_queue.h"
 #include "../../utils/threadpool/threadpool.h"
+#include "../../utils/metrics/metrics.h"
+#include "../../utils/trace/probes.h"
 #include "../../utils/timer/lst_timer.h"
 
+class UserStore;
+
 class HttpConn {
 public:
     static const int FILENAME_LEN = 200;
@@ -59,15 +67,39 @@ public:
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
         INTERNAL_ERROR,
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        SERVICE_UNAVAILABLE,
+        ASYNC_REQUEST
+    };
+    enum AUTH_STATUS {
+        AUTH_OK = 0,
+        AUTH_DENIED,
+        AUTH_UNAVAILABLE
     };
     enum LINE_STATUS {
         LINE_OK = 0,
         LINE_BAD,
         LINE_OPEN
     };
+    // 一个请求经过的时间点，按先后顺序排列
+    enum TIMESTAMP {
+        TS_ACCEPTED = 0,    // 连接建立，只有连接上的第一个请求有
+        TS_FIRST_BYTE,      // 开始读请求
+        TS_READ,            // 最后一次读完
+        TS_DEQUEUED,        // 工作线程开始处理
+        TS_PARSED,          // 请求行和头部解析完
+        TS_DB_REQUESTED,    // 开始获取数据库连接
+        TS_DB_ACQUIRED,
+        TS_DB_RELEASED,
+        TS_READY,           // 响应已生成
+        TS_WRITTEN,         // 最后一个字节已发送
+        TS_COUNT
+    };
 
 private:
+    // bench/microbench.cpp直接驱动请求解析和响应头组装
+    friend class HttpConnBench;
+
     int m_sockfd;
     sockaddr_in m_address;
     char m_read_buf[READ_BUFFER_SIZE];
@@ -82,6 +114,8 @@ private:
     char* m_url;
     char* m_version;
     char* m_host;
+    // Authorization: Bearer 或 Cookie 中 session= 携带的会话令牌，指向读缓冲区
+    char* m_session_token;
     int m_content_length;
     bool m_linger;
     char* m_file_address;
@@ -110,7 +144,13 @@ private:
     HTTP_CODE parse_request_line(char* text);
     HTTP_CODE parse_headers(char* text);
     HTTP_CODE parse_content(char* text);
+    // 请求解析完毕，记录时间点后交给do_request()
+    HTTP_CODE dispatch_request();
     HTTP_CODE do_request();
+    HTTP_CODE serve_page(const char* page);
+    // 渲染/metrics，不访问数据库
+    HTTP_CODE serve_metrics();
+    HTTP_CODE map_file();
     char* get_line() {
         return m_read_buf + m_start_line;
     }
@@ -126,15 +166,75 @@ private:
     bool add_blank_line();
 
     // 用户认证相关函数
-    bool verify_user(const std::string& username, const std::string& password);
-    bool register_user(const std::string& username, const std::string& password);
+    // 取出用户保存的密码（散列值，旧数据为明文）
+    AUTH_STATUS lookup_user(const std::string& username, std::string* stored);
+    // 旧的明文或迭代次数不足的散列在登录成功后替换为新散列
+    void upgrade_password(const std::string& username, const std::string& encoded);
     HTTP_CODE handle_login();
+    HTTP_CODE reply_login(AUTH_STATUS status, const std::string& username);
     HTTP_CODE handle_register();
+    // 在计算线程上调用，插入结果总是经post_completion()交回主线程
+    void insert_user(unsigned gen, const std::string& username, const std::string& password,
+                     const std::string& encoded);
+    HTTP_CODE reply_register(AUTH_STATUS status);
+    HTTP_CODE handle_session();
+    HTTP_CODE handle_logout();
+    // 校验请求携带的会话令牌，成功时返回对应用户名
+    bool authenticate(std::string* username);
+    // extra_headers 为完整的额外响应头（含结尾\r\n），如 Set-Cookie
+    HTTP_CODE reply_json(const char* status_line, const Json::Value& body,
+                         const std::string& extra_headers = "");
+
+    // 生成响应并重新注册EPOLLOUT；异步请求由主线程在run_completions()中调用
+    void complete_request(HTTP_CODE ret);
+    // 把数据库连接的获取、归还时间记入本次请求；db须取自使用该连接的线程
+    void note_db_marks(const ConnectionRAII::ThreadMarks& db);
+    // 响应发送完(或发送失败)时记录各阶段耗时，并按采样写一条访问日志
+    void finish_request();
+    // 响应正文: 映射的文件或m_body
+    char* response_body() {
+        return m_file_address ? m_file_address : &m_body[0];
+    }
+    // 每次复用该对象服务新连接或连接被定时器关闭时递增，主线程据此丢弃过期的异步结果
+    std::atomic<unsigned> m_conn_gen;
+    // 异步回调(计算线程、SQL线程)不直接生成响应，而是把生成响应的函数交回主线程，
+    // 与init()和定时器关闭串行执行
+    struct Completion {
+        HttpConn* conn;
+        unsigned gen;
+        std::function<HTTP_CODE()> reply;
+    };
+    void post_completion(unsigned gen, std::function<HTTP_CODE()> reply);
+    static std::vector<Completion> m_completions;
+    static int m_completion_fd;
+
+    // 各时间点的单调时钟时间戳(微秒)，0表示本次请求没有经过
+    int64_t m_ts[TS_COUNT];
+    void mark(TIMESTAMP point) {
+        m_ts[point] = monotonic::now_us();
+    }
+    // 总耗时超过阈值的请求以WARN级别记录完整的时间线
+    void trace_slow_request(int64_t total_us);
+    static int64_t m_slow_request_us;
+    // 抓包: 连接编号，以及记录连接建立、收到的数据和关闭(见Log::init_capture)
+    static std::atomic<uint64_t> m_capture_seq;
+    uint64_t m_capture_id;
+    void capture_event(capture::Type type, const char* data = nullptr, int len = 0) {
+        Log* log = Log::get_instance();
+        if (log->is_capturing()) {
+            log->write_capture(m_capture_id, type, data, (uint32_t)len);
+        }
+    }
+    static UserStore* m_user_store;
+    // 访问日志: 路由和响应状态码
+    uint8_t m_route;
+    int m_status;
+    // 动态生成的响应正文(/metrics)，与m_write_buf中的头部一起发送
+    std::string m_body;
 
 public:
     static int m_epollfd;
-    static int m_user_count;
-    MYSQL* mysql;
+    static std::atomic<int> m_user_count;
     int m_state;
 
     HttpConn();
@@ -144,13 +244,28 @@ public:
     void close_conn(bool real_close = true);
     void process();
     bool read_once();
+    // 已读到完整的"GET /metrics"请求，主线程可以直接处理，不必经过工作队列
+    bool is_metrics_request() const;
+    // reactor模式下由工作线程读取，主线程只窥探请求行是否为"GET /metrics"，不消耗数据
+    bool peek_metrics_request() const;
     bool write();
     sockaddr_in* get_address() {
         return &m_address;
     }
-    void init_mysql_result(ConnectionPool* connPool);
-    int timer_flag;
-    int improv;
+    // 设置用户表后端(MySQL或测试用的内存实现)，并把全部用户加载到内存
+    static void init_user_store(UserStore* store);
+    // 慢请求阈值，0表示不记录
+    static void set_slow_request_ms(int ms);
+    // 创建异步结果的通知eventfd，由主线程加入epoll；可读时调用run_completions()
+    static int init_completions();
+    static void run_completions();
+    // 连接被关闭，尚未完成的异步请求不再回写
+    void cancel_pending() {
+        ++m_conn_gen;
+    }
+    // reactor模式下工作线程写、主线程轮询，须为原子变量，否则-O2下轮询会被优化成死循环
+    std::atomic<int> timer_flag;
+    std::atomic<int> improv;
 };
 
 #endif
\ No newline at end of file
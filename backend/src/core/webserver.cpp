@@ -1,5 +1,28 @@
 #include "webserver.h"
 
+// inet_ntoa返回静态缓冲区，多线程下不安全；buf至少INET_ADDRSTRLEN字节
+static const char* client_ip(const sockaddr_in* addr, char* buf) {
+    if (!inet_ntop(AF_INET, &addr->sin_addr, buf, INET_ADDRSTRLEN)) {
+        buf[0] = '\0';
+    }
+    return buf;
+}
+
+static metrics::Counter* const accepted_total = metrics::Registry::get_instance()->counter(
+    "tws_connections_accepted_total", "Accepted connections");
+static metrics::Counter* const rejected_total = metrics::Registry::get_instance()->counter(
+    "tws_connections_rejected_total", "Connections refused because the server was full");
+// 事件循环：每轮epoll_wait返回的事件数、处理耗时、单个事件的最长耗时，以及定时器tick的延迟
+static metrics::Histogram* const loop_batch_size = metrics::Registry::get_instance()->histogram(
+    "tws_event_loop_batch_size", "Events returned by one epoll_wait", "",
+    metrics::Registry::Unit::COUNT);
+static metrics::Histogram* const loop_batch_seconds = metrics::Registry::get_instance()->histogram(
+    "tws_event_loop_batch_seconds", "Time spent handling the events of one epoll_wait");
+static metrics::Histogram* const loop_max_handler_seconds = metrics::Registry::get_instance()->histogram(
+    "tws_event_loop_max_handler_seconds", "Slowest single event handler per epoll_wait batch");
+static metrics::Histogram* const timer_drift_seconds = metrics::Registry::get_instance()->histogram(
+    "tws_timer_tick_drift_seconds", "How late the timer tick ran compared to TIMESLOT");
+
 WebServer::WebServer() {
     m_users = new HttpConn[MAX_FD];
 
@@ -11,6 +34,10 @@ WebServer::WebServer() {
     strcat(m_root, root);
 
     m_users_timer = new ClientData[MAX_FD];
+    m_tick_count = 0;
+    m_conn_pool = nullptr;
+    m_user_store = nullptr;
+    m_completion_fd = -1;
 }
 
 WebServer::~WebServer() {
@@ -18,14 +45,19 @@ WebServer::~WebServer() {
     close(m_listenfd);
     close(m_pipefd[1]);
     close(m_pipefd[0]);
+    close(m_completion_fd);
     delete[] m_users;
     delete[] m_users_timer;
     delete m_thread_pool;
+    AsyncSqlExecutor::get_instance()->stop();
+    delete m_user_store;
 }
 
 void WebServer::init(int port, std::string user, std::string password, std::string database_name, 
                     int log_write, int opt_linger, int trig_mode, int sql_num, 
-                    int thread_num, int close_log, int actor_model) {
+                    int thread_num, int close_log, int actor_model, int sql_affine,
+                    std::string sql_replicas, int read_your_writes_ms, int kdf_threads,
+                    std::string user_store) {
     m_port = port;
     m_user = user;
     m_password = password;
@@ -37,6 +69,11 @@ void WebServer::init(int port, std::string user, std::string password, std::stri
     m_trig_mode = trig_mode;
     m_close_log = close_log;
     m_actor_model = actor_model;
+    m_sql_affine = sql_affine;
+    m_sql_replicas = sql_replicas;
+    m_read_your_writes_ms = read_your_writes_ms;
+    m_kdf_threads = kdf_threads;
+    m_user_store_spec = user_store;
 }
 
 void WebServer::init_trig_mode() {
@@ -55,7 +92,7 @@ void WebServer::init_trig_mode() {
             break;
         case 3: // ET + ET
             m_listen_trig_mode = 1;
-            m_conn_trig_mode = 0;
+            m_conn_trig_mode = 1;
             break;
         default:
             break;
@@ -73,6 +110,19 @@ void WebServer::init_log() {
 }
 
 void WebServer::init_sql_pool() {
+    LoginCache::get_instance()->init(LOGIN_CACHE_CAPACITY, LOGIN_CACHE_POSITIVE_TTL,
+                                     LOGIN_CACHE_NEGATIVE_TTL);
+
+    // 内存用户表(压测用)不连接数据库，连接池和异步执行器都不启动
+    if (m_user_store_spec != "mysql") {
+        m_user_store = UserStore::create(m_user_store_spec, nullptr);
+        if (!m_user_store) {
+            throw std::runtime_error("Invalid user store: " + m_user_store_spec);
+        }
+        HttpConn::init_user_store(m_user_store);
+        return;
+    }
+
     m_conn_pool = ConnectionPool::get_instance();
     ConnectionPoolConfig config{
         .url = "localhost",
@@ -81,15 +131,117 @@ void WebServer::init_sql_pool() {
         .database_name = m_database_name,
         .port = 3306,
         .max_conn = m_sql_num,
-        .close_log = m_close_log
+        .close_log = m_close_log,
+        // 空闲时收缩到一半，负载上来后按需扩容到sql_num
+        .min_conn = (m_sql_num + 1) / 2,
+        // 从库在下面解析，其余字段使用默认值
+        .replicas = {}
     };
+
+    // 解析从库列表 host:port[,host:port...]，只读查询按最少未完成请求分配
+    size_t begin = 0;
+    while (begin < m_sql_replicas.size()) {
+        size_t end = m_sql_replicas.find(',', begin);
+        if (end == std::string::npos) {
+            end = m_sql_replicas.size();
+        }
+        std::string item = m_sql_replicas.substr(begin, end - begin);
+        size_t colon = item.rfind(':');
+        SqlEndpoint endpoint;
+        endpoint.url = item.substr(0, colon);
+        endpoint.port = (colon == std::string::npos) ? 3306 : atoi(item.c_str() + colon + 1);
+        config.replicas.push_back(endpoint);
+        begin = end + 1;
+    }
+    config.read_your_writes_ms = m_read_your_writes_ms;
     m_conn_pool->init(config);
 
-    m_users->init_mysql_result(m_conn_pool);
+    m_user_store = new MySqlUserStore(m_conn_pool);
+    HttpConn::init_user_store(m_user_store);
+
+    // 注册等写请求走非阻塞查询，不占用工作线程
+    if (!AsyncSqlExecutor::get_instance()->init(m_conn_pool)) {
+        LOG_ERROR("%s", "Failed to start async sql executor, registrations will be refused");
+    }
+}
+
+void WebServer::init_session() {
+    SessionStore* sessions = SessionStore::get_instance();
+    sessions->init(SESSION_TTL);
+    int restored = sessions->restore(SESSION_SNAPSHOT_FILE);
+    if (restored < 0) {
+        LOG_ERROR("Ignoring unreadable session snapshot %s", SESSION_SNAPSHOT_FILE);
+    } else {
+        LOG_INFO("Restored %d sessions from %s", restored, SESSION_SNAPSHOT_FILE);
+    }
+}
+
+void WebServer::save_sessions() {
+    if (!SessionStore::get_instance()->snapshot(SESSION_SNAPSHOT_FILE)) {
+        LOG_ERROR("Failed to write session snapshot %s, errno is:%d", SESSION_SNAPSHOT_FILE, errno);
+    }
 }
 
 void WebServer::init_thread_pool() {
-    m_thread_pool = new threadpool<HttpConn>(m_actor_model, m_conn_pool, m_thread_num);
+    m_thread_pool = new threadpool<HttpConn>(m_actor_model, m_conn_pool, m_thread_num, 10000, m_sql_affine == 1);
+
+    // 密码散列使用独立的计算线程池，登录高峰时不占用处理静态请求的工作线程
+    if (!PasswordHasher::get_instance()->init(PasswordHasher::DEFAULT_ITERATIONS, m_kdf_threads, KDF_MAX_PENDING)) {
+        LOG_ERROR("%s", "Failed to start KDF pool, hashing passwords on worker threads");
+    }
+}
+
+void WebServer::init_metrics() {
+    metrics::Registry* registry = metrics::Registry::get_instance();
+    registry->gauge("tws_connections_active", "Open client connections",
+                    [] { return (double)HttpConn::m_user_count.load(); });
+    threadpool<HttpConn>* pool = m_thread_pool;
+    registry->gauge("tws_threadpool_queue_depth", "Requests waiting for a worker thread",
+                    [pool] { return (double)pool->queue_depth(); });
+    registry->gauge("tws_threadpool_threads", "Worker threads",
+                    [this] { return (double)m_thread_num; });
+
+    // 连接池：主库和各从库分别导出
+    ConnectionPool* primary = m_conn_pool;
+    std::vector<std::pair<ConnectionPool*, std::string>> pools;
+    pools.emplace_back(primary, "pool=\"primary\"");
+    for (size_t i = 0; primary && i < primary->get_replica_count(); ++i) {
+        pools.emplace_back(primary->get_replica(i), "pool=\"replica" + std::to_string(i) + "\"");
+    }
+    for (size_t i = 0; primary && i < pools.size(); ++i) {
+        ConnectionPool* p = pools[i].first;
+        const char* labels = pools[i].second.c_str();
+        registry->gauge("tws_db_connections_open", "Open MySQL connections",
+                        [p] { return (double)p->get_total_conn(); }, labels);
+        registry->gauge("tws_db_connections_idle", "Idle MySQL connections",
+                        [p] { return (double)p->get_free_conn(); }, labels);
+        registry->counter_fn("tws_db_acquire_timeouts_total", "Connection acquires that timed out",
+                             [p] { return (double)p->get_stats().connection_timeouts; }, labels);
+        registry->counter_fn("tws_db_connect_failures_total", "Failed attempts to open a connection",
+                             [p] { return (double)p->get_stats().failed_connections; }, labels);
+        registry->counter_fn("tws_db_reconnects_total", "Broken connections replaced by health checks",
+                             [p] { return (double)p->get_stats().reconnects; }, labels);
+    }
+
+    LoginCache* cache = LoginCache::get_instance();
+    registry->counter_fn("tws_login_cache_lookups_total", "Login cache lookups by result",
+                         [cache] { return (double)cache->get_stats().positive_hits; }, "result=\"positive_hit\"");
+    registry->counter_fn("tws_login_cache_lookups_total", "Login cache lookups by result",
+                         [cache] { return (double)cache->get_stats().negative_hits; }, "result=\"negative_hit\"");
+    registry->counter_fn("tws_login_cache_lookups_total", "Login cache lookups by result",
+                         [cache] { return (double)cache->get_stats().misses; }, "result=\"miss\"");
+    registry->gauge("tws_login_cache_entries", "Cached login outcomes",
+                    [cache] { return (double)cache->get_stats().entries; });
+
+    const ComputePool* kdf_pool = PasswordHasher::get_instance()->get_pool();
+    if (kdf_pool) {
+        registry->gauge("tws_kdf_queue_depth", "Password hashing tasks queued or running",
+                        [kdf_pool] { return (double)kdf_pool->get_stats().queue_depth; });
+        registry->counter_fn("tws_kdf_completed_total", "Password hashing tasks completed",
+                             [kdf_pool] { return (double)kdf_pool->get_stats().completed; });
+        registry->counter_fn("tws_kdf_rejected_total", "Password hashing tasks rejected because the queue was full",
+                             [kdf_pool] { return (double)kdf_pool->get_stats().rejected; });
+    }
 }
 
 void WebServer::init_event_listen() {
@@ -131,9 +283,15 @@ void WebServer::init_event_listen() {
     m_utils.set_non_blocking(m_pipefd[1]);
     m_utils.add_fd(m_epollfd, m_pipefd[0], false, 0);
 
+    m_completion_fd = HttpConn::init_completions();
+    assert(m_completion_fd != -1);
+    m_utils.add_fd(m_epollfd, m_completion_fd, false, 0);
+
     m_utils.add_sig(SIGPIPE, SIG_IGN);
     m_utils.add_sig(SIGALRM, m_utils.sig_handler, false);
     m_utils.add_sig(SIGTERM, m_utils.sig_handler, false);
+    m_utils.add_sig(SIGINT, m_utils.sig_handler, false);
+    m_utils.add_sig(SIGUSR1, m_utils.sig_handler, false);
 
     alarm(TIMESLOT);
 
@@ -146,6 +304,7 @@ void WebServer::init_timer(int connfd, struct sockaddr_in client_address) {
 
     m_users_timer[connfd].address = client_address;
     m_users_timer[connfd].sockfd = connfd;
+    m_users_timer[connfd].conn = m_users + connfd;
     UtilTimer* timer = new UtilTimer;
     timer->user_data = &m_users_timer[connfd];
     timer->cb_func = cb_func;
@@ -160,7 +319,7 @@ void WebServer::adjust_timer(UtilTimer* timer) {
     timer->expire = cur + 3 * TIMESLOT;
     m_utils.m_timer_lst.adjust_timer(timer);
 
-    LOG_INFO("%s", "adjust time once");
+    LOG_DEBUG("%s", "adjust time once");
 }
 
 void WebServer::handle_timer(UtilTimer* timer, int sockfd) {
@@ -182,10 +341,12 @@ bool WebServer::handle_client_data() {
             return false;
         }
         if (HttpConn::m_user_count >= MAX_FD) {
+            rejected_total->inc();
             m_utils.show_error(connfd, "Internal server busy");
             LOG_ERROR("%s", "Internal server busy");
             return false;
         }
+        accepted_total->inc();
         init_timer(connfd, client_address);
     } else {
         while (1) {
@@ -195,10 +356,12 @@ bool WebServer::handle_client_data() {
                 break;
             }
             if (HttpConn::m_user_count >= MAX_FD) {
+                rejected_total->inc();
                 m_utils.show_error(connfd, "Internal server busy");
                 LOG_ERROR("%s", "Internal server busy");
                 break;
             }
+            accepted_total->inc();
             init_timer(connfd, client_address);
         }
         return false;        
@@ -222,8 +385,13 @@ bool WebServer::handle_signal(bool &timeout, bool &stop_server) {
                 timeout = true;
                 break;
             case SIGTERM:
+            case SIGINT:
                 stop_server = true;
                 break;
+            // 运行中临时打开/关闭DEBUG日志
+            case SIGUSR1:
+                Log::get_instance()->toggle_debug();
+                break;
             default:
                 break;
             }
@@ -240,6 +408,20 @@ void WebServer::handle_thread(int sockfd) {
         if (timer) {
             adjust_timer(timer);
         }
+        // 抓取/metrics由主线程读取、处理并直接发送，不进入工作队列；未发完的部分照常等EPOLLOUT
+        if (m_users[sockfd].peek_metrics_request()) {
+            bool ok = m_users[sockfd].read_once();
+            if (ok) {
+                // process()会改写读缓冲区，需先判断请求是否完整
+                bool complete = m_users[sockfd].is_metrics_request();
+                m_users[sockfd].process();
+                ok = !complete || m_users[sockfd].write();
+            }
+            if (!ok) {
+                handle_timer(timer, sockfd);
+            }
+            return;
+        }
         m_thread_pool->append(m_users + sockfd, 0);
         while (true) {
             if (m_users[sockfd].improv == 1) {
@@ -254,8 +436,14 @@ void WebServer::handle_thread(int sockfd) {
     } else {
     // proactor 
         if (m_users[sockfd].read_once()) {
-            LOG_INFO("deal with the client(%s)", inet_ntoa(m_users[sockfd].get_address()->sin_addr));
-            m_thread_pool->append_p(m_users + sockfd);
+            char ip[INET_ADDRSTRLEN];
+            LOG_DEBUG("deal with the client(%s)", client_ip(m_users[sockfd].get_address(), ip));
+            // 抓取/metrics直接在主线程处理，不进入工作队列
+            if (m_users[sockfd].is_metrics_request()) {
+                m_users[sockfd].process();
+            } else {
+                m_thread_pool->append_p(m_users + sockfd);
+            }
             if (timer) {
                 adjust_timer(timer);
             }
@@ -288,7 +476,8 @@ void WebServer::handle_write(int sockfd) {
     } else {
     // proactor
         if (m_users[sockfd].write()) {
-            LOG_INFO("send data to the client(%s)", inet_ntoa(m_users[sockfd].get_address()->sin_addr));
+            char ip[INET_ADDRSTRLEN];
+            LOG_DEBUG("send data to the client(%s)", client_ip(m_users[sockfd].get_address(), ip));
             if (timer) {
                 adjust_timer(timer);
             }
@@ -301,6 +490,7 @@ void WebServer::handle_write(int sockfd) {
 void WebServer::event_loop() {
     bool timeout = false;
     bool stop_server = false;
+    int64_t last_tick_us = monotonic::now_us();
 
     while (!stop_server) {
         int number = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUMBER, -1);
@@ -309,32 +499,97 @@ void WebServer::event_loop() {
             break;
         }
 
+        int64_t batch_start_us = monotonic::now_us();
+        int64_t handler_start_us = batch_start_us;
+        int64_t slowest_us = 0;
+        int slowest_fd = -1;
+        const char* slowest_event = "";
         for (int i = 0; i < number; ++i) {
             int sockfd = m_events[i].data.fd;
+            const char* event = "";
 
             if (sockfd == m_listenfd) {
-                bool flag = handle_client_data();
-                if (flag == false) {
-                    continue;
-                }
+                event = "accept";
+                handle_client_data();
             } else if (m_events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                event = "close";
                 UtilTimer* timer = m_users_timer[sockfd].timer;
                 handle_timer(timer, sockfd);
             } else if ((sockfd == m_pipefd[0]) && (m_events[i].events & EPOLLIN)) {
+                event = "signal";
                 bool flag = handle_signal(timeout, stop_server);
                 if (flag == false) {
                     LOG_ERROR("%s", "handle_client_data failure");
                 }
+            } else if (sockfd == m_completion_fd) {
+                event = "completion";
+                HttpConn::run_completions();
             } else if (m_events[i].events & EPOLLIN) {
-                handle_write(sockfd);
+                event = "read";
+                handle_thread(sockfd);
             } else if (m_events[i].events & EPOLLOUT) {
+                event = "write";
                 handle_write(sockfd);
             }
+
+            int64_t handler_end_us = monotonic::now_us();
+            if (handler_end_us - handler_start_us > slowest_us) {
+                slowest_us = handler_end_us - handler_start_us;
+                slowest_fd = sockfd;
+                slowest_event = event;
+            }
+            handler_start_us = handler_end_us;
         }
         if (timeout) {
+            // alarm每TIMESLOT秒触发一次，超出部分即信号投递和事件循环造成的延迟
+            int64_t drift_us = handler_start_us - last_tick_us - TIMESLOT * 1000000LL;
+            timer_drift_seconds->observe(drift_us > 0 ? drift_us : 0);
+            last_tick_us = handler_start_us;
+
             m_utils.timer_handler();
+            SessionStore::get_instance()->expire(time(nullptr));
+            if (++m_tick_count % SESSION_SNAPSHOT_TICKS == 0) {
+                // 事件循环里只复制会话，落盘和fsync交给后台线程
+                SessionStore::get_instance()->snapshot_async(SESSION_SNAPSHOT_FILE);
+            }
             LOG_INFO("%s", "timer tick");
             timeout = false;
+
+            int64_t tick_end_us = monotonic::now_us();
+            if (tick_end_us - handler_start_us > slowest_us) {
+                slowest_us = tick_end_us - handler_start_us;
+                slowest_fd = -1;
+                slowest_event = "timer";
+            }
+            handler_start_us = tick_end_us;
+        }
+
+        if (number > 0) {
+            int64_t batch_us = handler_start_us - batch_start_us;
+            loop_batch_size->observe(number);
+            loop_batch_seconds->observe(batch_us);
+            loop_max_handler_seconds->observe(slowest_us);
+            // 单轮过慢时其他连接都在等待，记录下最慢的事件便于定位
+            if (batch_us >= EVENT_LOOP_WATCHDOG_MS * 1000LL) {
+                LOG_WARN("event loop stalled: %lld us for %d events, slowest %s fd %d took %lld us",
+                         (long long)batch_us, number, slowest_event, slowest_fd, (long long)slowest_us);
+            }
         }
     }
+
+    // 正常退出时保存会话，重启后用户无需重新登录
+    save_sessions();
+    const ComputePool* kdf_pool = PasswordHasher::get_instance()->get_pool();
+    if (kdf_pool) {
+        ComputePool::Stats kdf_stats = kdf_pool->get_stats();
+        LOG_INFO("%s pool: %llu completed, %llu rejected, max queue %llu, avg wait %llu us",
+                 kdf_pool->get_name().c_str(), (unsigned long long)kdf_stats.completed,
+                 (unsigned long long)kdf_stats.rejected, (unsigned long long)kdf_stats.max_queue_depth,
+                 (unsigned long long)(kdf_stats.completed ? kdf_stats.total_wait_us / kdf_stats.completed : 0));
+    }
+    PasswordHasher::get_instance()->stop();
+    LoginCache::Stats cache_stats = LoginCache::get_instance()->get_stats();
+    LOG_INFO("login cache: %llu positive hits, %llu negative hits, %llu misses, hit rate %.2f",
+             (unsigned long long)cache_stats.positive_hits, (unsigned long long)cache_stats.negative_hits,
+             (unsigned long long)cache_stats.misses, cache_stats.hit_rate());
 }
\ No newline at end of file
@@ -15,14 +15,32 @@
 #include "../utils/threadpool/threadpool.h"
 #include "./http/http_conn.h"
 #include "../third_party/sql_connection_pool.h"
+#include "../third_party/async_sql.h"
+#include "./auth/login_cache.h"
+#include "./auth/session_store.h"
+#include "./auth/password_hasher.h"
+#include "./auth/user_store.h"
 #include "../utils/timer/lst_timer.h"
 #include "../utils/log/log.h"
 #include "../utils/block_queue/block_queue.h"
 #include "../utils/lock/locker.h"
+#include "../utils/metrics/metrics.h"
 
 const int MAX_FD = 65536;
 const int MAX_EVENT_NUMBER = 10000;
 const int TIMESLOT = 5;
+// 登录结果缓存：容量，成功/失败结果的有效期（秒）
+const int LOGIN_CACHE_CAPACITY = 65536;
+const int LOGIN_CACHE_POSITIVE_TTL = 300;
+const int LOGIN_CACHE_NEGATIVE_TTL = 30;
+// 会话有效期（秒），快照文件及写快照的间隔（定时器tick数）
+const int SESSION_TTL = 7200;
+const char* const SESSION_SNAPSHOT_FILE = "./sessions.dat";
+const int SESSION_SNAPSHOT_TICKS = 12;
+// 等待散列计算的登录/注册请求上限，超过后直接返回503
+const int KDF_MAX_PENDING = 256;
+// 事件循环单轮处理超过该时间（毫秒）时记录告警，指出最慢的fd
+const int EVENT_LOOP_WATCHDOG_MS = 100;
 
 class WebServer {
 public:
@@ -31,10 +49,15 @@ public:
 
     void init(int port, std::string user, std::string password, std::string database_name, 
              int log_write, int opt_linger, int trig_mode, int sql_num, 
-             int thread_num, int close_log, int actor_model);
+             int thread_num, int close_log, int actor_model, int sql_affine = 0,
+             std::string sql_replicas = "", int read_your_writes_ms = 0, int kdf_threads = 2,
+             std::string user_store = "mysql");
 
     void init_thread_pool();
+    // 注册/metrics中由其他模块状态计算的指标，需在连接池和线程池初始化之后调用
+    void init_metrics();
     void init_sql_pool();
+    void init_session();
     void init_log();
     void init_trig_mode();
     void init_event_listen();
@@ -44,6 +67,7 @@ public:
     void handle_timer(UtilTimer *timer, int sockfd);
     bool handle_client_data();
     bool handle_signal(bool& timeout, bool& stop_server);
+    void save_sessions();
     void handle_thread(int sockfd);
     void handle_write(int sockfd);
 
@@ -58,6 +82,8 @@ private:
     // 网络相关
     int m_pipefd[2];
     int m_epollfd;
+    // 异步请求(登录、注册)的结果由此eventfd通知主线程
+    int m_completion_fd;
     int m_listenfd;
     int m_opt_linger;
     int m_trig_mode;
@@ -71,15 +97,23 @@ private:
     std::string m_password;
     std::string m_database_name;
     int m_sql_num;
+    int m_sql_affine;
+    std::string m_sql_replicas;
+    int m_read_your_writes_ms;
+    // 用户表后端，见UserStore
+    std::string m_user_store_spec;
+    UserStore *m_user_store;
 
     // 线程池相关
     threadpool<HttpConn> *m_thread_pool;
     int m_thread_num;
+    int m_kdf_threads;
 
     // 客户端相关
     HttpConn *m_users;
     ClientData *m_users_timer;
     Utils m_utils;
+    int m_tick_count;
 };
 
 #endif
\ No newline at end of file
@@ -36,6 +36,17 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Failed to initialize log system\n");
         return 1;
     }
+    Log::get_instance()->set_level((Log::Level)g_Config.get_log_level());
+    // 二进制访问日志，用tools/access_log_dump查看
+    if (!Log::get_instance()->init_access("./AccessLog", g_Config.get_access_sample())) {
+        fprintf(stderr, "Failed to open access log\n");
+    }
+    // 抓取原始请求流量，用tools/tws_replay回放
+    if (!g_Config.get_capture_file().empty() &&
+        !Log::get_instance()->init_capture(g_Config.get_capture_file().c_str())) {
+        fprintf(stderr, "Failed to open capture file %s\n", g_Config.get_capture_file().c_str());
+    }
+    HttpConn::set_slow_request_ms(g_Config.get_slow_request_ms());
 
     // 设置信号处理
     struct sigaction sa;
@@ -52,7 +63,9 @@ int main(int argc, char *argv[]) {
         g_Server.init(g_Config.get_port(), user, password, databasename, 
                    g_Config.get_log_write(), g_Config.get_opt_linger(), g_Config.get_trig_mode(),
                    g_Config.get_sql_num(), g_Config.get_thread_num(), g_Config.get_close_log(), 
-                   g_Config.get_actor_model());
+                   g_Config.get_actor_model(), g_Config.get_sql_affine(),
+                   g_Config.get_sql_replicas(), g_Config.get_read_your_writes_ms(),
+                   g_Config.get_kdf_threads(), g_Config.get_user_store());
 
         // 初始化日志写入
         g_Server.init_log();
@@ -62,10 +75,16 @@ int main(int argc, char *argv[]) {
         g_Server.init_sql_pool();
         LOG_INFO("Database connection pool initialized");
 
+        // 恢复会话快照
+        g_Server.init_session();
+
         // 初始化线程池
         g_Server.init_thread_pool();
         LOG_INFO("Thread pool initialized");
 
+        // 注册/metrics导出的指标
+        g_Server.init_metrics();
+
         // 设置触发模式
         g_Server.init_trig_mode();
         LOG_INFO("Trigger mode set to %d", g_Config.get_trig_mode());
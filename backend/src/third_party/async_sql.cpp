@@ -0,0 +1,375 @@
+#include "async_sql.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+
+#include "../utils/timer/monotonic.h"
+#include "../utils/trace/probes.h"
+
+AsyncSqlExecutor::AsyncSqlExecutor()
+    : m_pool(nullptr)
+    , m_epollfd(-1)
+    , m_eventfd(-1)
+    , m_thread(0)
+    , m_running(false)
+    , m_stop(false)
+    , m_inflight(0)
+    , m_max_pending(0)
+    , m_query_timeout_ms(0)
+    , m_lock("async_sql_submit") {
+}
+
+AsyncSqlExecutor::~AsyncSqlExecutor() {
+    stop();
+}
+
+AsyncSqlExecutor* AsyncSqlExecutor::get_instance() {
+    static AsyncSqlExecutor executor;
+    return &executor;
+}
+
+bool AsyncSqlExecutor::init(ConnectionPool* pool, int max_pending, int query_timeout_ms) {
+    if (m_running || pool == nullptr || max_pending <= 0 || query_timeout_ms <= 0) {
+        return false;
+    }
+    m_pool = pool;
+    m_max_pending = max_pending;
+    m_query_timeout_ms = query_timeout_ms;
+
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollfd < 0) {
+        return false;
+    }
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventfd < 0) {
+        close(m_epollfd);
+        m_epollfd = -1;
+        return false;
+    }
+
+    // data.ptr == nullptr marks the wakeup fd, every other event is an Operation
+    epoll_event event;
+    event.data.ptr = nullptr;
+    event.events = EPOLLIN;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_eventfd, &event);
+
+    m_stop = false;
+    if (pthread_create(&m_thread, nullptr, loop_thread, this) != 0) {
+        close(m_eventfd);
+        close(m_epollfd);
+        m_eventfd = m_epollfd = -1;
+        return false;
+    }
+    m_running = true;
+    return true;
+}
+
+void AsyncSqlExecutor::stop() {
+    if (!m_running) {
+        return;
+    }
+    m_stop = true;
+    uint64_t one = 1;
+    ssize_t ret = ::write(m_eventfd, &one, sizeof(one));
+    (void)ret;
+    pthread_join(m_thread, nullptr);
+    m_running = false;
+
+    // Shutting down: drop whatever never completed without running callbacks
+    take_submitted();
+    for (Operation* op : m_waiting) {
+        delete op;
+    }
+    m_waiting.clear();
+    for (Operation* op : m_active) {
+        if (op->result) {
+            mysql_free_result(op->result);
+        }
+        m_pool->discard_connection(op->conn);
+        delete op;
+    }
+    m_active.clear();
+    m_inflight = 0;
+
+    close(m_eventfd);
+    close(m_epollfd);
+    m_eventfd = m_epollfd = -1;
+}
+
+bool AsyncSqlExecutor::submit(const std::string& sql, AsyncSqlCallback cb) {
+    Operation* op = new Operation;
+    op->sql = sql;
+    op->cb = std::move(cb);
+    return enqueue(op);
+}
+
+bool AsyncSqlExecutor::submit(AsyncSqlBuilder build, AsyncSqlCallback cb) {
+    Operation* op = new Operation;
+    op->build = std::move(build);
+    op->cb = std::move(cb);
+    return enqueue(op);
+}
+
+bool AsyncSqlExecutor::enqueue(Operation* op) {
+    if (!m_running) {
+        delete op;
+        return false;
+    }
+    // Reserve the slot first: a separate check and increment would let
+    // concurrent submitters all pass the check and overshoot max_pending
+    if (m_inflight.fetch_add(1) >= m_max_pending) {
+        m_inflight.fetch_sub(1);
+        delete op;
+        return false;
+    }
+    op->conn = nullptr;
+    op->result = nullptr;
+    op->stage = STAGE_QUERY;
+    op->registered = false;
+    op->sent = false;
+    op->submitted_us = monotonic::now_us();
+    op->acquired_us = 0;
+    op->deadline_us = 0;
+
+    m_lock.lock();
+    m_submitted.push_back(op);
+    m_lock.unlock();
+
+    uint64_t one = 1;
+    ssize_t ret = ::write(m_eventfd, &one, sizeof(one));
+    (void)ret;
+    return true;
+}
+
+void* AsyncSqlExecutor::loop_thread(void* arg) {
+    mysql_thread_init();
+    static_cast<AsyncSqlExecutor*>(arg)->run_loop();
+    mysql_thread_end();
+    return nullptr;
+}
+
+void AsyncSqlExecutor::run_loop() {
+    epoll_event events[MAX_EVENTS];
+    while (!m_stop) {
+        int number = epoll_wait(m_epollfd, events, MAX_EVENTS, next_timeout_ms());
+        if (number < 0 && errno != EINTR) {
+            LOG_ERROR("%s", "async sql epoll failure");
+            break;
+        }
+
+        for (int i = 0; i < number; ++i) {
+            Operation* op = static_cast<Operation*>(events[i].data.ptr);
+            if (op == nullptr) {
+                uint64_t count;
+                while (::read(m_eventfd, &count, sizeof(count)) > 0) {
+                }
+                take_submitted();
+            } else {
+                step(op);
+            }
+        }
+        expire_active();
+        dispatch_waiting();
+    }
+}
+
+int AsyncSqlExecutor::next_timeout_ms() const {
+    int timeout = m_waiting.empty() ? -1 : WAITING_POLL_MS;
+    if (!m_active.empty()) {
+        uint64_t now = (uint64_t)monotonic::now_us();
+        uint64_t deadline = m_active.front()->deadline_us;
+        // Round up so the wakeup does not come just before the deadline
+        int until = deadline > now ? (int)((deadline - now + 999) / 1000) : 0;
+        timeout = timeout < 0 ? until : std::min(timeout, until);
+    }
+    return timeout;
+}
+
+void AsyncSqlExecutor::take_submitted() {
+    m_lock.lock();
+    m_waiting.splice(m_waiting.end(), m_submitted);
+    m_lock.unlock();
+}
+
+void AsyncSqlExecutor::dispatch_waiting() {
+    // Same bound a blocking caller of get_connection() would get
+    int timeout_ms = m_pool->get_acquire_timeout_ms();
+    if (timeout_ms > 0) {
+        uint64_t now = (uint64_t)monotonic::now_us();
+        while (!m_waiting.empty() && now - m_waiting.front()->submitted_us > (uint64_t)timeout_ms * 1000) {
+            Operation* op = m_waiting.front();
+            m_waiting.pop_front();
+            expire(op);
+        }
+    }
+
+    while (!m_waiting.empty()) {
+        MYSQL* conn = m_pool->try_get_connection();
+        if (conn == nullptr) {
+            return;
+        }
+        Operation* op = m_waiting.front();
+        m_waiting.pop_front();
+        op->conn = conn;
+        op->acquired_us = monotonic::now_us();
+        TWS_PROBE1(db_acquire, (op->acquired_us - op->submitted_us) * 1000);
+        op->deadline_us = op->acquired_us + (uint64_t)m_query_timeout_ms * 1000;
+        op->active_pos = m_active.insert(m_active.end(), op);
+        if (op->build) {
+            op->sql = op->build(conn);
+            if (op->sql.empty()) {
+                finish(op, false);
+                continue;
+            }
+        }
+        step(op);
+    }
+}
+
+void AsyncSqlExecutor::expire_active() {
+    // Every op gets the same timeout, so the list is in deadline order
+    uint64_t now = (uint64_t)monotonic::now_us();
+    while (!m_active.empty() && m_active.front()->deadline_us <= now) {
+        expire(m_active.front());
+    }
+}
+
+void AsyncSqlExecutor::step(Operation* op) {
+    while (true) {
+        net_async_status status;
+        switch (op->stage) {
+            case STAGE_QUERY:
+                status = mysql_real_query_nonblocking(op->conn, op->sql.c_str(), op->sql.size());
+                break;
+            case STAGE_STORE:
+                status = mysql_store_result_nonblocking(op->conn, &op->result);
+                break;
+            default:
+                finish(op, false);
+                return;
+        }
+
+        if (status == NET_ASYNC_NOT_READY) {
+            if (op->stage == STAGE_QUERY && !op->sent) {
+                // The client library blocks on a full send buffer, so a socket
+                // that still has room means the query went out and the reply
+                // is what it waits for
+                struct pollfd pfd = {op->conn->net.fd, POLLOUT, 0};
+                op->sent = poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+            }
+            if (!arm(op)) {
+                finish(op, false);
+            }
+            return;
+        }
+        if (status == NET_ASYNC_ERROR) {
+            finish(op, false);
+            return;
+        }
+        if (op->stage == STAGE_QUERY) {
+            op->stage = STAGE_STORE;
+            continue;
+        }
+        // Statements without a result set complete with a null result
+        finish(op, op->result != nullptr || mysql_errno(op->conn) == 0);
+        return;
+    }
+}
+
+bool AsyncSqlExecutor::arm(Operation* op) {
+    epoll_event event;
+    event.data.ptr = op;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    if (op->stage == STAGE_QUERY && !op->sent) {
+        event.events |= EPOLLOUT;
+    }
+    int ctl = op->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(m_epollfd, ctl, op->conn->net.fd, &event) != 0) {
+        LOG_ERROR("async sql epoll_ctl failed, errno is:%d", errno);
+        return false;
+    }
+    op->registered = true;
+    return true;
+}
+
+void AsyncSqlExecutor::finish(Operation* op, bool ok) {
+    if (op->registered) {
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, op->conn->net.fd, 0);
+    }
+    m_active.erase(op->active_pos);
+
+    AsyncSqlResult res;
+    res.ok = ok;
+    res.timed_out = false;
+    res.err_no = mysql_errno(op->conn);
+    res.error = ok ? "" : mysql_error(op->conn);
+    res.affected_rows = ok ? mysql_affected_rows(op->conn) : 0;
+    res.result = op->result;
+    if (!ok) {
+        LOG_ERROR("async sql error:%s", res.error.c_str());
+    }
+
+    // The callback reads this op's connection times like a ConnectionRAII user
+    ConnectionRAII::ThreadMarks marks = {op->submitted_us, op->acquired_us, (uint64_t)monotonic::now_us()};
+    ConnectionRAII::set_thread_marks(marks);
+    if (op->cb) {
+        op->cb(res);
+    }
+    if (op->result) {
+        mysql_free_result(op->result);
+    }
+    uint64_t hold_us = monotonic::now_us() - op->acquired_us;
+    m_pool->record_hold(hold_us);
+    TWS_PROBE1(db_release, hold_us * 1000);
+    m_pool->release_connection(op->conn);
+    delete op;
+    --m_inflight;
+}
+
+void AsyncSqlExecutor::expire(Operation* op) {
+    AsyncSqlResult res;
+    res.ok = false;
+    res.timed_out = true;
+    res.err_no = 0;
+    res.affected_rows = 0;
+    res.result = nullptr;
+    if (op->conn) {
+        res.error = "query timeout";
+        LOG_WARN("async sql query timed out after %d ms", m_query_timeout_ms);
+    } else {
+        res.error = "connection pool timeout";
+        LOG_WARN("%s", "async sql gave up waiting for a pooled connection");
+    }
+
+    ConnectionRAII::ThreadMarks marks = {0, 0, 0};
+    if (op->conn) {
+        marks = {op->submitted_us, op->acquired_us, (uint64_t)monotonic::now_us()};
+    }
+    ConnectionRAII::set_thread_marks(marks);
+    if (op->cb) {
+        op->cb(res);
+    }
+    if (op->conn) {
+        // The protocol state is unknown mid query, so the connection is not
+        // pooled again. shutdown() first keeps mysql_close() from blocking on
+        // a send buffer the stalled server never drains.
+        if (op->registered) {
+            epoll_ctl(m_epollfd, EPOLL_CTL_DEL, op->conn->net.fd, 0);
+        }
+        m_active.erase(op->active_pos);
+        shutdown(op->conn->net.fd, SHUT_RDWR);
+        if (op->result) {
+            mysql_free_result(op->result);
+        }
+        uint64_t hold_us = monotonic::now_us() - op->acquired_us;
+        m_pool->record_hold(hold_us);
+        TWS_PROBE1(db_release, hold_us * 1000);
+        m_pool->discard_connection(op->conn);
+    }
+    delete op;
+    --m_inflight;
+}
@@ -0,0 +1,121 @@
+#ifndef _ASYNC_SQL_
+#define _ASYNC_SQL_
+
+#include <mysql/mysql.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <string>
+
+#include "../utils/lock/locker.h"
+#include "sql_connection_pool.h"
+
+// Result handed to an AsyncSqlCallback. `result` is only valid for the
+// duration of the callback and is freed by the executor afterwards. During
+// the callback ConnectionRAII::thread_marks() describes the operation's
+// connection (submit, acquire and completion times; zero if it never got one).
+struct AsyncSqlResult {
+    bool ok;
+    // No pooled connection became available within the pool's acquire
+    // timeout, or the query itself outlived the query timeout
+    bool timed_out;
+    unsigned int err_no;
+    std::string error;
+    unsigned long long affected_rows;
+    MYSQL_RES* result;
+};
+
+typedef std::function<void(const AsyncSqlResult&)> AsyncSqlCallback;
+// Builds the statement once a connection is assigned, so values can be
+// escaped for that connection's charset and sql_mode. Returning an empty
+// string fails the query.
+typedef std::function<std::string(MYSQL*)> AsyncSqlBuilder;
+
+// Runs queries with the MySQL 8 non-blocking client API on a dedicated
+// event loop. Connections are borrowed from ConnectionPool without blocking,
+// their sockets are parked in the executor's epoll set while the server
+// works, and the callback fires on the executor thread once the result has
+// been stored. A caller never occupies a worker thread while waiting on MySQL.
+class AsyncSqlExecutor {
+public:
+    static AsyncSqlExecutor* get_instance();
+
+    // A query that has not completed `query_timeout_ms` after it got its
+    // connection is abandoned: the connection is closed, not pooled again
+    bool init(ConnectionPool* pool, int max_pending = 1024, int query_timeout_ms = 5000);
+    void stop();
+    bool is_running() const { return m_running; }
+
+    // Queues `sql`; returns false if the executor is not running or the
+    // pending limit is reached, in which case `cb` is never invoked.
+    bool submit(const std::string& sql, AsyncSqlCallback cb);
+    bool submit(AsyncSqlBuilder build, AsyncSqlCallback cb);
+
+    size_t get_inflight() const { return m_inflight; }
+
+private:
+    enum Stage {
+        STAGE_QUERY = 0,
+        STAGE_STORE
+    };
+
+    struct Operation {
+        std::string sql;
+        AsyncSqlBuilder build;
+        AsyncSqlCallback cb;
+        MYSQL* conn;
+        MYSQL_RES* result;
+        uint64_t submitted_us;
+        uint64_t acquired_us;
+        uint64_t deadline_us;
+        Stage stage;
+        bool registered;
+        // The query has been handed to the kernel; until then the op also
+        // waits for the socket to become writable
+        bool sent;
+        std::list<Operation*>::iterator active_pos;
+    };
+
+    static const int MAX_EVENTS = 256;
+    // Poll interval used only while operations wait for a free connection
+    static const int WAITING_POLL_MS = 5;
+
+    AsyncSqlExecutor();
+    ~AsyncSqlExecutor();
+    AsyncSqlExecutor(const AsyncSqlExecutor&) = delete;
+    AsyncSqlExecutor& operator=(const AsyncSqlExecutor&) = delete;
+
+    static void* loop_thread(void* arg);
+    void run_loop();
+    int next_timeout_ms() const;
+    bool enqueue(Operation* op);
+    void take_submitted();
+    void dispatch_waiting();
+    void expire_active();
+    void step(Operation* op);
+    bool arm(Operation* op);
+    void finish(Operation* op, bool ok);
+    void expire(Operation* op);
+
+    ConnectionPool* m_pool;
+    int m_epollfd;
+    int m_eventfd;
+    pthread_t m_thread;
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_stop;
+    std::atomic<size_t> m_inflight;
+    size_t m_max_pending;
+    int m_query_timeout_ms;
+
+    // Filled by submit() from any thread, drained by the loop thread
+    locker::Mutex m_lock;
+    std::list<Operation*> m_submitted;
+    // Loop thread only: operations still waiting for a connection, and ones
+    // holding a connection in acquire (and so deadline) order
+    std::list<Operation*> m_waiting;
+    std::list<Operation*> m_active;
+};
+
+#endif
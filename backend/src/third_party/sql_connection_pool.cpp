@@ -1,15 +1,55 @@
 #include "sql_connection_pool.h"
 
-ConnectionPool::ConnectionPool() 
+#include <mysql/errmsg.h>
+#include <vector>
+
+#include "../utils/metrics/metrics.h"
+#include "../utils/timer/monotonic.h"
+#include "../utils/trace/probes.h"
+
+constexpr uint64_t ConnectionPool::WAIT_BUCKET_BOUNDS_US[];
+
+namespace {
+// Shared by the primary and replica sub-pools; PoolStats keeps the per-pool view
+metrics::Histogram* const acquire_seconds = metrics::Registry::get_instance()->histogram(
+    "tws_db_acquire_seconds", "Time spent waiting for a pooled MySQL connection, timeouts included");
+metrics::Histogram* const hold_seconds = metrics::Registry::get_instance()->histogram(
+    "tws_db_hold_seconds", "Time a MySQL connection stayed checked out (queries and result handling)");
+
+// Per-thread state of a thread-affine connection
+struct AffineSlot {
+    ConnectionPool* pool;
+    MYSQL* conn;
+    uint64_t last_used_us;
+    bool in_use;
+    // Set once the thread got a connection, so it rebinds after a breakage
+    bool rebind;
+};
+thread_local AffineSlot t_affine = {nullptr, nullptr, 0, false, false};
+thread_local ConnectionRAII::ThreadMarks t_marks = {0, 0, 0};
+}
+
+ConnectionPool::ConnectionPool()
     : m_max_conn(0)
+    , m_min_conn(0)
     , m_cur_conn(0)
     , m_free_conn(0)
-    , m_close_log(0) {
-    // Initialize atomic members individually
-    m_stats.total_connections = 0;
-    m_stats.active_connections = 0;
-    m_stats.connection_timeouts = 0;
-    m_stats.failed_connections = 0;
+    , m_total_conn(0)
+    , m_lock("sql_pool")
+    , m_close_log(0)
+    , m_acquire_timeout_ms(0)
+    , m_idle_timeout_s(0)
+    , m_health_check_interval_s(0)
+    , m_connect_timeout_s(0)
+    , m_bound(0)
+    , m_outstanding(0)
+    , m_next_replica(0)
+    , m_read_your_writes_ms(0)
+    , m_last_write_us(0)
+    , m_recent_lock("sql_recent_writes")
+    , m_maintainer(0)
+    , m_maintainer_running(false)
+    , m_stop(false) {
 }
 
 ConnectionPool::~ConnectionPool() {
@@ -21,101 +61,592 @@ ConnectionPool* ConnectionPool::get_instance() {
     return &conn_pool;
 }
 
+MYSQL* ConnectionPool::connect_one() {
+    MYSQL* con = mysql_init(nullptr);
+    if (con == nullptr) {
+        LOG_ERROR("%s", "Failed to initialize MySQL connection");
+        ++m_stats.failed_connections;
+        return nullptr;
+    }
+    if (m_connect_timeout_s > 0) {
+        unsigned int timeout = m_connect_timeout_s;
+        mysql_options(con, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    }
+    if (mysql_real_connect(con, m_url.c_str(), m_user.c_str(), m_password.c_str(),
+                           m_database_name.c_str(), atoi(m_port.c_str()), nullptr, 0) == nullptr) {
+        LOG_ERROR("Failed to connect to MySQL: %s", mysql_error(con));
+        mysql_close(con);
+        ++m_stats.failed_connections;
+        return nullptr;
+    }
+    ++m_stats.total_connections;
+    return con;
+}
+
+namespace {
+struct ConnectTask {
+    ConnectionPool* pool;
+    MYSQL* (ConnectionPool::*connect)();
+    MYSQL* conn;
+    pthread_t tid;
+};
+
+void* connect_task(void* arg) {
+    ConnectTask* task = static_cast<ConnectTask*>(arg);
+    task->conn = (task->pool->*(task->connect))();
+    mysql_thread_end();
+    return nullptr;
+}
+}
+
 void ConnectionPool::init(const ConnectionPoolConfig& config) {
-    try {
-        m_url = config.url;
-        m_port = to_string(config.port);
-        m_user = config.user;
-        m_password = config.password;
-        m_database_name = config.database_name;
-        m_close_log = config.close_log;
-
-        for (int i = 0; i < config.max_conn; ++i) {
-            MYSQL* con = nullptr;
-            con = mysql_init(con);
-            if (con == nullptr) {
-                throw std::runtime_error("Failed to initialize MySQL connection");
+    m_url = config.url;
+    m_port = to_string(config.port);
+    m_user = config.user;
+    m_password = config.password;
+    m_database_name = config.database_name;
+    m_close_log = config.close_log;
+    m_max_conn = config.max_conn;
+    m_min_conn = (config.min_conn > 0 && config.min_conn < config.max_conn) ? config.min_conn : config.max_conn;
+    m_acquire_timeout_ms = config.acquire_timeout_ms;
+    m_idle_timeout_s = config.idle_timeout_s;
+    m_health_check_interval_s = config.health_check_interval_s;
+    m_connect_timeout_s = config.connect_timeout_s;
+
+    // mysql_init() is only thread-safe once the library has been initialised
+    mysql_library_init(0, nullptr, nullptr);
+
+    // Open the initial connections in parallel so startup costs one round trip
+    std::vector<ConnectTask> tasks(m_min_conn);
+    for (auto& task : tasks) {
+        task.pool = this;
+        task.connect = &ConnectionPool::connect_one;
+        task.conn = nullptr;
+        if (pthread_create(&task.tid, nullptr, connect_task, &task) != 0) {
+            task.tid = 0;
+            task.conn = connect_one();
+        }
+    }
+    bool failed = false;
+    for (auto& task : tasks) {
+        if (task.tid) {
+            pthread_join(task.tid, nullptr);
+        }
+        if (task.conn == nullptr) {
+            failed = true;
+        }
+    }
+    if (failed) {
+        for (auto& task : tasks) {
+            if (task.conn) {
+                mysql_close(task.conn);
             }
+        }
+        throw std::runtime_error("Failed to connect to MySQL at " + m_url + ":" + m_port);
+    }
+
+    uint64_t now = monotonic::now_us();
+    m_lock.lock();
+    for (auto& task : tasks) {
+        m_idle.push_back(IdleConn{task.conn, now});
+    }
+    m_free_conn = m_min_conn;
+    m_total_conn = m_min_conn;
+    m_lock.unlock();
+    m_reserve = locker::Semaphore(m_max_conn);
 
-            con = mysql_real_connect(con, m_url.c_str(), m_user.c_str(), m_password.c_str(), 
-                                   m_database_name.c_str(), config.port, nullptr, 0);
-            if (con == nullptr) {
-                throw std::runtime_error("Failed to connect to MySQL: " + 
-                                       std::string(mysql_error(con)));
+    if (m_health_check_interval_s > 0) {
+        m_stop = false;
+        if (pthread_create(&m_maintainer, nullptr, maintain_thread, this) == 0) {
+            m_maintainer_running = true;
+        } else {
+            LOG_ERROR("%s", "Failed to start connection pool health check thread");
+        }
+    }
+
+    m_read_your_writes_ms = config.read_your_writes_ms;
+    for (const SqlEndpoint& endpoint : config.replicas) {
+        ConnectionPoolConfig replica_config = config;
+        replica_config.url = endpoint.url;
+        replica_config.port = endpoint.port;
+        replica_config.replicas.clear();
+        unique_ptr<ConnectionPool> replica(new ConnectionPool());
+        try {
+            replica->init(replica_config);
+        } catch (const std::exception& e) {
+            // A missing replica only costs read capacity; the primary serves its share
+            LOG_ERROR("Skipping replica %s:%d: %s", endpoint.url.c_str(), endpoint.port, e.what());
+            continue;
+        }
+        m_replicas.push_back(std::move(replica));
+    }
+}
+
+ConnectionPool* ConnectionPool::route(Route route, const string& key) {
+    if (route == Route::PRIMARY || m_replicas.empty()) {
+        return this;
+    }
+
+    if (m_read_your_writes_ms > 0) {
+        uint64_t window_start = monotonic::now_us() - (uint64_t)m_read_your_writes_ms * 1000;
+        if (key.empty()) {
+            if (m_last_write_us > window_start) {
+                return this;
             }
-            m_conn_list.emplace_back(con);
-            ++m_free_conn;
-            ++m_stats.total_connections;
+        } else if (m_last_write_us > window_start) {
+            // Only consult the map while some write is still inside the window
+            locker::LockGuard guard(m_recent_lock);
+            auto it = m_recent_writes.find(key);
+            if (it != m_recent_writes.end()) {
+                if (it->second > window_start) {
+                    return this;
+                }
+                m_recent_writes.erase(it);
+            }
+        }
+    }
+
+    // Least outstanding requests; the rotating start index breaks ties
+    size_t count = m_replicas.size();
+    size_t start = m_next_replica++ % count;
+    ConnectionPool* best = nullptr;
+    int best_outstanding = 0;
+    for (size_t i = 0; i < count; ++i) {
+        ConnectionPool* replica = m_replicas[(start + i) % count].get();
+        int outstanding = replica->m_outstanding.load(std::memory_order_relaxed);
+        if (best == nullptr || outstanding < best_outstanding) {
+            best = replica;
+            best_outstanding = outstanding;
         }
-        m_reserve = locker::Semaphore(m_free_conn);
-        m_max_conn = m_free_conn;
-    } catch (const std::exception& e) {
-        destroy_pool();
-        throw;
     }
+    return best;
+}
+
+void ConnectionPool::note_write(const string& key) {
+    if (m_replicas.empty() || m_read_your_writes_ms <= 0) {
+        return;
+    }
+    uint64_t now = monotonic::now_us();
+    m_last_write_us = now;
+    if (key.empty()) {
+        return;
+    }
+
+    locker::LockGuard guard(m_recent_lock);
+    m_recent_writes[key] = now;
+    // Keep the map bounded by the write rate inside one window
+    if (m_recent_writes.size() > 4096) {
+        uint64_t window_start = now - (uint64_t)m_read_your_writes_ms * 1000;
+        for (auto it = m_recent_writes.begin(); it != m_recent_writes.end();) {
+            if (it->second <= window_start) {
+                it = m_recent_writes.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+void ConnectionPool::record_wait(uint64_t wait_us) {
+    int bucket = 0;
+    while (bucket < WAIT_BUCKETS - 1 && wait_us > WAIT_BUCKET_BOUNDS_US[bucket]) {
+        ++bucket;
+    }
+    ++m_stats.wait_buckets[bucket];
+    ++m_stats.wait_count;
+    m_stats.total_wait_us += wait_us;
+    acquire_seconds->observe(wait_us);
 }
 
 MYSQL* ConnectionPool::get_connection(int timeout_ms) {
-    MYSQL* con = nullptr;
-    if (m_conn_list.empty()) {
-        return nullptr;
+    if (timeout_ms < 0) {
+        timeout_ms = m_acquire_timeout_ms;
     }
 
-    if (!m_reserve.wait()) {
+    uint64_t start = monotonic::now_us();
+    bool acquired = (timeout_ms == 0) ? m_reserve.wait() : m_reserve.timed_wait(timeout_ms);
+    record_wait(monotonic::now_us() - start);
+    if (!acquired) {
         ++m_stats.connection_timeouts;
+        LOG_WARN("get_connection timed out after %d ms", timeout_ms);
         return nullptr;
     }
+    return checkout();
+}
 
+MYSQL* ConnectionPool::try_get_connection() {
+    if (!m_reserve.try_wait()) {
+        return nullptr;
+    }
+    return checkout();
+}
+
+MYSQL* ConnectionPool::checkout() {
+    // The caller holds a permit, so either an idle connection exists or the
+    // pool is below max_conn and may open a new one
+    MYSQL* con = nullptr;
     m_lock.lock();
-    con = m_conn_list.front();
-    m_conn_list.pop_front();
-    --m_free_conn;
+    if (!m_idle.empty()) {
+        con = m_idle.back().conn;
+        m_idle.pop_back();
+        --m_free_conn;
+    } else {
+        ++m_total_conn;
+    }
     ++m_cur_conn;
-    ++m_stats.active_connections;
     m_lock.unlock();
 
+    if (con == nullptr) {
+        con = connect_one();
+        if (con == nullptr) {
+            m_lock.lock();
+            --m_total_conn;
+            --m_cur_conn;
+            m_lock.unlock();
+            m_reserve.post();
+            return nullptr;
+        }
+    }
+    ++m_stats.active_connections;
+    ++m_outstanding;
     return con;
 }
 
+bool ConnectionPool::is_broken(MYSQL* con) {
+    unsigned int err = mysql_errno(con);
+    return err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
+}
+
 bool ConnectionPool::release_connection(MYSQL* con) {
     if (con == nullptr) {
         return false;
     }
-    m_lock.lock();
+    // A connection that lost the server is dropped here; the next checkout
+    // opens a replacement, so callers reconnect without noticing
+    bool broken = is_broken(con);
+    if (broken) {
+        LOG_WARN("Dropping broken MySQL connection: %s", mysql_error(con));
+    }
+    put_back(con, broken);
+    return true;
+}
 
-    m_conn_list.push_back(con);
-    ++m_free_conn;
-    --m_cur_conn;
-    --m_stats.active_connections;
+void ConnectionPool::discard_connection(MYSQL* con) {
+    if (con != nullptr) {
+        put_back(con, true);
+    }
+}
 
+void ConnectionPool::put_back(MYSQL* con, bool drop) {
+    m_lock.lock();
+    --m_cur_conn;
+    if (drop) {
+        --m_total_conn;
+    } else {
+        m_idle.push_back(IdleConn{con, (uint64_t)monotonic::now_us()});
+        ++m_free_conn;
+    }
     m_lock.unlock();
+    --m_stats.active_connections;
+    --m_outstanding;
 
+    if (drop) {
+        mysql_close(con);
+        ++m_stats.reconnects;
+    }
     m_reserve.post();
+}
+
+void ConnectionPool::record_hold(uint64_t hold_us) {
+    hold_seconds->observe(hold_us);
+    ++m_stats.hold_count;
+    m_stats.total_hold_us += hold_us;
+    uint64_t prev = m_stats.max_hold_us.load(std::memory_order_relaxed);
+    while (hold_us > prev &&
+           !m_stats.max_hold_us.compare_exchange_weak(prev, hold_us, std::memory_order_relaxed)) {
+    }
+}
+
+bool ConnectionPool::reserve_bound() {
+    if (m_bound.fetch_add(1) >= m_max_conn - 1) {
+        --m_bound;
+        return false;
+    }
     return true;
 }
 
+bool ConnectionPool::bind_thread_connection() {
+    AffineSlot& slot = t_affine;
+    if (slot.pool != nullptr) {
+        return slot.pool == this && slot.conn != nullptr;
+    }
+    slot.pool = this;
+    if (!reserve_bound()) {
+        return false;
+    }
+    slot.conn = get_connection();
+    if (slot.conn == nullptr) {
+        --m_bound;
+        return false;
+    }
+    slot.last_used_us = monotonic::now_us();
+    slot.rebind = true;
+    return true;
+}
+
+MYSQL* ConnectionPool::take_thread_connection() {
+    AffineSlot& slot = t_affine;
+    if (slot.pool != this || slot.in_use) {
+        return nullptr;
+    }
+    if (slot.conn == nullptr) {
+        // Lost the previous one; rebind only if that costs no waiting
+        if (!slot.rebind || !reserve_bound()) {
+            return nullptr;
+        }
+        slot.conn = try_get_connection();
+        if (slot.conn == nullptr) {
+            --m_bound;
+            return nullptr;
+        }
+        slot.last_used_us = monotonic::now_us();
+    }
+
+    // The health check thread never sees bound connections, so validate one
+    // that sat unused for a whole check interval before handing it out
+    uint64_t now = monotonic::now_us();
+    if (m_health_check_interval_s > 0 &&
+        now - slot.last_used_us > (uint64_t)m_health_check_interval_s * 1000000 &&
+        mysql_ping(slot.conn) != 0) {
+        ++m_stats.ping_failures;
+        release_connection(slot.conn);
+        slot.conn = nullptr;
+        --m_bound;
+        return nullptr;
+    }
+    slot.in_use = true;
+    return slot.conn;
+}
+
+void ConnectionPool::return_thread_connection(MYSQL* con) {
+    AffineSlot& slot = t_affine;
+    slot.in_use = false;
+    slot.last_used_us = monotonic::now_us();
+    if (is_broken(con)) {
+        // release_connection() drops it; the next request rebinds
+        release_connection(con);
+        slot.conn = nullptr;
+        --m_bound;
+    }
+}
+
+void* ConnectionPool::maintain_thread(void* arg) {
+    static_cast<ConnectionPool*>(arg)->maintain();
+    mysql_thread_end();
+    return nullptr;
+}
+
+void ConnectionPool::maintain() {
+    while (true) {
+        m_stop_lock.lock();
+        if (!m_stop) {
+            struct timespec abstime;
+            clock_gettime(CLOCK_REALTIME, &abstime);
+            abstime.tv_sec += m_health_check_interval_s;
+            m_stop_cond.timed_wait(m_stop_lock, &abstime);
+        }
+        bool stop = m_stop;
+        m_stop_lock.unlock();
+        if (stop) {
+            break;
+        }
+        run_health_check();
+    }
+}
+
+void ConnectionPool::run_health_check() {
+    uint64_t now = monotonic::now_us();
+    uint64_t interval_us = (uint64_t)m_health_check_interval_s * 1000000;
+    uint64_t idle_timeout_us = (uint64_t)m_idle_timeout_s * 1000000;
+
+    // Take connections idle for at least one interval from the cold end of
+    // the list. Each one holds a permit while it is checked, so the pool
+    // never exceeds max_conn.
+    std::vector<IdleConn> checked;
+    while (m_reserve.try_wait()) {
+        m_lock.lock();
+        if (m_idle.empty() || now - m_idle.front().last_used_us < interval_us) {
+            m_lock.unlock();
+            m_reserve.post();
+            break;
+        }
+        checked.push_back(m_idle.front());
+        m_idle.pop_front();
+        --m_free_conn;
+        m_lock.unlock();
+    }
+
+    std::vector<IdleConn> healthy;
+    for (auto& idle : checked) {
+        m_lock.lock();
+        bool shrink = idle_timeout_us > 0 && now - idle.last_used_us >= idle_timeout_us &&
+                      m_total_conn > m_min_conn;
+        if (shrink) {
+            --m_total_conn;
+        }
+        m_lock.unlock();
+
+        if (shrink) {
+            mysql_close(idle.conn);
+            ++m_stats.idle_closed;
+        } else if (mysql_ping(idle.conn) != 0) {
+            LOG_WARN("MySQL ping failed, reconnecting: %s", mysql_error(idle.conn));
+            ++m_stats.ping_failures;
+            mysql_close(idle.conn);
+            idle.conn = connect_one();
+            if (idle.conn) {
+                ++m_stats.reconnects;
+                healthy.push_back(idle);
+            } else {
+                m_lock.lock();
+                --m_total_conn;
+                m_lock.unlock();
+            }
+        } else {
+            healthy.push_back(idle);
+        }
+    }
+
+    // Put survivors back at the cold end in their original order
+    m_lock.lock();
+    for (auto it = healthy.rbegin(); it != healthy.rend(); ++it) {
+        m_idle.push_front(*it);
+        ++m_free_conn;
+    }
+    m_lock.unlock();
+    for (size_t i = 0; i < checked.size(); ++i) {
+        m_reserve.post();
+    }
+
+    // Grow back to min_conn after failures or a database restart
+    while (m_reserve.try_wait()) {
+        m_lock.lock();
+        bool need = m_total_conn < m_min_conn;
+        if (need) {
+            ++m_total_conn;
+        }
+        m_lock.unlock();
+
+        MYSQL* con = need ? connect_one() : nullptr;
+        m_lock.lock();
+        if (con) {
+            m_idle.push_back(IdleConn{con, (uint64_t)monotonic::now_us()});
+            ++m_free_conn;
+        } else if (need) {
+            --m_total_conn;
+        }
+        m_lock.unlock();
+        m_reserve.post();
+        if (con == nullptr) {
+            break;
+        }
+    }
+}
+
 void ConnectionPool::destroy_pool() {
+    for (auto& replica : m_replicas) {
+        replica->destroy_pool();
+    }
+
+    if (m_maintainer_running) {
+        m_stop_lock.lock();
+        m_stop = true;
+        m_stop_cond.signal();
+        m_stop_lock.unlock();
+        pthread_join(m_maintainer, nullptr);
+        m_maintainer_running = false;
+    }
+
     m_lock.lock();
 
-    if (!m_conn_list.empty()) {
-        for (auto it = m_conn_list.begin(); it != m_conn_list.end(); ++it) {
-            MYSQL* con = *it;
-            mysql_close(con);
+    if (!m_idle.empty()) {
+        for (auto it = m_idle.begin(); it != m_idle.end(); ++it) {
+            mysql_close(it->conn);
         }
-        m_cur_conn = 0;
+        m_total_conn -= m_free_conn;
         m_free_conn = 0;
-        m_conn_list.clear();
+        m_idle.clear();
     }
 
     m_lock.unlock();
 }
 
+const ConnectionRAII::ThreadMarks& ConnectionRAII::thread_marks() {
+    return t_marks;
+}
+
+void ConnectionRAII::set_thread_marks(const ThreadMarks& marks) {
+    t_marks = marks;
+}
+
 ConnectionRAII::ConnectionRAII(MYSQL** sql, ConnectionPool* conn_pool) {
-    *sql = conn_pool->get_connection();
-    m_con_raii = *sql;
+    uint64_t start = monotonic::now_us();
     m_pool_raii = conn_pool;
+    m_acquired_us = 0;
+    *sql = conn_pool->take_thread_connection();
+    m_affine = *sql != nullptr;
+    if (!m_affine) {
+        *sql = conn_pool->get_connection();
+        m_acquired_us = monotonic::now_us();
+    }
+    m_con_raii = *sql;
+    mark_acquired(start);
+}
+
+ConnectionRAII::ConnectionRAII(MYSQL** sql, ConnectionPool* conn_pool, ConnectionPool::Route route,
+                               const string& key) {
+    uint64_t start = monotonic::now_us();
+    m_pool_raii = conn_pool->route(route, key);
+    m_acquired_us = 0;
+    *sql = m_pool_raii->take_thread_connection();
+    m_affine = *sql != nullptr;
+    if (!m_affine) {
+        int timeout_ms = m_pool_raii->get_acquire_timeout_ms();
+        *sql = m_pool_raii->get_connection(timeout_ms);
+        if (*sql == nullptr && m_pool_raii != conn_pool) {
+            // The replica and the primary share one acquire deadline, so a
+            // timed-out replica does not double the caller's wait
+            m_pool_raii = conn_pool;
+            int64_t remaining_ms = timeout_ms - (int64_t)(monotonic::now_us() - start) / 1000;
+            *sql = remaining_ms > 0 ? m_pool_raii->get_connection((int)remaining_ms)
+                                    : m_pool_raii->try_get_connection();
+        }
+        m_acquired_us = monotonic::now_us();
+    }
+    m_con_raii = *sql;
+    mark_acquired(start);
+}
+
+void ConnectionRAII::mark_acquired(uint64_t start_us) {
+    if (m_con_raii) {
+        t_marks.acquire_start_us = start_us;
+        t_marks.acquired_us = m_acquired_us ? m_acquired_us : monotonic::now_us();
+        t_marks.released_us = 0;
+        TWS_PROBE1(db_acquire, (t_marks.acquired_us - start_us) * 1000);
+    }
 }
 
 ConnectionRAII::~ConnectionRAII() {
+    if (m_con_raii) {
+        t_marks.released_us = monotonic::now_us();
+        TWS_PROBE1(db_release, (t_marks.released_us - t_marks.acquired_us) * 1000);
+    }
+    if (m_affine) {
+        m_pool_raii->return_thread_connection(m_con_raii);
+        return;
+    }
+    if (m_con_raii) {
+        m_pool_raii->record_hold(t_marks.released_us - m_acquired_us);
+    }
     m_pool_raii->release_connection(m_con_raii);
 }
@@ -2,7 +2,9 @@
 #define _CONNECTION_POOL_
 
 #include <stdio.h>
-#include <list>
+#include <deque>
+#include <vector>
+#include <unordered_map>
 #include <mysql/mysql.h>
 #include <error.h>
 #include <string.h>
@@ -11,12 +13,21 @@
 #include <atomic>
 #include <memory>
 #include <stdexcept>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "../utils/lock/locker.h"
 #include "../utils/log/log.h"
 
 using namespace std;
 
+// A read replica; it shares credentials and database name with the primary
+struct SqlEndpoint {
+    string url;
+    int port;
+};
+
 struct ConnectionPoolConfig {
     string url;
     string user;
@@ -25,16 +36,48 @@ struct ConnectionPoolConfig {
     int port;
     int max_conn;
     int close_log;
+    // Connections kept open even when idle; 0 means max_conn (fixed size)
+    int min_conn = 0;
+    // Default bound for get_connection(); 0 waits forever
+    int acquire_timeout_ms = 500;
+    // Idle connections above min_conn are closed after this long
+    int idle_timeout_s = 60;
+    // How often idle connections are pinged and the pool is resized
+    int health_check_interval_s = 10;
+    int connect_timeout_s = 3;
+    // Read-only queries are spread over these; empty means everything goes
+    // to the primary. Each replica gets its own sub-pool sized like this one.
+    vector<SqlEndpoint> replicas;
+    // After a write, reads for the same key (or any read without a key) go
+    // to the primary for this long so replication lag is not observed
+    int read_your_writes_ms = 0;
 };
 
 class ConnectionPool {
+public:
+    // Upper bounds (microseconds) of the acquire wait histogram buckets,
+    // the last bucket counts everything slower
+    static const int WAIT_BUCKETS = 12;
+    static constexpr uint64_t WAIT_BUCKET_BOUNDS_US[WAIT_BUCKETS - 1] = {
+        10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000
+    };
+
 private:
+    struct IdleConn {
+        MYSQL* conn;
+        uint64_t last_used_us;
+    };
+
     // Connection pool state
     int m_max_conn;
-    int m_cur_conn;
-    int m_free_conn;
+    int m_min_conn;
+    int m_cur_conn;     // checked out
+    int m_free_conn;    // idle
+    int m_total_conn;   // open, including ones being created or checked
     locker::Mutex m_lock;
-    list<MYSQL*> m_conn_list;
+    // Idle connections, most recently used at the back
+    deque<IdleConn> m_idle;
+    // One permit per connection that may still be handed out (max - checked out)
     locker::Semaphore m_reserve;
 
     // Connection configuration
@@ -44,6 +87,30 @@ private:
     string m_password;
     string m_database_name;
     int m_close_log;
+    int m_acquire_timeout_ms;
+    int m_idle_timeout_s;
+    int m_health_check_interval_s;
+    int m_connect_timeout_s;
+
+    // Connections permanently checked out by worker threads (thread-affine mode)
+    atomic<int> m_bound;
+
+    // Read/write split. Only the primary (the singleton) has replicas.
+    vector<unique_ptr<ConnectionPool>> m_replicas;
+    // Connections currently checked out, used for least-outstanding routing
+    atomic<int> m_outstanding;
+    atomic<unsigned> m_next_replica;
+    int m_read_your_writes_ms;
+    atomic<uint64_t> m_last_write_us;
+    locker::Mutex m_recent_lock;
+    unordered_map<string, uint64_t> m_recent_writes;
+
+    // Health check thread
+    pthread_t m_maintainer;
+    bool m_maintainer_running;
+    bool m_stop;
+    locker::Mutex m_stop_lock;
+    locker::ConditionVariable m_stop_cond;
 
     // Statistics
     struct PoolStats {
@@ -51,43 +118,138 @@ private:
         atomic<size_t> active_connections{0};
         atomic<size_t> connection_timeouts{0};
         atomic<size_t> failed_connections{0};
+        // Time a connection stays checked out through ConnectionRAII
+        atomic<size_t> hold_count{0};
+        atomic<uint64_t> total_hold_us{0};
+        atomic<uint64_t> max_hold_us{0};
+        // Time spent waiting in get_connection(), including timeouts
+        atomic<size_t> wait_buckets[WAIT_BUCKETS];
+        atomic<size_t> wait_count{0};
+        atomic<uint64_t> total_wait_us{0};
+        // Health checking and elastic sizing
+        atomic<size_t> reconnects{0};
+        atomic<size_t> ping_failures{0};
+        atomic<size_t> idle_closed{0};
 
         // Default constructor
-        PoolStats() = default;
+        PoolStats() {
+            for (int i = 0; i < WAIT_BUCKETS; ++i) {
+                wait_buckets[i] = 0;
+            }
+        }
 
         // Delete copy constructor and assignment operator
         PoolStats(const PoolStats&) = delete;
         PoolStats& operator=(const PoolStats&) = delete;
     } m_stats;
 
+    MYSQL* connect_one();
+    MYSQL* checkout();
+    // Returns a checked-out connection to the idle list, or closes it
+    void put_back(MYSQL* con, bool drop);
+    void record_wait(uint64_t wait_us);
+    bool is_broken(MYSQL* conn);
+    static void* maintain_thread(void* arg);
+    void maintain();
+    void run_health_check();
+    bool reserve_bound();
+
 public:
     ConnectionPool();
     ~ConnectionPool();
 
+    // PRIMARY for writes and reads that must see the latest data, READ for
+    // queries a replica may answer
+    enum class Route {
+        PRIMARY = 0,
+        READ
+    };
+
     static ConnectionPool* get_instance();
     void init(const ConnectionPoolConfig& config);
-    MYSQL* get_connection(int timeout_ms = 0);
+
+    // Picks the sub-pool for a query. READ goes to the replica with the fewest
+    // checked-out connections unless `key` (or, without a key, anything) was
+    // written within the read-your-writes window.
+    ConnectionPool* route(Route route, const string& key = "");
+    // Starts the read-your-writes window for `key`
+    void note_write(const string& key);
+    size_t get_replica_count() const { return m_replicas.size(); }
+    ConnectionPool* get_replica(size_t i) const { return m_replicas[i].get(); }
+    // timeout_ms < 0 uses the configured acquire timeout. Returns nullptr on
+    // timeout or when a new connection could not be opened; callers should
+    // answer 503 in that case.
+    MYSQL* get_connection(int timeout_ms = -1);
+    // Never blocks: returns nullptr when no connection can be handed out now
+    MYSQL* try_get_connection();
     bool release_connection(MYSQL* conn);
+    // Closes a checked-out connection instead of reusing it, for one left in
+    // an unknown protocol state (a query abandoned half way)
+    void discard_connection(MYSQL* conn);
     int get_free_conn() const { return m_free_conn; }
+    int get_total_conn() const { return m_total_conn; }
+    int get_acquire_timeout_ms() const { return m_acquire_timeout_ms; }
     void destroy_pool();
 
     const PoolStats& get_stats() const { return m_stats; }
-    void reset_stats() { 
+    void reset_stats() {
         m_stats.total_connections = 0;
         m_stats.active_connections = 0;
         m_stats.connection_timeouts = 0;
         m_stats.failed_connections = 0;
+        m_stats.hold_count = 0;
+        m_stats.total_hold_us = 0;
+        m_stats.max_hold_us = 0;
+        for (int i = 0; i < WAIT_BUCKETS; ++i) {
+            m_stats.wait_buckets[i] = 0;
+        }
+        m_stats.wait_count = 0;
+        m_stats.total_wait_us = 0;
+        m_stats.reconnects = 0;
+        m_stats.ping_failures = 0;
+        m_stats.idle_closed = 0;
     }
+    void record_hold(uint64_t hold_us);
+
+    // Thread-affine mode: a worker checks out one connection for its whole
+    // lifetime. ConnectionRAII then uses it without touching the semaphore,
+    // the mutex or any shared counter, and falls back to the shared pool when
+    // it is already in use (nested) or broken. At most max_conn - 1
+    // connections are bound so overflow and async queries still have one.
+    bool bind_thread_connection();
+    MYSQL* take_thread_connection();
+    void return_thread_connection(MYSQL* conn);
 };
 
 class ConnectionRAII {
 private:
     MYSQL* m_con_raii;
     ConnectionPool* m_pool_raii;
+    uint64_t m_acquired_us;
+    bool m_affine;
+
+    void mark_acquired(uint64_t start_us);
 
 public:
     ConnectionRAII(MYSQL** con, ConnectionPool* conn_pool);
+    // Routed variant: READ may be served by a replica and falls back to the
+    // primary when the replica has no connection to give
+    ConnectionRAII(MYSQL** con, ConnectionPool* conn_pool, ConnectionPool::Route route,
+                   const string& key = "");
     ~ConnectionRAII();
+
+    // Monotonic times (us) of the calling thread's most recent ConnectionRAII
+    // that got a connection, for per-request traces. released_us is 0 while
+    // it is still held.
+    struct ThreadMarks {
+        uint64_t acquire_start_us;
+        uint64_t acquired_us;
+        uint64_t released_us;
+    };
+    static const ThreadMarks& thread_marks();
+    // For code that holds pooled connections without a ConnectionRAII (the
+    // async executor sets them around each callback)
+    static void set_thread_marks(const ThreadMarks& marks);
 };
 
-#endif
\ No newline at end of file
+#endif
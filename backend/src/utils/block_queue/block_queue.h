@@ -145,7 +145,6 @@ public:
     bool push(const T &item) {
         m_mutex.lock();
         if (m_size >= m_max_size) {
-            m_cond.broadcast();
             m_mutex.unlock();
             return false;
         }
@@ -199,7 +198,11 @@ public:
         m_mutex.lock();
         if (m_size <= 0) {
             t.tv_sec = now.tv_sec + ms_timeout / 1000;
-            t.tv_nsec = (ms_timeout % 1000) * 1000;
+            t.tv_nsec = now.tv_usec * 1000 + (long)(ms_timeout % 1000) * 1000000;
+            if (t.tv_nsec >= 1000000000) {
+                t.tv_sec += 1;
+                t.tv_nsec -= 1000000000;
+            }
             if (!m_cond.timed_wait(m_mutex, &t)) {
                 m_mutex.unlock();
                 return false;
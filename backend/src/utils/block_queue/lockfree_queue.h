@@ -0,0 +1,313 @@
+#ifndef LOCKFREE_QUEUE_H
+#define LOCKFREE_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// Bounded lock-free multi-producer/multi-consumer queue with the same
+// interface as BlockQueue<T>.
+//
+// Each cell carries a sequence number (Vyukov's bounded MPMC design): a
+// producer may fill cell `pos % capacity` once its sequence equals `pos`, a
+// consumer may take it once the sequence equals `pos + 1`. Head and tail
+// live on their own cache lines. Capacity is rounded up to a power of two.
+//
+// push() never blocks and fails when the queue is full, like BlockQueue.
+// The blocking pops spin briefly (not at all on a single CPU), yield a few
+// times and then park on a futex eventcount. A producer makes the wake-up syscall only when the
+// parked bit is set, and the first one to see it clears it, so a burst of
+// pushes costs one wake-up rather than one per item.
+template <class T>
+class LockFreeQueue {
+private:
+    static const size_t CACHE_LINE = 64;
+    static const int SPIN_LIMIT = 128;
+    static const int YIELD_LIMIT = 4;
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    size_t m_capacity;
+    size_t m_mask;
+    std::unique_ptr<Cell[]> m_cells;
+
+    alignas(CACHE_LINE) std::atomic<size_t> m_head;
+    alignas(CACHE_LINE) std::atomic<size_t> m_tail;
+    // Eventcount: epoch << 1 | parked bit. Consumers set the bit and sleep
+    // on the value, a notifier adds one, which clears the bit and bumps the
+    // epoch in a single step.
+    alignas(CACHE_LINE) std::atomic<uint32_t> m_state;
+    int m_spin_limit;
+
+    static size_t round_up(size_t n) {
+        size_t cap = 2;
+        while (cap < n) {
+            cap <<= 1;
+        }
+        return cap;
+    }
+
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#else
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+    }
+
+    static uint64_t monotonic_ms() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // Returns false on timeout. Spurious wake-ups are fine: callers re-check.
+    bool futex_wait(uint32_t expected, int timeout_ms) {
+        struct timespec ts;
+        struct timespec* pts = nullptr;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+            pts = &ts;
+        }
+        long ret = syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_state), FUTEX_WAIT_PRIVATE,
+                           expected, pts, nullptr, 0);
+        return !(ret != 0 && errno == ETIMEDOUT);
+    }
+
+    void notify() {
+        // Pairs with the fence after setting the parked bit in wait_for()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint32_t state = m_state.load(std::memory_order_relaxed);
+        while (state & 1) {
+            if (m_state.compare_exchange_weak(state, state + 1, std::memory_order_relaxed)) {
+                // Everyone parked wakes; the ones that find nothing park again
+                syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_state), FUTEX_WAKE_PRIVATE,
+                        INT_MAX, nullptr, nullptr, 0);
+                return;
+            }
+        }
+    }
+
+    // Runs `attempt` until it succeeds, spinning first and then parking.
+    // timeout_ms < 0 waits forever.
+    template <class Attempt>
+    bool wait_for(Attempt attempt, int timeout_ms) {
+        for (int i = 0; i < m_spin_limit; ++i) {
+            if (attempt()) {
+                return true;
+            }
+            cpu_relax();
+        }
+        // Yielding lets a preempted producer finish (and others add more)
+        // before we pay for a futex round trip per item
+        for (int i = 0; i < YIELD_LIMIT; ++i) {
+            if (attempt()) {
+                return true;
+            }
+            sched_yield();
+        }
+        uint64_t deadline = timeout_ms >= 0 ? monotonic_ms() + timeout_ms : 0;
+        while (true) {
+            uint32_t state = m_state.fetch_or(1, std::memory_order_relaxed) | 1;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // Re-check after setting the bit so a concurrent push either sees
+            // it or we see the push's item
+            if (attempt()) {
+                return true;
+            }
+            int remaining = -1;
+            if (timeout_ms >= 0) {
+                uint64_t now = monotonic_ms();
+                if (now >= deadline) {
+                    return false;
+                }
+                remaining = (int)(deadline - now);
+            }
+            futex_wait(state, remaining);
+            if (attempt()) {
+                return true;
+            }
+        }
+    }
+
+    bool try_pop_batch(std::vector<T>& items, size_t count) {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        while (true) {
+            // Every cell in [pos, pos + count) must already be published
+            bool ready = true;
+            for (size_t i = 0; i < count; ++i) {
+                if (m_cells[(pos + i) & m_mask].seq.load(std::memory_order_acquire) != pos + i + 1) {
+                    ready = false;
+                    break;
+                }
+            }
+            if (!ready) {
+                size_t head = m_head.load(std::memory_order_relaxed);
+                if (head == pos) {
+                    return false;
+                }
+                pos = head;
+                continue;
+            }
+            if (m_head.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        items.clear();
+        items.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            Cell& cell = m_cells[(pos + i) & m_mask];
+            items.push_back(std::move(cell.data));
+            cell.seq.store(pos + i + m_capacity, std::memory_order_release);
+        }
+        return true;
+    }
+
+public:
+    LockFreeQueue(int max_size = 1000)
+        : m_head(0)
+        , m_tail(0)
+        , m_state(0)
+        , m_spin_limit(sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_LIMIT : 0) {
+        if (max_size <= 0) {
+            throw std::invalid_argument("Queue size must be positive");
+        }
+        m_capacity = round_up((size_t)max_size);
+        m_mask = m_capacity - 1;
+        m_cells.reset(new Cell[m_capacity]);
+        for (size_t i = 0; i < m_capacity; ++i) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    LockFreeQueue(const LockFreeQueue&) = delete;
+    LockFreeQueue& operator=(const LockFreeQueue&) = delete;
+
+    // Approximate while other threads are pushing or popping
+    int size() const {
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        size_t head = m_head.load(std::memory_order_acquire);
+        return tail > head ? (int)(tail - head) : 0;
+    }
+
+    bool is_full() const {
+        return (size_t)size() >= m_capacity;
+    }
+
+    bool is_empty() const {
+        return size() == 0;
+    }
+
+    int max_size() const {
+        return (int)m_capacity;
+    }
+
+    bool push(const T& item) {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = item;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        notify();
+        return true;
+    }
+
+    // All or nothing: fails without pushing anything if the batch does not fit
+    bool push_batch(const std::vector<T>& items) {
+        size_t count = items.size();
+        if (count == 0) {
+            return true;
+        }
+        if (count > m_capacity) {
+            return false;
+        }
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        do {
+            // A stale head only under-estimates free space
+            size_t head = m_head.load(std::memory_order_acquire);
+            if (pos + count > head + m_capacity) {
+                return false;
+            }
+        } while (!m_tail.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed));
+
+        for (size_t i = 0; i < count; ++i) {
+            Cell& cell = m_cells[(pos + i) & m_mask];
+            // The consumer that claimed this slot's previous lap may still be
+            // moving the old value out
+            while (cell.seq.load(std::memory_order_acquire) != pos + i) {
+                cpu_relax();
+            }
+            cell.data = items[i];
+            cell.seq.store(pos + i + 1, std::memory_order_release);
+        }
+        notify();
+        return true;
+    }
+
+    bool try_pop(T& item) {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0) {
+                if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+        item = std::move(cell->data);
+        cell->seq.store(pos + m_capacity, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        return wait_for([&]() { return try_pop(item); }, -1);
+    }
+
+    bool pop(T& item, int ms_timeout) {
+        return wait_for([&]() { return try_pop(item); }, ms_timeout);
+    }
+
+    // Blocks until `count` items can be taken at once
+    bool pop_batch(std::vector<T>& items, int count) {
+        if (count <= 0 || (size_t)count > m_capacity) {
+            return false;
+        }
+        return wait_for([&]() { return try_pop_batch(items, (size_t)count); }, -1);
+    }
+};
+
+#endif
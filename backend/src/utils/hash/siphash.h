@@ -0,0 +1,64 @@
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+// SipHash-2-4: a keyed 64-bit hash. With a secret key the output can be
+// stored in place of the input without making the input recoverable or
+// letting an attacker pick colliding inputs.
+struct SipKey {
+    uint64_t k0;
+    uint64_t k1;
+};
+
+namespace siphash_detail {
+
+inline uint64_t rotl(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+inline void round(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+    v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+    v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+}
+
+} // namespace siphash_detail
+
+inline uint64_t siphash24(const SipKey& key, const void* data, size_t len) {
+    using siphash_detail::round;
+    const unsigned char* in = static_cast<const unsigned char*>(data);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key.k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key.k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key.k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ key.k1;
+    uint64_t b = (uint64_t)len << 56;
+
+    size_t whole = len & ~(size_t)7;
+    for (size_t i = 0; i < whole; i += 8) {
+        uint64_t m;
+        memcpy(&m, in + i, 8);  // little-endian hosts only, like the rest of the server
+        v3 ^= m;
+        round(v0, v1, v2, v3);
+        round(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    for (size_t i = 0; i < (len & 7); ++i) {
+        b |= (uint64_t)in[whole + i] << (8 * i);
+    }
+
+    v3 ^= b;
+    round(v0, v1, v2, v3);
+    round(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; ++i) {
+        round(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#endif
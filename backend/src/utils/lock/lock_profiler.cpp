@@ -0,0 +1,187 @@
+#include "lock_profiler.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../metrics/metrics.h"
+
+namespace locker {
+namespace profiling {
+
+namespace {
+
+// Call sites tracked per lock name; contention from further sites is
+// charged to a single "other" site
+const int MAX_SITES = 32;
+// Sites exported per lock name, longest total wait first
+const int TOP_SITES = 10;
+
+struct Site {
+    std::atomic<const char *> file{nullptr};
+    int line = 0;
+    std::atomic<uint64_t> contended{0};
+    std::atomic<uint64_t> wait_us{0};
+};
+
+} // namespace
+
+struct LockStats {
+    std::string name;
+    metrics::Counter *acquisitions = nullptr;
+    metrics::Counter *contended = nullptr;
+    metrics::Histogram *wait = nullptr;
+    metrics::Histogram *hold = nullptr;
+    Site sites[MAX_SITES];
+    // Sites are published by bumping the count after filling them in
+    std::atomic<int> site_count{0};
+    Site other;
+};
+
+namespace {
+
+// Plain pthread mutexes: a profiled lock in here would profile itself
+struct Profiler {
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<std::unique_ptr<LockStats>> locks;
+};
+
+Profiler &profiler() {
+    static Profiler instance;
+    return instance;
+}
+
+bool same_site(const Site &site, const char *file, int line) {
+    const char *site_file = site.file.load(std::memory_order_acquire);
+    return site.line == line && (site_file == file || strcmp(site_file, file) == 0);
+}
+
+Site *find_site(LockStats *stats, const char *file, int line) {
+    int count = stats->site_count.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i) {
+        if (same_site(stats->sites[i], file, line)) {
+            return &stats->sites[i];
+        }
+    }
+
+    Profiler &p = profiler();
+    pthread_mutex_lock(&p.sites_lock);
+    Site *site = &stats->other;
+    count = stats->site_count.load(std::memory_order_relaxed);
+    for (int i = 0; i < count; ++i) {
+        if (same_site(stats->sites[i], file, line)) {
+            site = &stats->sites[i];
+            break;
+        }
+    }
+    if (site == &stats->other && count < MAX_SITES) {
+        site = &stats->sites[count];
+        site->line = line;
+        site->file.store(file, std::memory_order_release);
+        stats->site_count.store(count + 1, std::memory_order_release);
+    }
+    pthread_mutex_unlock(&p.sites_lock);
+    return site;
+}
+
+std::string site_labels(const LockStats &stats, const Site &site) {
+    const char *file = site.file.load(std::memory_order_acquire);
+    std::string labels = "lock=\"" + stats.name + "\",site=\"";
+    if (file) {
+        // Paths from __builtin_FILE are long and differ between builds
+        const char *base = strrchr(file, '/');
+        labels += (base ? base + 1 : file) + std::string(":") + std::to_string(site.line);
+    } else {
+        labels += "other";
+    }
+    return labels + "\"";
+}
+
+// Top sites of every lock, by total wait
+void collect_sites(bool wait, metrics::Registry::Samples *samples) {
+    Profiler &p = profiler();
+    pthread_mutex_lock(&p.lock);
+    for (const auto &stats : p.locks) {
+        std::vector<const Site *> sites;
+        int count = stats->site_count.load(std::memory_order_acquire);
+        for (int i = 0; i < count; ++i) {
+            sites.push_back(&stats->sites[i]);
+        }
+        if (stats->other.contended.load(std::memory_order_relaxed) > 0) {
+            sites.push_back(&stats->other);
+        }
+        std::sort(sites.begin(), sites.end(), [](const Site *a, const Site *b) {
+            return a->wait_us.load(std::memory_order_relaxed) > b->wait_us.load(std::memory_order_relaxed);
+        });
+        if (sites.size() > (size_t)TOP_SITES) {
+            sites.resize(TOP_SITES);
+        }
+        for (const Site *site : sites) {
+            double value = wait ? site->wait_us.load(std::memory_order_relaxed) / 1e6
+                                : (double)site->contended.load(std::memory_order_relaxed);
+            samples->emplace_back(site_labels(*stats, *site), value);
+        }
+    }
+    pthread_mutex_unlock(&p.lock);
+}
+
+} // namespace
+
+LockStats *register_lock(const char *name) {
+    Profiler &p = profiler();
+    pthread_mutex_lock(&p.lock);
+    for (const auto &stats : p.locks) {
+        if (stats->name == name) {
+            pthread_mutex_unlock(&p.lock);
+            return stats.get();
+        }
+    }
+    std::unique_ptr<LockStats> stats(new LockStats());
+    stats->name = name;
+    // The registry never calls back into the profiler with its lock held
+    metrics::Registry *registry = metrics::Registry::get_instance();
+    std::string labels = "lock=\"" + stats->name + "\"";
+    stats->acquisitions = registry->counter("tws_lock_acquisitions_total", "Lock acquisitions",
+                                            labels.c_str());
+    stats->contended = registry->counter("tws_lock_contended_total",
+                                         "Lock acquisitions that had to wait", labels.c_str());
+    stats->wait = registry->histogram("tws_lock_wait_seconds", "Wait time of contended lock acquisitions",
+                                      labels.c_str());
+    stats->hold = registry->histogram("tws_lock_hold_seconds", "Time a lock was held", labels.c_str());
+    if (p.locks.empty()) {
+        registry->counter_samples("tws_lock_site_wait_seconds_total",
+                                  "Time spent waiting for a lock, by call site (top sites per lock)",
+                                  [](metrics::Registry::Samples *samples) { collect_sites(true, samples); });
+        registry->counter_samples("tws_lock_site_contended_total",
+                                  "Contended lock acquisitions, by call site (top sites per lock)",
+                                  [](metrics::Registry::Samples *samples) { collect_sites(false, samples); });
+    }
+    p.locks.push_back(std::move(stats));
+    LockStats *result = p.locks.back().get();
+    pthread_mutex_unlock(&p.lock);
+    return result;
+}
+
+void record_acquired(LockStats *stats, const char *file, int line, bool contended, int64_t wait_us) {
+    stats->acquisitions->inc();
+    if (!contended) {
+        return;
+    }
+    stats->contended->inc();
+    stats->wait->observe(wait_us);
+    Site *site = find_site(stats, file, line);
+    site->contended.fetch_add(1, std::memory_order_relaxed);
+    site->wait_us.fetch_add(wait_us, std::memory_order_relaxed);
+}
+
+void record_released(LockStats *stats, int64_t hold_us) {
+    stats->hold->observe(hold_us);
+}
+
+} // namespace profiling
+} // namespace locker
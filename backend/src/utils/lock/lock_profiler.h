@@ -0,0 +1,30 @@
+#ifndef LOCK_PROFILER_H
+#define LOCK_PROFILER_H
+
+#include <stdint.h>
+
+// Contention profiling for named locker::Mutex instances.
+//
+// Only used when built with TWS_LOCK_PROFILING. Every named mutex then
+// try-locks first; an acquisition that has to block counts as contended and
+// is charged, with its wait time, to the calling file:line. Per lock name
+// the profiler exports acquisition and contention counters, wait and hold
+// time histograms, and the call sites that waited longest, all on /metrics.
+//
+// Mutexes with the same name share one set of statistics.
+namespace locker {
+namespace profiling {
+
+struct LockStats;
+
+// Never returns nullptr; the result lives until exit
+LockStats *register_lock(const char *name);
+
+// wait_us is 0 for uncontended acquisitions
+void record_acquired(LockStats *stats, const char *file, int line, bool contended, int64_t wait_us);
+void record_released(LockStats *stats, int64_t hold_us);
+
+} // namespace profiling
+} // namespace locker
+
+#endif
@@ -2,11 +2,20 @@
 #define LOCKER_H
 
 #include <exception>
+#include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
 #include <string>
 #include <system_error>
 
+#ifdef TWS_LOCK_PROFILING
+#include "lock_profiler.h"
+#include "../timer/monotonic.h"
+// 记录调用lock()的位置，由编译器在调用处展开
+#define TWS_LOCK_SITE const char* file = __builtin_FILE(), int line = __builtin_LINE()
+#endif
+
 namespace locker {
 
 // 信号量类
@@ -30,6 +39,27 @@ public:
         return sem_wait(&m_sem) == 0;
     }
 
+    // 非阻塞获取，信号量为0时立即返回false
+    bool try_wait() {
+        return sem_trywait(&m_sem) == 0;
+    }
+
+    // 最多等待timeout_ms毫秒，超时返回false
+    bool timed_wait(int timeout_ms) {
+        struct timespec abstime;
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_sec += timeout_ms / 1000;
+        abstime.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (abstime.tv_nsec >= 1000000000) {
+            abstime.tv_sec += 1;
+            abstime.tv_nsec -= 1000000000;
+        }
+        int ret;
+        while ((ret = sem_timedwait(&m_sem, &abstime)) != 0 && errno == EINTR) {
+        }
+        return ret == 0;
+    }
+
     bool post() {
         return sem_post(&m_sem) == 0;
     }
@@ -55,22 +85,83 @@ public:
 };
 
 // 互斥锁类
+// 定义TWS_LOCK_PROFILING时，带名字的锁会统计竞争次数、等待/持有时间及竞争最多的调用位置，
+// 见lock_profiler.h；未定义时名字被忽略，没有任何开销
 class Mutex {
 private:
     pthread_mutex_t m_mutex;
+#ifdef TWS_LOCK_PROFILING
+    profiling::LockStats* m_stats;
+    int64_t m_acquired_us;
+#endif
+
+    friend class ConditionVariable;
+
+    // 条件变量等待期间锁被释放，不计入持有时间
+    void before_wait() {
+#ifdef TWS_LOCK_PROFILING
+        if (m_stats) {
+            profiling::record_released(m_stats, monotonic::now_us() - m_acquired_us);
+        }
+#endif
+    }
+
+    void after_wait() {
+#ifdef TWS_LOCK_PROFILING
+        if (m_stats) {
+            m_acquired_us = monotonic::now_us();
+        }
+#endif
+    }
 
 public:
-    Mutex() {
+    explicit Mutex(const char* name = nullptr) {
         if (pthread_mutex_init(&m_mutex, nullptr) != 0) {
             throw std::system_error(errno, std::system_category(),
                                     "Failed to initialize mutex");
         }
+#ifdef TWS_LOCK_PROFILING
+        m_stats = name ? profiling::register_lock(name) : nullptr;
+        m_acquired_us = 0;
+#else
+        (void)name;
+#endif
     }
 
     ~Mutex() {
         pthread_mutex_destroy(&m_mutex);
     }
 
+#ifdef TWS_LOCK_PROFILING
+    // 先尝试加锁，失败才算一次竞争并计时
+    bool lock(TWS_LOCK_SITE) {
+        if (!m_stats) {
+            return pthread_mutex_lock(&m_mutex) == 0;
+        }
+        if (pthread_mutex_trylock(&m_mutex) == 0) {
+            m_acquired_us = monotonic::now_us();
+            profiling::record_acquired(m_stats, file, line, false, 0);
+            return true;
+        }
+        int64_t start_us = monotonic::now_us();
+        if (pthread_mutex_lock(&m_mutex) != 0) {
+            return false;
+        }
+        m_acquired_us = monotonic::now_us();
+        profiling::record_acquired(m_stats, file, line, true, m_acquired_us - start_us);
+        return true;
+    }
+
+    bool unlock() {
+        if (!m_stats) {
+            return pthread_mutex_unlock(&m_mutex) == 0;
+        }
+        int64_t hold_us = monotonic::now_us() - m_acquired_us;
+        bool ret = pthread_mutex_unlock(&m_mutex) == 0;
+        profiling::record_released(m_stats, hold_us);
+        return ret;
+    }
+#else
     bool lock() {
         return pthread_mutex_lock(&m_mutex) == 0;
     }
@@ -78,6 +169,7 @@ public:
     bool unlock() {
         return pthread_mutex_unlock(&m_mutex) == 0;
     }
+#endif
 
     pthread_mutex_t* get() {
         return &m_mutex;
@@ -91,6 +183,10 @@ public:
     Mutex(Mutex&& other) noexcept {
         m_mutex = other.m_mutex;
         pthread_mutex_init(&other.m_mutex, nullptr);  // Reset source object
+#ifdef TWS_LOCK_PROFILING
+        m_stats = other.m_stats;
+        m_acquired_us = 0;
+#endif
     }
 
     Mutex& operator=(Mutex&& other) noexcept {
@@ -98,6 +194,10 @@ public:
             pthread_mutex_destroy(&m_mutex);
             m_mutex = other.m_mutex;
             pthread_mutex_init(&other.m_mutex, nullptr);  // Reset source object
+#ifdef TWS_LOCK_PROFILING
+            m_stats = other.m_stats;
+            m_acquired_us = 0;
+#endif
         }
         return *this;
     }
@@ -109,9 +209,16 @@ private:
     Mutex& m_mutex;
 
 public:
+#ifdef TWS_LOCK_PROFILING
+    // 竞争记在构造LockGuard的位置
+    explicit LockGuard(Mutex& mutex, TWS_LOCK_SITE) : m_mutex(mutex) {
+        m_mutex.lock(file, line);
+    }
+#else
     explicit LockGuard(Mutex& mutex) : m_mutex(mutex) {
         m_mutex.lock();
     }
+#endif
 
     ~LockGuard() {
         m_mutex.unlock();
@@ -122,6 +229,40 @@ public:
     LockGuard& operator=(const LockGuard&) = delete;
 };
 
+// 读写锁类，读多写少的共享数据使用
+class RWLock {
+private:
+    pthread_rwlock_t m_rwlock;
+
+public:
+    RWLock() {
+        if (pthread_rwlock_init(&m_rwlock, nullptr) != 0) {
+            throw std::system_error(errno, std::system_category(),
+                                    "Failed to initialize rwlock");
+        }
+    }
+
+    ~RWLock() {
+        pthread_rwlock_destroy(&m_rwlock);
+    }
+
+    bool rdlock() {
+        return pthread_rwlock_rdlock(&m_rwlock) == 0;
+    }
+
+    bool wrlock() {
+        return pthread_rwlock_wrlock(&m_rwlock) == 0;
+    }
+
+    bool unlock() {
+        return pthread_rwlock_unlock(&m_rwlock) == 0;
+    }
+
+    // 删除拷贝构造函数和赋值操作符
+    RWLock(const RWLock&) = delete;
+    RWLock& operator=(const RWLock&) = delete;
+};
+
 // 条件变量类
 class ConditionVariable {
 private:
@@ -140,11 +281,17 @@ public:
     }
 
     bool wait(Mutex& mutex) {
-        return pthread_cond_wait(&m_cond, mutex.get()) == 0;
+        mutex.before_wait();
+        bool ret = pthread_cond_wait(&m_cond, mutex.get()) == 0;
+        mutex.after_wait();
+        return ret;
     }
 
     bool timed_wait(Mutex& mutex, const struct timespec* abstime) {
-        return pthread_cond_timedwait(&m_cond, mutex.get(), abstime) == 0;
+        mutex.before_wait();
+        bool ret = pthread_cond_timedwait(&m_cond, mutex.get(), abstime) == 0;
+        mutex.after_wait();
+        return ret;
     }
 
     bool signal() {
@@ -0,0 +1,90 @@
+#ifndef ACCESS_RECORD_H
+#define ACCESS_RECORD_H
+
+#include <stdint.h>
+
+#include "../timer/monotonic.h"
+
+// Binary access log.
+//
+// One fixed-size AccessRecord per request, appended in native byte order
+// after a FileHeader. Records go through the async logger's per-thread
+// buffers like ordinary log lines, but the writer copies them to the access
+// log file verbatim instead of formatting them. tools/access_log_dump turns
+// a file back into text or CSV.
+//
+//   FileHeader | AccessRecord | AccessRecord | ...
+namespace accesslog {
+
+const char MAGIC[8] = {'T', 'W', 'S', 'A', 'C', 'C', 'L', 'G'};
+const uint16_t VERSION = 1;
+
+struct FileHeader {
+    char magic[8];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t reserved;
+};
+
+// Request stages, each measured on CLOCK_MONOTONIC
+enum Stage {
+    STAGE_READ = 0,     // first byte received -> request read
+    STAGE_QUEUE,        // request read -> picked up by a worker
+    STAGE_PROCESS,      // parsing, handlers and async waits -> response ready
+    STAGE_WRITE,        // response ready -> last byte sent
+    STAGE_COUNT
+};
+
+// Path ids, so records stay fixed size. Append only: ids are stored on disk
+enum Route : uint8_t {
+    ROUTE_OTHER = 0,
+    ROUTE_STATIC,
+    ROUTE_API_LOGIN,
+    ROUTE_API_REGISTER,
+    ROUTE_API_SESSION,
+    ROUTE_API_LOGOUT,
+    ROUTE_FORM_LOGIN,
+    ROUTE_FORM_REGISTER,
+    ROUTE_METRICS,
+    ROUTE_COUNT
+};
+
+const char *const ROUTE_NAMES[ROUTE_COUNT] = {
+    "-", "static", "/api/login", "/api/register", "/api/session", "/api/logout",
+    "form-login", "form-register", "/metrics"
+};
+
+// Indexed by HttpConn::METHOD
+const char *const METHOD_NAMES[] = {
+    "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATH"
+};
+const int METHOD_COUNT = sizeof(METHOD_NAMES) / sizeof(METHOD_NAMES[0]);
+
+struct AccessRecord {
+    int64_t time_us;        // request start, CLOCK_REALTIME
+    uint32_t client_ip;     // network byte order
+    uint16_t client_port;   // host byte order
+    uint8_t method;
+    uint8_t route;
+    uint16_t status;        // 0 if no response was produced
+    uint16_t sample;        // 1 in `sample` such requests was logged
+    uint32_t bytes;         // response bytes sent
+    uint32_t stage_us[STAGE_COUNT];
+    uint32_t total_us;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(AccessRecord) == 48, "AccessRecord is an on-disk format");
+static_assert(sizeof(FileHeader) == 16, "FileHeader is an on-disk format");
+
+// Clamped difference of two monotonic::now_us() readings; 0 if either is unset
+inline uint32_t elapsed_us(int64_t from, int64_t to) {
+    if (from <= 0 || to < from) {
+        return 0;
+    }
+    return to - from > UINT32_MAX ? UINT32_MAX : (uint32_t)(to - from);
+}
+
+} // namespace accesslog
+
+#endif
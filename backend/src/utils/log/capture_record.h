@@ -0,0 +1,52 @@
+#ifndef CAPTURE_RECORD_H
+#define CAPTURE_RECORD_H
+
+#include <stdint.h>
+
+// Binary traffic capture.
+//
+// Every accepted connection, every recv() that returned data and every
+// client close is one CaptureRecord, followed by the received bytes for DATA
+// records. Records go through the async logger's per-thread buffers, so
+// capturing takes no lock on the request path; the writer copies them to
+// the capture file verbatim. Buffers drain in batches, so the file is not
+// in time order: readers sort by time_us (stable) before use.
+// tools/tws_replay plays a capture back against a server.
+//
+// conn_id and time_us only mean something within one server run, so the
+// server truncates the file when it opens it: a capture holds one run.
+//
+//   FileHeader | CaptureRecord [data] | CaptureRecord [data] | ...
+namespace capture {
+
+const char MAGIC[8] = {'T', 'W', 'S', 'C', 'A', 'P', 'T', 'R'};
+const uint16_t VERSION = 1;
+
+struct FileHeader {
+    char magic[8];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t reserved;
+};
+
+enum Type : uint8_t {
+    OPEN = 1,   // connection accepted
+    DATA,       // `length` bytes received
+    CLOSE       // the client closed or reset its end; closes by the server are
+                // not recorded, a replayed server makes those itself
+};
+
+struct CaptureRecord {
+    int64_t time_us;        // CLOCK_MONOTONIC
+    uint64_t conn_id;       // unique per accepted connection within one run
+    uint32_t length;        // bytes following the record
+    uint8_t type;
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(CaptureRecord) == 24, "CaptureRecord is an on-disk format");
+static_assert(sizeof(FileHeader) == 16, "FileHeader is an on-disk format");
+
+} // namespace capture
+
+#endif
@@ -2,29 +2,147 @@
 
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
-#include <stdarg.h>
 #include <pthread.h>
+#include <algorithm>
 #include <memory>
 #include <stdexcept>
 
 using namespace std;
 
-Log::Log() 
+namespace {
+
+// 每个线程的记录、格式化和日志缓冲区，日志缓冲区在线程退出时交还给后台线程释放
+struct ThreadLogState {
+    LogBuffer *buffer = nullptr;
+    std::unique_ptr<char[]> record;
+    size_t record_size = 0;
+    std::unique_ptr<char[]> line;
+    int line_size = 0;
+    // 访问日志采样计数
+    unsigned access_count = 0;
+
+    ~ThreadLogState() {
+        if (buffer) {
+            buffer->retire();
+        }
+    }
+};
+
+thread_local ThreadLogState t_log_state;
+
+// 每个线程缓存当前这一秒的"YYYY-MM-DD HH:MM:SS."，秒变化时才调用localtime_r，
+// 微秒部分每次直接拼上去。后台线程和同步模式下的调用线程各有一份
+struct TimeCache {
+    time_t sec = -1;
+    char text[32];
+    int len = 0;
+};
+
+thread_local TimeCache t_time_cache;
+
+const char *const LEVEL_LABELS[] = {"[debug]: ", "[info]: ", "[warn]: ", "[erro]: "};
+const int LEVEL_LABEL_LENS[] = {9, 8, 8, 8};
+
+// 写入"YYYY-MM-DD HH:MM:SS.uuuuuu "，返回长度
+int format_time(time_t sec, long usec, char *out) {
+    TimeCache &cache = t_time_cache;
+    if (cache.sec != sec) {
+        struct tm my_tm;
+        localtime_r(&sec, &my_tm);
+        cache.len = snprintf(cache.text, sizeof(cache.text), "%d-%02d-%02d %02d:%02d:%02d.",
+                             my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
+                             my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec);
+        cache.sec = sec;
+    }
+    memcpy(out, cache.text, cache.len);
+    char *p = out + cache.len;
+    for (int i = 5; i >= 0; --i) {
+        p[i] = (char)('0' + usec % 10);
+        usec /= 10;
+    }
+    p[6] = ' ';
+    return cache.len + 7;
+}
+
+int open_log_file(const char *path) {
+    return open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+// 写完len字节，出错时放弃
+void write_fully(int fd, const char *data, size_t len) {
+    while (len > 0 && fd >= 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// now之后的第一个本地零点
+long long next_midnight(time_t now) {
+    struct tm my_tm;
+    localtime_r(&now, &my_tm);
+    my_tm.tm_hour = 0;
+    my_tm.tm_min = 0;
+    my_tm.tm_sec = 0;
+    my_tm.tm_mday += 1;
+    my_tm.tm_isdst = -1;
+    return (long long)mktime(&my_tm);
+}
+
+}
+
+Log::Log()
     : m_count(0)
+    , m_next_day(0)
+    , m_fd(-1)
     , m_is_async(false)
-    , m_fp(nullptr)
-    , m_stop_thread(false)
-    , m_thread_id(0) {
+    , m_thread_buffer_size(0)
+    , m_buffers_mutex("log_buffers")
+    , m_wake_mutex("log_wake")
+    , m_wake_pending(false)
+    , m_output_len(0)
+    , m_sync_interval_ms(0)
+    , m_next_fd(-1)
+    , m_last_sync_ms(0)
+    , m_unsynced(false)
+    , m_access_fd(-1)
+    , m_access_sample(0)
+    , m_access_output_len(0)
+    , m_capture_fd(-1)
+    , m_capture_output_len(0)
+    , m_close_log(1)
+    , m_level((int)Level::INFO)
+    , m_configured_level((int)Level::INFO)
+    , m_rate_interval_us(1000000 / DEFAULT_RATE_PER_SECOND)
+    , m_rate_burst(DEFAULT_RATE_BURST)
+    , m_thread_id(0)
+    , m_stop_thread(false) {
+    m_dir_name[0] = '\0';
+    m_log_name[0] = '\0';
+    m_next_path[0] = '\0';
 }
 
 Log::~Log() {
-    m_stop_thread = true;
-    if (m_thread_id) {
-        pthread_join(m_thread_id, nullptr);
+    stop_writer();
+    if (m_fd >= 0) {
+        close(m_fd);
     }
-    if (m_fp) {
-        fclose(m_fp);
+    if (m_access_fd >= 0) {
+        close(m_access_fd);
+    }
+    if (m_capture_fd >= 0) {
+        close(m_capture_fd);
     }
 }
 
@@ -33,147 +151,573 @@ bool Log::init(const char *file_name, int close_log, int log_buf_size, int split
         return false;
     }
 
+    // 允许重复初始化: 先写完旧缓冲区并停掉旧的后台线程
+    stop_writer();
+    m_is_async = false;
+
     m_close_log = close_log;
     m_log_buf_size = log_buf_size;
-    m_buf = std::make_unique<char[]>(m_log_buf_size);
-    if (!m_buf) {
-        return false;
-    }
-    memset(m_buf.get(), '\0', m_log_buf_size);
     m_split_lines = split_lines;
 
-    time_t t = time(NULL);
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
-
     const char *p = strrchr(file_name, '/');
-    char log_full_name[256] = {0};
-
     if (p == NULL) {
-        snprintf(log_full_name, 255, "%d_%02d_%02d_%s", 
-                my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, file_name);
+        m_dir_name[0] = '\0';
+        snprintf(m_log_name, sizeof(m_log_name), "%s", file_name);
     } else {
-        strcpy(m_log_name, p + 1);
-        strncpy(m_dir_name, file_name, p - file_name + 1);
-        snprintf(log_full_name, 255, "%s%d_%02d_%02d_%s", 
-                m_dir_name, my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, m_log_name);
+        snprintf(m_log_name, sizeof(m_log_name), "%s", p + 1);
+        snprintf(m_dir_name, sizeof(m_dir_name), "%.*s", (int)(p - file_name + 1), file_name);
     }
 
-    m_today = my_tm.tm_mday;
+    time_t t = time(NULL);
+    char log_full_name[256];
+    log_file_name(t, 0, log_full_name, sizeof(log_full_name));
+    m_next_day = next_midnight(t);
+    m_count = 0;
 
-    m_fp = fopen(log_full_name, "a");
-    if (!m_fp) {
+    int fd = open_log_file(log_full_name);
+    if (fd < 0) {
         return false;
     }
+    m_fd_lock.wrlock();
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+    m_fd = fd;
+    m_fd_lock.unlock();
 
     if (max_queue_size >= 1) {
-        m_is_async = true;
-        m_log_queue = std::make_unique<BlockQueue<std::string>>(max_queue_size);
-        if (!m_log_queue) {
-            return false;
+        m_thread_buffer_size = (size_t)max_queue_size * AVG_LINE_SIZE;
+        if (m_thread_buffer_size < (size_t)m_log_buf_size * 2) {
+            m_thread_buffer_size = (size_t)m_log_buf_size * 2;
         }
+        size_t batch = OUTPUT_BATCH_SIZE;
+        m_output.assign(std::max(batch, (size_t)m_log_buf_size * 2), '\0');
+        m_output_len = 0;
+        m_stop_thread = false;
         if (pthread_create(&m_thread_id, NULL, flush_log_thread, NULL) != 0) {
-            m_is_async = false;
+            m_thread_id = 0;
             return false;
         }
+        m_is_async = true;
     }
 
     return true;
 }
 
-void Log::write_log(Level level, const char *format, ...) {
-    struct timeval now = {0, 0};
-    gettimeofday(&now, NULL);
-    time_t t = now.tv_sec;
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
-    char s[16] = {0};
-    
-    switch (level) {
-        case Level::DEBUG:
-            strcpy(s, "[debug]:");
-            break;
-        case Level::INFO:
-            strcpy(s, "[info]:");
-            break;
-        case Level::WARN:
-            strcpy(s, "[warn]:");
-            break;
-        case Level::ERROR:
-            strcpy(s, "[erro]:");
-            break;
+char *Log::record_buffer(size_t *cap) {
+    ThreadLogState &state = t_log_state;
+    size_t size = (size_t)m_log_buf_size + RECORD_SLACK;
+    if (state.record_size != size) {
+        state.record = std::make_unique<char[]>(size);
+        state.record_size = size;
     }
+    *cap = size;
+    return state.record.get();
+}
 
-    m_mutex.lock();
-    m_count++;
-    
-    if (m_today != my_tm.tm_mday || m_count % m_split_lines == 0) {
-        char new_log[256] = {0};
-        fflush(m_fp);
-        fclose(m_fp);
-        char tail[16] = {0};
-
-        snprintf(tail, 16, "%d_%02d_%02d_", 
-                my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday);
-        
-        if (m_today != my_tm.tm_mday) {
-            snprintf(new_log, 255, "%s%s%s", m_dir_name, tail, m_log_name);
-            m_today = my_tm.tm_mday;
-            m_count = 0;
-        } else {
-            snprintf(new_log, 255, "%s%s%s.%lld", 
-                    m_dir_name, tail, m_log_name, m_count / m_split_lines);
+void Log::commit_record(const char *record, size_t len) {
+    if (m_is_async) {
+        // 异步模式下计数和切换文件都由后台线程完成
+        if (append_async(record, len)) {
+            return;
         }
-        m_fp = fopen(new_log, "a");
-        if (!m_fp) {
-            m_mutex.unlock();
+    } else {
+        logrec::RecordHeader header;
+        memcpy(&header, record, sizeof(header));
+        time_t now = (time_t)(header.time_ns / 1000000000);
+        long long count = ++m_count;
+        if (now >= m_next_day || count % m_split_lines == 0) {
+            rotate(now, count);
+        }
+    }
+
+    // 同步模式或缓冲区满时在调用线程上格式化并直接写入
+    {
+        ThreadLogState &state = t_log_state;
+        if (state.line_size != m_log_buf_size) {
+            state.line = std::make_unique<char[]>(m_log_buf_size);
+            state.line_size = m_log_buf_size;
+        }
+        write_direct(state.line.get(), format_line(record, state.line.get()));
+    }
+}
+
+// 把一条记录格式化成一行文本，out至少有m_log_buf_size字节，返回行长(含换行符)
+size_t Log::format_line(const char *record, char *out) {
+    logrec::RecordHeader header;
+    memcpy(&header, record, sizeof(header));
+    int n = format_time((time_t)(header.time_ns / 1000000000),
+                        (long)(header.time_ns % 1000000000 / 1000), out);
+    int level = header.level <= (int)Level::ERROR ? header.level : (int)Level::ERROR;
+    memcpy(out + n, LEVEL_LABELS[level], LEVEL_LABEL_LENS[level]);
+    n += LEVEL_LABEL_LENS[level];
+
+    // 留一个字节给换行符，过长的行被截断
+    size_t m = logrec::format_record_args(header, record + sizeof(header), record + header.size,
+                                          out + n, m_log_buf_size - n);
+    out[n + m] = '\n';
+    return n + m + 1;
+}
+
+void Log::set_level(Level level) {
+    m_configured_level = (int)level;
+    m_level = (int)level;
+}
+
+void Log::toggle_debug() {
+    m_level = m_level == (int)Level::DEBUG ? m_configured_level : (int)Level::DEBUG;
+}
+
+void Log::set_rate_limit(int per_second, int burst) {
+    m_rate_interval_us = per_second > 0 ? 1000000 / per_second : 0;
+    m_rate_burst = burst > 0 ? burst : 1;
+}
+
+void Log::report_suppressed(const char *file, int line, uint64_t dropped) {
+    write_log(Level::WARN, "%s:%d: %llu messages suppressed by rate limit",
+              file, line, (unsigned long long)dropped);
+}
+
+void Log::flush() {
+    if (m_is_async) {
+        wake_writer();
+    }
+}
+
+LogBuffer *Log::thread_buffer() {
+    ThreadLogState &state = t_log_state;
+    if (!state.buffer) {
+        std::unique_ptr<LogBuffer> buffer(new LogBuffer(m_thread_buffer_size));
+        state.buffer = buffer.get();
+        m_buffers_mutex.lock();
+        m_buffers.push_back(std::move(buffer));
+        m_buffers_mutex.unlock();
+    }
+    return state.buffer;
+}
+
+bool Log::append_async(const char *record, size_t len) {
+    LogBuffer *buffer = thread_buffer();
+    size_t before = buffer->readable();
+    if (!buffer->append(record, len)) {
+        wake_writer();
+        return false;
+    }
+    // 刚越过半满时唤醒后台线程，不必等到下一个时间间隔
+    size_t half = buffer->capacity() / 2;
+    if (before < half && before + len >= half) {
+        wake_writer();
+    }
+    return true;
+}
+
+void Log::write_direct(const char *line, size_t len) {
+    m_fd_lock.rdlock();
+    write_fully(m_fd, line, len);
+    m_fd_lock.unlock();
+}
+
+bool Log::init_access(const char *file_name, int sample) {
+    int fd = -1;
+    if (sample > 0) {
+        fd = open_log_file(file_name);
+        if (fd < 0) {
+            return false;
+        }
+        // 新文件先写文件头，已有的文件接着追加
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size == 0) {
+            accesslog::FileHeader header;
+            memcpy(header.magic, accesslog::MAGIC, sizeof(header.magic));
+            header.version = accesslog::VERSION;
+            header.record_size = sizeof(accesslog::AccessRecord);
+            header.reserved = 0;
+            write_fully(fd, (const char *)&header, sizeof(header));
+        }
+        if (m_access_output.empty()) {
+            m_access_output.assign(ACCESS_BATCH_SIZE, '\0');
+        }
+    }
+
+    m_fd_lock.wrlock();
+    int old_fd = m_access_fd;
+    m_access_fd = fd;
+    m_fd_lock.unlock();
+    if (old_fd >= 0) {
+        close(old_fd);
+    }
+    m_access_sample = sample > 0 ? sample : 0;
+    return true;
+}
+
+int Log::sample_access(int status) {
+    int sample = m_access_sample.load(std::memory_order_relaxed);
+    if (sample <= 0) {
+        return 0;
+    }
+    if (status == 0 || status >= 400) {
+        return 1;
+    }
+    return ++t_log_state.access_count % (unsigned)sample == 0 ? sample : 0;
+}
+
+void Log::write_access(const accesslog::AccessRecord &record) {
+    if (m_is_async) {
+        char buf[sizeof(logrec::RecordHeader) + sizeof(accesslog::AccessRecord)];
+        logrec::RecordHeader header;
+        header.size = sizeof(buf);
+        header.level = ACCESS_LEVEL;
+        header.nargs = 0;
+        header.reserved = 0;
+        header.format = nullptr;
+        header.time_ns = 0;
+        memcpy(buf, &header, sizeof(header));
+        memcpy(buf + sizeof(header), &record, sizeof(record));
+        if (append_async(buf, sizeof(buf))) {
             return;
         }
     }
+    // 一条记录只有几十字节，O_APPEND下直接写不会和其他线程交错
+    m_fd_lock.rdlock();
+    write_fully(m_access_fd, (const char *)&record, sizeof(record));
+    m_fd_lock.unlock();
+}
 
-    m_mutex.unlock();
+bool Log::init_capture(const char *file_name) {
+    int fd = -1;
+    if (file_name && file_name[0]) {
+        // 抓取内容含请求体(包括密码)，只允许属主读写
+        // 连接编号和单调时钟每次启动都从头开始，多次运行不能追加到同一文件，打开时清空
+        fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            return false;
+        }
+        capture::FileHeader header;
+        memcpy(header.magic, capture::MAGIC, sizeof(header.magic));
+        header.version = capture::VERSION;
+        header.record_size = sizeof(capture::CaptureRecord);
+        header.reserved = 0;
+        write_fully(fd, (const char *)&header, sizeof(header));
+        if (m_capture_output.empty()) {
+            m_capture_output.assign(CAPTURE_BATCH_SIZE, '\0');
+        }
+    }
 
-    va_list valst;
-    va_start(valst, format);
+    m_fd_lock.wrlock();
+    int old_fd = m_capture_fd;
+    m_capture_fd = fd;
+    m_fd_lock.unlock();
+    if (old_fd >= 0) {
+        close(old_fd);
+    }
+    return true;
+}
 
-    std::string log_str;
-    m_mutex.lock();
+void Log::write_capture(uint64_t conn_id, capture::Type type, const char *data, uint32_t len) {
+    capture::CaptureRecord record;
+    record.time_us = monotonic::now_us();
+    record.conn_id = conn_id;
+    record.length = len;
+    record.type = type;
+    memset(record.reserved, 0, sizeof(record.reserved));
 
-    int n = snprintf(m_buf.get(), 48, "%d-%02d-%02d %02d:%02d:%02d.%06ld %s ", 
-                    my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
-                    my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, now.tv_usec, s);
-    
-    int m = vsnprintf(m_buf.get() + n, m_log_buf_size - 1, format, valst);
-    m_buf[n+m] = '\n';
-    m_buf[n+m+1] = '\0';
-    log_str = m_buf.get();
+    // 记录头 + 抓包记录 + 数据，一次性写入，数据最多一个读缓冲区大小
+    thread_local std::vector<char> buf;
+    size_t offset = m_is_async ? sizeof(logrec::RecordHeader) : 0;
+    size_t total = offset + sizeof(record) + len;
+    if (buf.size() < total) {
+        buf.resize(total);
+    }
+    memcpy(buf.data() + offset, &record, sizeof(record));
+    if (len > 0) {
+        memcpy(buf.data() + offset + sizeof(record), data, len);
+    }
+    if (m_is_async) {
+        logrec::RecordHeader header;
+        header.size = (uint32_t)total;
+        header.level = CAPTURE_LEVEL;
+        header.nargs = 0;
+        header.reserved = 0;
+        header.format = nullptr;
+        header.time_ns = 0;
+        memcpy(buf.data(), &header, sizeof(header));
+        if (append_async(buf.data(), total)) {
+            return;
+        }
+    }
+    // O_APPEND下一次write写完整条记录，不会和其他线程交错
+    m_fd_lock.rdlock();
+    write_fully(m_capture_fd, buf.data() + offset, total - offset);
+    m_fd_lock.unlock();
+}
 
-    m_mutex.unlock();
+// 生成某一天的日志文件名，index > 0时带上分卷序号
+void Log::log_file_name(time_t day, long long index, char *out, size_t len) const {
+    struct tm my_tm;
+    localtime_r(&day, &my_tm);
+    if (index > 0) {
+        snprintf(out, len, "%s%d_%02d_%02d_%s.%lld", m_dir_name, my_tm.tm_year + 1900,
+                 my_tm.tm_mon + 1, my_tm.tm_mday, m_log_name, index);
+    } else {
+        snprintf(out, len, "%s%d_%02d_%02d_%s", m_dir_name, my_tm.tm_year + 1900,
+                 my_tm.tm_mon + 1, my_tm.tm_mday, m_log_name);
+    }
+}
 
-    if (m_is_async && m_log_queue && !m_log_queue->is_full()) {
-        m_log_queue->push(log_str);
+// 换上新的fd，正在写旧fd的线程持有读锁，所以关闭旧fd是安全的
+void Log::swap_fd(int fd) {
+    m_fd_lock.wrlock();
+    int old_fd = m_fd;
+    m_fd = fd;
+    m_fd_lock.unlock();
+    if (old_fd >= 0) {
+        if (m_unsynced) {
+            fdatasync(old_fd);
+        }
+        close(old_fd);
+    }
+    m_unsynced = false;
+}
+
+// 同步模式下由写日志的线程切换文件
+void Log::rotate(time_t now, long long count) {
+    m_fd_lock.wrlock();
+    bool new_day = now >= m_next_day;
+    if (!new_day && count % m_split_lines != 0) {
+        // 其他线程已经切换过了
+        m_fd_lock.unlock();
+        return;
+    }
+
+    char new_log[256];
+    if (new_day) {
+        log_file_name(now, 0, new_log, sizeof(new_log));
+        m_next_day = next_midnight(now);
+        m_count = 0;
     } else {
-        m_mutex.lock();
-        fputs(log_str.c_str(), m_fp);
-        m_mutex.unlock();
+        log_file_name(now, count / m_split_lines, new_log, sizeof(new_log));
     }
-    va_end(valst);
+    int fd = open_log_file(new_log);
+    if (fd >= 0) {
+        close(m_fd);
+        m_fd = fd;
+    }
+    m_fd_lock.unlock();
 }
 
-void Log::flush() {
-    m_mutex.lock();
-    fflush(m_fp);
-    m_mutex.unlock();
+// 异步模式下由后台线程切换文件，优先使用预先打开的fd
+void Log::writer_rotate(time_t now) {
+    bool new_day = now >= m_next_day;
+    if (new_day) {
+        m_next_day = next_midnight(now);
+        m_count = 0;
+    }
+    char path[256];
+    log_file_name(now, new_day ? 0 : m_count / m_split_lines, path, sizeof(path));
+
+    // 之前的文本属于旧文件
+    flush_output();
+    int fd = -1;
+    if (m_next_fd >= 0 && strcmp(path, m_next_path) == 0) {
+        fd = m_next_fd;
+    } else {
+        if (m_next_fd >= 0) {
+            close(m_next_fd);
+        }
+        fd = open_log_file(path);
+    }
+    m_next_fd = -1;
+    if (fd >= 0) {
+        swap_fd(fd);
+    }
+}
+
+// 快到切换点时提前打开下一个文件，切换时只需要换fd
+void Log::preopen_next_file() {
+    if (m_next_fd >= 0) {
+        return;
+    }
+    time_t now = time(NULL);
+    char path[256];
+    if (now >= m_next_day - PREOPEN_SECONDS) {
+        log_file_name((time_t)m_next_day, 0, path, sizeof(path));
+    } else if (m_count % m_split_lines >= m_split_lines - m_split_lines / 10) {
+        log_file_name(now, m_count / m_split_lines + 1, path, sizeof(path));
+    } else {
+        return;
+    }
+    m_next_fd = open_log_file(path);
+    snprintf(m_next_path, sizeof(m_next_path), "%s", path);
+}
+
+void Log::set_sync_interval(int interval_ms) {
+    m_sync_interval_ms = interval_ms > 0 ? interval_ms : 0;
+}
+
+void Log::maybe_sync() {
+    int interval = m_sync_interval_ms;
+    if (interval <= 0 || !m_unsynced) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    long long now_ms = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if (now_ms - m_last_sync_ms < interval) {
+        return;
+    }
+    m_fd_lock.rdlock();
+    fdatasync(m_fd);
+    m_fd_lock.unlock();
+    m_last_sync_ms = now_ms;
+    m_unsynced = false;
+}
+
+void Log::wake_writer() {
+    m_wake_mutex.lock();
+    m_wake_pending = true;
+    m_wake_cond.signal();
+    m_wake_mutex.unlock();
+}
+
+void Log::stop_writer() {
+    if (!m_thread_id) {
+        return;
+    }
+    m_wake_mutex.lock();
+    m_stop_thread = true;
+    m_wake_cond.signal();
+    m_wake_mutex.unlock();
+    pthread_join(m_thread_id, nullptr);
+    m_thread_id = 0;
+}
+
+void Log::flush_output() {
+    if (m_output_len > 0) {
+        write_direct(m_output.data(), m_output_len);
+        m_output_len = 0;
+        m_unsynced = true;
+    }
+}
+
+void Log::append_access(const char *data, size_t len) {
+    if (m_access_output.size() - m_access_output_len < len) {
+        flush_access();
+        if (m_access_output.size() < len) {
+            return;
+        }
+    }
+    memcpy(m_access_output.data() + m_access_output_len, data, len);
+    m_access_output_len += len;
+}
+
+void Log::flush_access() {
+    if (m_access_output_len > 0) {
+        m_fd_lock.rdlock();
+        write_fully(m_access_fd, m_access_output.data(), m_access_output_len);
+        m_fd_lock.unlock();
+        m_access_output_len = 0;
+    }
+}
+
+void Log::append_capture(const char *data, size_t len) {
+    if (m_capture_output.size() - m_capture_output_len < len) {
+        flush_capture();
+        if (m_capture_output.size() < len) {
+            return;
+        }
+    }
+    memcpy(m_capture_output.data() + m_capture_output_len, data, len);
+    m_capture_output_len += len;
+}
+
+void Log::flush_capture() {
+    if (m_capture_output_len > 0) {
+        m_fd_lock.rdlock();
+        write_fully(m_capture_fd, m_capture_output.data(), m_capture_output_len);
+        m_fd_lock.unlock();
+        m_capture_output_len = 0;
+    }
+}
+
+// 取出各线程缓冲区中的记录，格式化后成批写出
+void Log::drain_buffers() {
+    std::vector<LogBuffer *> buffers;
+    m_buffers_mutex.lock();
+    for (auto it = m_buffers.begin(); it != m_buffers.end();) {
+        if ((*it)->retired() && (*it)->readable() == 0) {
+            it = m_buffers.erase(it);
+        } else {
+            buffers.push_back(it->get());
+            ++it;
+        }
+    }
+    m_buffers_mutex.unlock();
+
+    for (LogBuffer *buffer : buffers) {
+        // 只取开始时已有的记录，避免被一直写日志的线程拖住
+        size_t readable = buffer->readable();
+        while (readable >= sizeof(logrec::RecordHeader)) {
+            logrec::RecordHeader header;
+            buffer->copy_out(&header, sizeof(header));
+            if (m_record.size() < header.size) {
+                m_record.resize(header.size);
+            }
+            buffer->copy_out(m_record.data(), header.size);
+            buffer->consume(header.size);
+            readable -= header.size;
+
+            if (header.level == ACCESS_LEVEL) {
+                append_access(m_record.data() + sizeof(header), header.size - sizeof(header));
+                continue;
+            }
+            if (header.level == CAPTURE_LEVEL) {
+                append_capture(m_record.data() + sizeof(header), header.size - sizeof(header));
+                continue;
+            }
+            time_t sec = (time_t)(header.time_ns / 1000000000);
+            if (sec >= m_next_day || (m_count > 0 && m_count % m_split_lines == 0)) {
+                writer_rotate(sec);
+            }
+            ++m_count;
+
+            if (m_output.size() - m_output_len < (size_t)m_log_buf_size) {
+                flush_output();
+            }
+            m_output_len += format_line(m_record.data(), m_output.data() + m_output_len);
+        }
+    }
+    flush_output();
+    flush_access();
+    flush_capture();
 }
 
 void *Log::async_write_log() {
-    std::string single_log;
-    while (!m_stop_thread) {
-        if (m_log_queue && m_log_queue->pop(single_log)) {
-            m_mutex.lock();
-            fputs(single_log.c_str(), m_fp);
-            m_mutex.unlock();
+    while (true) {
+        m_wake_mutex.lock();
+        if (!m_stop_thread && !m_wake_pending) {
+            struct timespec abstime;
+            clock_gettime(CLOCK_REALTIME, &abstime);
+            abstime.tv_nsec += (long)FLUSH_INTERVAL_MS * 1000000;
+            if (abstime.tv_nsec >= 1000000000) {
+                abstime.tv_sec += abstime.tv_nsec / 1000000000;
+                abstime.tv_nsec %= 1000000000;
+            }
+            m_wake_cond.timed_wait(m_wake_mutex, &abstime);
         }
+        bool stop = m_stop_thread;
+        m_wake_pending = false;
+        m_wake_mutex.unlock();
+
+        drain_buffers();
+        if (stop) {
+            break;
+        }
+        preopen_next_file();
+        maybe_sync();
+    }
+    if (m_next_fd >= 0) {
+        close(m_next_fd);
+        m_next_fd = -1;
     }
     return nullptr;
 }
@@ -8,8 +8,20 @@
 #include <pthread.h>
 #include <memory>
 #include <atomic>
+#include <vector>
 
-#include "../block_queue/block_queue.h"
+#include "../lock/locker.h"
+#include "log_buffer.h"
+#include "log_rate_limiter.h"
+#include "log_record.h"
+#include "access_record.h"
+#include "capture_record.h"
+
+// 编译期最低日志级别(0:DEBUG 1:INFO 2:WARN 3:ERROR 4:全部关闭)，
+// 低于它的LOG_*在编译时就被去掉，例如 -DTWS_LOG_MIN_LEVEL=1
+#ifndef TWS_LOG_MIN_LEVEL
+#define TWS_LOG_MIN_LEVEL 0
+#endif
 
 class Log {
 public:
@@ -25,11 +37,57 @@ public:
         return &instance;
     }
 
+    // max_queue_size >= 1 开启异步模式: 每个线程一个约能容纳max_queue_size行的缓冲区
     bool init(const char *file_name, int close_log, int log_buf_size = 8192, 
               int split_lines = 5000000, int max_queue_size = 0);
-    void write_log(Level level, const char *format, ...);
+    // 调用线程只记录格式串指针、时间戳和原始参数，格式化由后台线程完成。
+    // format必须是字符串字面量(由LOG_*宏保证)
+    template <typename... Args>
+    void write_log(Level level, const char *format, const Args&... args) {
+        size_t cap = 0;
+        char *buf = record_buffer(&cap);
+        logrec::RecordWriter writer(buf, cap, m_log_buf_size);
+        writer.begin((uint8_t)level, format);
+        int expand[] = {0, (logrec::encode_arg(writer, args), 0)...};
+        (void)expand;
+        commit_record(buf, writer.finish());
+    }
+    // 请求后台线程立即写出各线程缓冲区，平时按大小或时间间隔写出
     void flush();
     bool is_logging_enabled() const { return m_close_log == 0; }
+    bool is_enabled(Level level) const {
+        return m_close_log == 0 && (int)level >= m_level.load(std::memory_order_relaxed);
+    }
+
+    // 运行期日志级别，可随时修改
+    void set_level(Level level);
+    Level get_level() const { return (Level)m_level.load(std::memory_order_relaxed); }
+    // 在DEBUG和set_level设置的级别之间切换(SIGUSR1)
+    void toggle_debug();
+
+    // 每个LOG_*调用点每秒最多per_second条，允许突发burst条；per_second为0时不限速
+    void set_rate_limit(int per_second, int burst);
+    bool admit(LogRateLimiter &site, uint64_t *dropped) {
+        return site.acquire(m_rate_interval_us.load(std::memory_order_relaxed),
+                            m_rate_burst.load(std::memory_order_relaxed), dropped);
+    }
+    void report_suppressed(const char *file, int line, uint64_t dropped);
+
+    // 异步模式下后台线程每隔interval_ms对日志文件做一次fdatasync，0表示不做(默认)
+    void set_sync_interval(int interval_ms);
+
+    // 二进制访问日志(见access_record.h)，每sample个请求记录一个，0表示关闭。
+    // 需在处理请求之前调用，与文本日志共用各线程缓冲区和后台线程
+    bool init_access(const char *file_name, int sample);
+    // 决定是否记录这个请求: 返回0表示不记录，否则为记录的权重(写入AccessRecord::sample)。
+    // 按线程计数采样，出错或没有响应的请求总是记录
+    int sample_access(int status);
+    void write_access(const accesslog::AccessRecord &record);
+
+    // 原始请求流量抓取(见capture_record.h)，file_name为空时关闭。同样经过各线程缓冲区
+    bool init_capture(const char *file_name);
+    bool is_capturing() const { return m_capture_fd >= 0; }
+    void write_capture(uint64_t conn_id, capture::Type type, const char *data = nullptr, uint32_t len = 0);
 
 private:
     Log();
@@ -37,47 +95,116 @@ private:
     Log(const Log&) = delete;
     Log& operator=(const Log&) = delete;
 
+    static const int DEFAULT_RATE_PER_SECOND = 1000;
+    static const int DEFAULT_RATE_BURST = 2000;
+
+    // 按平均行长估算每个线程缓冲区的大小
+    static const int AVG_LINE_SIZE = 128;
+    // 后台线程至少每隔这么久写出一次
+    static const int FLUSH_INTERVAL_MS = 100;
+    // 记录头和数值参数占用的额外空间
+    static const int RECORD_SLACK = 256;
+    // 后台线程攒够这么多文本再写文件
+    static const size_t OUTPUT_BATCH_SIZE = 256 * 1024;
+    // 距零点不到这么多秒时提前打开第二天的文件
+    static const int PREOPEN_SECONDS = 60;
+    // 访问日志记录在RecordHeader::level中的标记，后台线程原样写入访问日志文件
+    static const uint8_t ACCESS_LEVEL = 0xff;
+    static const size_t ACCESS_BATCH_SIZE = 64 * 1024;
+    // 抓包记录的标记，后台线程原样写入抓包文件
+    static const uint8_t CAPTURE_LEVEL = 0xfe;
+    static const size_t CAPTURE_BATCH_SIZE = 256 * 1024;
+
     void *async_write_log();
     static void *flush_log_thread(void *args);
+    void stop_writer();
+    void wake_writer();
+    void drain_buffers();
+    LogBuffer *thread_buffer();
+    char *record_buffer(size_t *cap);
+    void commit_record(const char *record, size_t len);
+    size_t format_line(const char *record, char *out);
+    bool append_async(const char *record, size_t len);
+    void write_direct(const char *line, size_t len);
+    void flush_output();
+    void append_access(const char *data, size_t len);
+    void flush_access();
+    void append_capture(const char *data, size_t len);
+    void flush_capture();
+    void log_file_name(time_t day, long long index, char *out, size_t len) const;
+    void swap_fd(int fd);
+    void rotate(time_t now, long long count);
+    void writer_rotate(time_t now);
+    void preopen_next_file();
+    void maybe_sync();
 
     char m_dir_name[128];
     char m_log_name[128];
     int m_split_lines;
     int m_log_buf_size;
     std::atomic<long long> m_count;
-    int m_today;
-    FILE *m_fp;
-    std::unique_ptr<char[]> m_buf;
-    std::unique_ptr<BlockQueue<std::string>> m_log_queue;
+    // 下一个本地零点，到点后切换到新一天的文件
+    std::atomic<long long> m_next_day;
+    int m_fd;
+    // 写文件持读锁，切换文件持写锁
+    locker::RWLock m_fd_lock;
     bool m_is_async;
-    locker::Mutex m_mutex;
+    size_t m_thread_buffer_size;
+    // 各线程的缓冲区，只有后台线程会释放已退出线程的缓冲区
+    std::vector<std::unique_ptr<LogBuffer>> m_buffers;
+    locker::Mutex m_buffers_mutex;
+    locker::Mutex m_wake_mutex;
+    locker::ConditionVariable m_wake_cond;
+    bool m_wake_pending;
+    // 以下只由后台线程使用
+    std::vector<char> m_record;
+    std::vector<char> m_output;
+    size_t m_output_len;
+    std::atomic<int> m_sync_interval_ms;
+    int m_next_fd;
+    char m_next_path[256];
+    long long m_last_sync_ms;
+    bool m_unsynced;
+    // 访问日志，fd同样受m_fd_lock保护
+    int m_access_fd;
+    std::atomic<int> m_access_sample;
+    std::vector<char> m_access_output;
+    size_t m_access_output_len;
+    // 抓包文件，fd同样受m_fd_lock保护
+    std::atomic<int> m_capture_fd;
+    std::vector<char> m_capture_output;
+    size_t m_capture_output_len;
     int m_close_log;
+    std::atomic<int> m_level;
+    int m_configured_level;
+    std::atomic<int64_t> m_rate_interval_us;
+    std::atomic<int64_t> m_rate_burst;
     pthread_t m_thread_id;
     bool m_stop_thread;
 };
 
-#define LOG_DEBUG(format, ...) \
-    if(Log::get_instance()->is_logging_enabled()) { \
-        Log::get_instance()->write_log(Log::Level::DEBUG, format, ##__VA_ARGS__); \
-        Log::get_instance()->flush(); \
-    }
-
-#define LOG_INFO(format, ...) \
-    if(Log::get_instance()->is_logging_enabled()) { \
-        Log::get_instance()->write_log(Log::Level::INFO, format, ##__VA_ARGS__); \
-        Log::get_instance()->flush(); \
-    }
+// 不会被调用，只用于让编译器按printf规则检查LOG_*的参数
+inline void __attribute__((format(printf, 1, 2))) log_format_check(const char *, ...) {}
 
-#define LOG_WARN(format, ...) \
-    if(Log::get_instance()->is_logging_enabled()) { \
-        Log::get_instance()->write_log(Log::Level::WARN, format, ##__VA_ARGS__); \
-        Log::get_instance()->flush(); \
-    }
+// 级别低于TWS_LOG_MIN_LEVEL的分支是常量false，整条语句会被编译器去掉。
+// 每个调用点有自己的限速器，被丢弃的条数在下一次放行时补记一条WARN
+#define LOG_AT(level, format, ...) \
+    do { \
+        if (0) log_format_check(format, ##__VA_ARGS__); \
+        if ((int)(level) >= TWS_LOG_MIN_LEVEL && Log::get_instance()->is_enabled(level)) { \
+            static LogRateLimiter tws_log_site; \
+            uint64_t tws_log_dropped; \
+            if (Log::get_instance()->admit(tws_log_site, &tws_log_dropped)) { \
+                if (tws_log_dropped) \
+                    Log::get_instance()->report_suppressed(__FILE__, __LINE__, tws_log_dropped); \
+                Log::get_instance()->write_log(level, "" format, ##__VA_ARGS__); \
+            } \
+        } \
+    } while (0)
 
-#define LOG_ERROR(format, ...) \
-    if(Log::get_instance()->is_logging_enabled()) { \
-        Log::get_instance()->write_log(Log::Level::ERROR, format, ##__VA_ARGS__); \
-        Log::get_instance()->flush(); \
-    }
+#define LOG_DEBUG(format, ...) LOG_AT(Log::Level::DEBUG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(Log::Level::INFO, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...) LOG_AT(Log::Level::WARN, format, ##__VA_ARGS__)
+#define LOG_ERROR(format, ...) LOG_AT(Log::Level::ERROR, format, ##__VA_ARGS__)
 
 #endif
\ No newline at end of file
@@ -0,0 +1,86 @@
+#ifndef LOG_BUFFER_H
+#define LOG_BUFFER_H
+
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+
+// Single-producer/single-consumer byte ring owned by one logging thread.
+//
+// The owning thread appends whole records without locks; the log writer
+// thread copies them out and then releases them. Capacity is rounded up to
+// a power of two.
+class LogBuffer {
+public:
+    explicit LogBuffer(size_t capacity)
+        : m_capacity(round_up(capacity))
+        , m_mask(m_capacity - 1)
+        , m_data(new char[m_capacity])
+        , m_head(0)
+        , m_tail(0)
+        , m_retired(false) {
+    }
+
+    LogBuffer(const LogBuffer&) = delete;
+    LogBuffer& operator=(const LogBuffer&) = delete;
+
+    size_t capacity() const { return m_capacity; }
+
+    size_t readable() const {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+    // Producer side. Fails without writing anything if the record does not fit.
+    bool append(const char* data, size_t len) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_acquire);
+        if (len > m_capacity - (tail - head)) {
+            return false;
+        }
+        size_t offset = tail & m_mask;
+        size_t first = len < m_capacity - offset ? len : m_capacity - offset;
+        memcpy(m_data.get() + offset, data, first);
+        memcpy(m_data.get(), data + first, len - first);
+        m_tail.store(tail + len, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Copies len readable bytes without releasing them.
+    void copy_out(void* dst, size_t len) const {
+        size_t offset = m_head.load(std::memory_order_relaxed) & m_mask;
+        size_t first = len < m_capacity - offset ? len : m_capacity - offset;
+        memcpy(dst, m_data.get() + offset, first);
+        memcpy(static_cast<char*>(dst) + first, m_data.get(), len - first);
+    }
+
+    void consume(size_t len) {
+        m_head.store(m_head.load(std::memory_order_relaxed) + len, std::memory_order_release);
+    }
+
+    // Set when the owning thread exits; the writer frees the buffer once drained
+    void retire() { m_retired.store(true, std::memory_order_release); }
+    bool retired() const { return m_retired.load(std::memory_order_acquire); }
+
+private:
+    static size_t round_up(size_t n) {
+        size_t cap = 4096;
+        while (cap < n) {
+            cap <<= 1;
+        }
+        return cap;
+    }
+
+    size_t m_capacity;
+    size_t m_mask;
+    std::unique_ptr<char[]> m_data;
+    // Keep the writer's head and the owner's tail on separate cache lines
+    // (padding rather than alignas: heap allocations are not over-aligned in C++14)
+    char m_pad0[64];
+    std::atomic<size_t> m_head;
+    char m_pad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_tail;
+    std::atomic<bool> m_retired;
+};
+
+#endif
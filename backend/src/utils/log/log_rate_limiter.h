@@ -0,0 +1,55 @@
+#ifndef LOG_RATE_LIMITER_H
+#define LOG_RATE_LIMITER_H
+
+#include <stdint.h>
+#include <atomic>
+
+#include "../timer/monotonic.h"
+
+// Token bucket for a single LOG_* call site.
+//
+// Implemented as GCRA (the "virtual scheduling" form of a token bucket): one
+// atomic holds the theoretical arrival time of the next allowed message, so
+// checking and consuming a token is a load and a CAS. Every LOG_* expansion
+// owns a static instance; the constexpr constructor makes it constant-
+// initialized, so no guard variable sits on the logging path.
+class LogRateLimiter {
+public:
+    constexpr LogRateLimiter() : m_tat(0), m_suppressed(0) {}
+
+    LogRateLimiter(const LogRateLimiter&) = delete;
+    LogRateLimiter& operator=(const LogRateLimiter&) = delete;
+
+    // interval_us is the time per token, burst the bucket depth; interval 0
+    // disables limiting. On success *dropped is set to the number of calls
+    // rejected since the previous one that got through.
+    bool acquire(int64_t interval_us, int64_t burst, uint64_t* dropped) {
+        *dropped = 0;
+        if (interval_us <= 0) {
+            return true;
+        }
+        // A few milliseconds of resolution is plenty for a rate limit
+        int64_t now = monotonic::coarse_now_us();
+        int64_t tat = m_tat.load(std::memory_order_relaxed);
+        while (true) {
+            int64_t next = (tat > now ? tat : now) + interval_us;
+            if (next - now > burst * interval_us) {
+                m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (m_tat.compare_exchange_weak(tat, next, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        if (m_suppressed.load(std::memory_order_relaxed) != 0) {
+            *dropped = m_suppressed.exchange(0, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+private:
+    std::atomic<int64_t> m_tat;
+    std::atomic<uint64_t> m_suppressed;
+};
+
+#endif
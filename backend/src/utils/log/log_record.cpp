@@ -0,0 +1,232 @@
+#include "log_record.h"
+
+#include <stdio.h>
+#include <string>
+
+namespace logrec {
+
+namespace {
+
+struct Arg {
+    uint8_t type;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+    };
+    const char *str;
+    uint32_t str_len;
+};
+
+class ArgReader {
+public:
+    ArgReader(const char *pos, const char *end, int count) : m_pos(pos), m_end(end), m_left(count) {}
+
+    bool next(Arg &arg) {
+        if (m_left <= 0 || m_pos >= m_end) {
+            return false;
+        }
+        arg.type = (uint8_t)*m_pos++;
+        if (arg.type == ARG_STRING) {
+            if ((size_t)(m_end - m_pos) < sizeof(uint32_t)) {
+                return false;
+            }
+            memcpy(&arg.str_len, m_pos, sizeof(uint32_t));
+            m_pos += sizeof(uint32_t);
+            if ((size_t)(m_end - m_pos) < arg.str_len) {
+                return false;
+            }
+            arg.str = m_pos;
+            m_pos += arg.str_len;
+        } else {
+            if ((size_t)(m_end - m_pos) < sizeof(uint64_t)) {
+                return false;
+            }
+            memcpy(&arg.u, m_pos, sizeof(uint64_t));
+            m_pos += sizeof(uint64_t);
+        }
+        --m_left;
+        return true;
+    }
+
+private:
+    const char *m_pos;
+    const char *m_end;
+    int m_left;
+};
+
+class Output {
+public:
+    Output(char *out, size_t cap) : m_out(out), m_cap(cap), m_len(0) {
+        if (m_cap > 0) {
+            m_out[0] = '\0';
+        }
+    }
+
+    void append(const char *s, size_t n) {
+        if (m_len + 1 >= m_cap) {
+            return;
+        }
+        if (n > m_cap - 1 - m_len) {
+            n = m_cap - 1 - m_len;
+        }
+        memcpy(m_out + m_len, s, n);
+        m_len += n;
+        m_out[m_len] = '\0';
+    }
+
+    // snprintf straight into the remaining space
+    template <class T>
+    void printf_one(const char *spec, T value) {
+        if (m_len + 1 >= m_cap) {
+            return;
+        }
+        int n = snprintf(m_out + m_len, m_cap - m_len, spec, value);
+        if (n > 0) {
+            m_len += (size_t)n < m_cap - m_len ? (size_t)n : m_cap - m_len - 1;
+        }
+    }
+
+    size_t length() const { return m_len; }
+
+private:
+    char *m_out;
+    size_t m_cap;
+    size_t m_len;
+};
+
+int64_t as_int(const Arg &arg) {
+    return arg.type == ARG_DOUBLE ? (int64_t)arg.d : arg.i;
+}
+
+} // namespace
+
+size_t format_record_args(const RecordHeader &header, const char *args, const char *end,
+                          char *out, size_t cap) {
+    Output output(out, cap);
+    ArgReader reader(args, end, header.nargs);
+    const char *p = header.format;
+
+    while (*p) {
+        const char *percent = strchr(p, '%');
+        if (!percent) {
+            output.append(p, strlen(p));
+            break;
+        }
+        output.append(p, percent - p);
+        if (percent[1] == '%') {
+            output.append("%", 1);
+            p = percent + 2;
+            continue;
+        }
+
+        // Rebuild the conversion spec with '*' resolved and the length
+        // modifier replaced by the width the argument was stored with
+        char spec[64];
+        size_t n = 0;
+        const char *q = percent + 1;
+        spec[n++] = '%';
+        bool ok = true;
+        while (*q && strchr("-+ #0'", *q) && n < 32) {
+            spec[n++] = *q++;
+        }
+        for (int part = 0; part < 2 && ok; ++part) {
+            if (part == 1) {
+                if (*q != '.') {
+                    break;
+                }
+                spec[n++] = *q++;
+            }
+            if (*q == '*') {
+                Arg star = Arg();
+                if (!reader.next(star)) {
+                    ok = false;
+                    break;
+                }
+                n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)as_int(star));
+                ++q;
+            } else {
+                while (*q >= '0' && *q <= '9' && n < 48) {
+                    spec[n++] = *q++;
+                }
+            }
+        }
+        while (*q && strchr("hlLqjzt", *q)) {
+            ++q;
+        }
+        char conv = *q;
+        if (!ok || !conv) {
+            output.append(percent, strlen(percent));
+            break;
+        }
+        p = q + 1;
+
+        Arg arg = Arg();
+        if (conv == 'n' || !reader.next(arg)) {
+            output.append(percent, p - percent);
+            continue;
+        }
+        switch (conv) {
+            case 'd':
+            case 'i':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conv;
+                spec[n] = '\0';
+                output.printf_one(spec, (long long)as_int(arg));
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conv;
+                spec[n] = '\0';
+                output.printf_one(spec, (unsigned long long)as_int(arg));
+                break;
+            case 'c':
+                spec[n++] = conv;
+                spec[n] = '\0';
+                output.printf_one(spec, (int)as_int(arg));
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                spec[n++] = conv;
+                spec[n] = '\0';
+                output.printf_one(spec, arg.type == ARG_DOUBLE ? arg.d : (double)arg.i);
+                break;
+            case 's':
+                if (arg.type != ARG_STRING) {
+                    output.append("(?)", 3);
+                } else if (n == 1) {
+                    // Plain %s, the common case: no need to go through snprintf
+                    output.append(arg.str, arg.str_len);
+                } else {
+                    // Stored strings are not NUL-terminated
+                    std::string value(arg.str, arg.str_len);
+                    spec[n++] = 's';
+                    spec[n] = '\0';
+                    output.printf_one(spec, value.c_str());
+                }
+                break;
+            case 'p':
+                spec[n++] = conv;
+                spec[n] = '\0';
+                output.printf_one(spec, (void *)(uintptr_t)arg.u);
+                break;
+            default:
+                output.append(percent, p - percent);
+                break;
+        }
+    }
+    return output.length();
+}
+
+} // namespace logrec
@@ -0,0 +1,152 @@
+#ifndef LOG_RECORD_H
+#define LOG_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <type_traits>
+
+// Binary log records.
+//
+// The logging thread only stores the format string pointer (always a
+// literal, see the LOG_* macros), a timestamp and the raw arguments, each
+// tagged with its type. Formatting happens later on the writer thread via
+// format_record_args(), which walks the printf format and renders one
+// conversion at a time.
+//
+//   RecordHeader | tag arg | tag arg | ...
+//
+// Strings are copied (the caller's buffer may be gone by then) and
+// truncated to the line size; integers widen to 64 bits.
+namespace logrec {
+
+enum ArgType : uint8_t {
+    ARG_INT = 1,
+    ARG_UINT,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER
+};
+
+struct RecordHeader {
+    uint32_t size;      // whole record, header included
+    uint8_t level;
+    uint8_t nargs;
+    uint16_t reserved;
+    const char *format;
+    int64_t time_ns;    // CLOCK_REALTIME
+};
+
+class RecordWriter {
+public:
+    RecordWriter(char *buf, size_t cap, size_t max_string)
+        : m_buf(buf), m_pos(buf + sizeof(RecordHeader)), m_end(buf + cap), m_max_string(max_string) {
+        m_header.nargs = 0;
+    }
+
+    void begin(uint8_t level, const char *format) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        m_header.level = level;
+        m_header.reserved = 0;
+        m_header.format = format;
+        m_header.time_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    void put_int(int64_t v) { put(ARG_INT, &v, sizeof(v)); }
+    void put_uint(uint64_t v) { put(ARG_UINT, &v, sizeof(v)); }
+    void put_double(double v) { put(ARG_DOUBLE, &v, sizeof(v)); }
+    void put_pointer(const void *p) {
+        uint64_t v = (uint64_t)(uintptr_t)p;
+        put(ARG_POINTER, &v, sizeof(v));
+    }
+
+    void put_string(const char *s) {
+        if (!s) {
+            s = "(null)";
+        }
+        size_t len = strnlen(s, m_max_string);
+        size_t room = (size_t)(m_end - m_pos);
+        if (room < 1 + sizeof(uint32_t)) {
+            return;
+        }
+        if (len > room - 1 - sizeof(uint32_t)) {
+            len = room - 1 - sizeof(uint32_t);
+        }
+        uint32_t n = (uint32_t)len;
+        *m_pos++ = (char)ARG_STRING;
+        memcpy(m_pos, &n, sizeof(n));
+        memcpy(m_pos + sizeof(n), s, len);
+        m_pos += sizeof(n) + len;
+        ++m_header.nargs;
+    }
+
+    // Returns the record length
+    size_t finish() {
+        m_header.size = (uint32_t)(m_pos - m_buf);
+        memcpy(m_buf, &m_header, sizeof(m_header));
+        return m_header.size;
+    }
+
+private:
+    // Arguments that do not fit are dropped; the formatter prints their
+    // conversion spec verbatim
+    void put(ArgType type, const void *v, size_t len) {
+        if ((size_t)(m_end - m_pos) < 1 + len) {
+            return;
+        }
+        *m_pos++ = (char)type;
+        memcpy(m_pos, v, len);
+        m_pos += len;
+        ++m_header.nargs;
+    }
+
+    RecordHeader m_header;
+    char *m_buf;
+    char *m_pos;
+    char *m_end;
+    size_t m_max_string;
+};
+
+template <class T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+encode_arg(RecordWriter &w, T v) {
+    w.put_int((int64_t)v);
+}
+
+template <class T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type
+encode_arg(RecordWriter &w, T v) {
+    w.put_uint((uint64_t)v);
+}
+
+template <class T>
+typename std::enable_if<std::is_enum<T>::value>::type
+encode_arg(RecordWriter &w, T v) {
+    w.put_int((int64_t)v);
+}
+
+template <class T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+encode_arg(RecordWriter &w, T v) {
+    w.put_double((double)v);
+}
+
+inline void encode_arg(RecordWriter &w, const char *s) {
+    w.put_string(s);
+}
+
+template <class T>
+void encode_arg(RecordWriter &w, const T *p) {
+    w.put_pointer(p);
+}
+
+// Renders the record's format and arguments into out (at most cap - 1
+// bytes, NUL-terminated) and returns the number of bytes written.
+size_t format_record_args(const RecordHeader &header, const char *args, const char *end,
+                          char *out, size_t cap);
+
+} // namespace logrec
+
+#endif
@@ -0,0 +1,348 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
+namespace metrics {
+
+namespace detail {
+
+thread_local Slab *t_slab = nullptr;
+
+namespace {
+
+// Hands the slab back to the registry when the thread exits
+struct SlabOwner {
+    Slab *slab = nullptr;
+
+    ~SlabOwner() {
+        if (slab) {
+            t_slab = nullptr;
+            Registry::get_instance()->retire_slab(slab);
+        }
+    }
+};
+
+thread_local SlabOwner t_owner;
+
+} // namespace
+
+Slab *attach_thread() {
+    t_owner.slab = Registry::get_instance()->add_slab();
+    t_slab = t_owner.slab;
+    return t_slab;
+}
+
+} // namespace detail
+
+namespace {
+
+const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+// Exported cumulative buckets: 1, 2, 4 ... 2^26 (1us ... ~67s for durations)
+const int EXPORTED_POWERS = 27;
+
+void append_format(std::string *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+void append_format(std::string *out, const char *format, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (n > 0) {
+        out->append(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+    }
+}
+
+// "{a=\"b\"}" or "", optionally with one more label appended
+std::string label_set(const std::string &labels, const char *extra = nullptr) {
+    std::string set = labels;
+    if (extra) {
+        if (!set.empty()) {
+            set += ",";
+        }
+        set += extra;
+    }
+    return set.empty() ? set : "{" + set + "}";
+}
+
+void append_value(std::string *out, double value) {
+    if (value == (double)(int64_t)value) {
+        append_format(out, "%lld\n", (long long)value);
+    } else {
+        append_format(out, "%.9g\n", value);
+    }
+}
+
+} // namespace
+
+Registry *Registry::get_instance() {
+    static Registry instance;
+    return &instance;
+}
+
+Registry::Registry()
+    : m_next_cell(0)
+    , m_chunk_count(0) {}
+
+void Registry::add_chunk(detail::Slab *slab, uint32_t chunk) {
+    detail::Cell *cells = new detail::Cell[detail::CHUNK_CELLS];
+    for (uint32_t i = 0; i < detail::CHUNK_CELLS; ++i) {
+        cells[i].store(0, std::memory_order_relaxed);
+    }
+    slab->chunks[chunk].store(cells, std::memory_order_release);
+}
+
+uint32_t Registry::allocate_cells(uint32_t cells, const char *name) {
+    uint32_t offset = m_next_cell & (detail::CHUNK_CELLS - 1);
+    if (m_next_cell == m_chunk_count * detail::CHUNK_CELLS || offset + cells > detail::CHUNK_CELLS) {
+        // Start a new chunk, leaving the tail of the current one unused
+        if (m_chunk_count == detail::MAX_CHUNKS) {
+            throw std::runtime_error(std::string("metrics: no cells left for ") + name);
+        }
+        for (detail::Slab *slab : m_slabs) {
+            add_chunk(slab, m_chunk_count);
+        }
+        m_next_cell = m_chunk_count * detail::CHUNK_CELLS;
+        ++m_chunk_count;
+        m_retired.resize(m_chunk_count * detail::CHUNK_CELLS, 0);
+    }
+    uint32_t cell = m_next_cell;
+    m_next_cell += cells;
+    return cell;
+}
+
+Registry::Series *Registry::add_series(const char *name, const char *help, Type type,
+                                       const char *labels, uint32_t cells, bool *created,
+                                       double scale) {
+    *created = false;
+    Family *family = nullptr;
+    for (auto &f : m_families) {
+        if (f->name == name) {
+            family = f.get();
+            break;
+        }
+    }
+    if (!family) {
+        m_families.emplace_back(new Family());
+        family = m_families.back().get();
+        family->name = name;
+        family->help = help;
+        family->type = type;
+        family->scale = scale;
+    } else if (family->type != type) {
+        throw std::runtime_error(std::string("metrics: ") + name + " registered with another type");
+    }
+    for (auto &s : family->series) {
+        if (s->labels == labels) {
+            return s.get();
+        }
+    }
+
+    std::unique_ptr<Series> series(new Series());
+    series->labels = labels;
+    series->cell = cells > 0 ? allocate_cells(cells, name) : 0;
+    family->series.push_back(std::move(series));
+    *created = true;
+    return family->series.back().get();
+}
+
+Counter *Registry::counter(const char *name, const char *help, const char *labels) {
+    locker::LockGuard guard(m_lock);
+    bool created = false;
+    Series *series = add_series(name, help, COUNTER, labels, 1, &created);
+    if (created) {
+        series->counter.reset(new Counter(series->cell));
+    }
+    return series->counter.get();
+}
+
+Histogram *Registry::histogram(const char *name, const char *help, const char *labels, Unit unit) {
+    locker::LockGuard guard(m_lock);
+    bool created = false;
+    Series *series = add_series(name, help, HISTOGRAM, labels, Histogram::CELLS, &created,
+                                unit == Unit::MICROSECONDS ? 1e6 : 1);
+    if (created) {
+        series->histogram.reset(new Histogram(series->cell));
+    }
+    return series->histogram.get();
+}
+
+void Registry::gauge(const char *name, const char *help, Callback fn, const char *labels) {
+    locker::LockGuard guard(m_lock);
+    bool created = false;
+    Series *series = add_series(name, help, GAUGE, labels, 0, &created);
+    series->fn = std::move(fn);
+}
+
+void Registry::counter_fn(const char *name, const char *help, Callback fn, const char *labels) {
+    locker::LockGuard guard(m_lock);
+    bool created = false;
+    Series *series = add_series(name, help, COUNTER, labels, 0, &created);
+    series->fn = std::move(fn);
+}
+
+void Registry::counter_samples(const char *name, const char *help, SamplesCallback fn) {
+    locker::LockGuard guard(m_lock);
+    bool created = false;
+    Series *series = add_series(name, help, COUNTER, "", 0, &created);
+    series->samples_fn = std::move(fn);
+}
+
+detail::Slab *Registry::add_slab() {
+    detail::Slab *slab = new detail::Slab();
+    for (uint32_t i = 0; i < detail::MAX_CHUNKS; ++i) {
+        slab->chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+    m_lock.lock();
+    for (uint32_t i = 0; i < m_chunk_count; ++i) {
+        add_chunk(slab, i);
+    }
+    m_slabs.push_back(slab);
+    m_lock.unlock();
+    return slab;
+}
+
+void Registry::retire_slab(detail::Slab *slab) {
+    m_lock.lock();
+    for (uint32_t chunk = 0; chunk < m_chunk_count; ++chunk) {
+        detail::Cell *cells = slab->chunks[chunk].load(std::memory_order_relaxed);
+        for (uint32_t i = 0; i < detail::CHUNK_CELLS; ++i) {
+            m_retired[chunk * detail::CHUNK_CELLS + i] += cells[i].load(std::memory_order_relaxed);
+        }
+        delete[] cells;
+    }
+    for (auto it = m_slabs.begin(); it != m_slabs.end(); ++it) {
+        if (*it == slab) {
+            m_slabs.erase(it);
+            break;
+        }
+    }
+    m_lock.unlock();
+    delete slab;
+}
+
+// Caller holds m_lock
+void Registry::collect(std::vector<uint64_t> *totals) {
+    totals->assign(m_retired.begin(), m_retired.begin() + m_next_cell);
+    for (detail::Slab *slab : m_slabs) {
+        for (uint32_t chunk = 0; chunk < m_chunk_count; ++chunk) {
+            const detail::Cell *cells = slab->chunks[chunk].load(std::memory_order_relaxed);
+            uint32_t base = chunk * detail::CHUNK_CELLS;
+            uint32_t end = std::min(m_next_cell - base, detail::CHUNK_CELLS);
+            for (uint32_t i = 0; i < end; ++i) {
+                (*totals)[base + i] += cells[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+void Registry::render_histogram(const Family &family, const Series &series,
+                                const std::vector<uint64_t> &totals, std::string *out) {
+    const uint64_t *buckets = totals.data() + series.cell;
+    uint64_t count = 0;
+    for (int i = 0; i < Histogram::BUCKETS; ++i) {
+        count += buckets[i];
+    }
+
+    // Fine buckets start at powers of two, so the exported counts are exact
+    // except that a value equal to a bound (above 8us) lands in the next one
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for (int power = 0; power < EXPORTED_POWERS; ++power) {
+        uint64_t bound = (uint64_t)1 << power;
+        while (bucket < Histogram::BUCKETS - 1 && Histogram::lower_bound(bucket + 1) <= bound + 1) {
+            cumulative += buckets[bucket++];
+        }
+        char le[32];
+        snprintf(le, sizeof(le), "le=\"%.9g\"", bound / family.scale);
+        append_format(out, "%s_bucket%s %llu\n", family.name.c_str(),
+                      label_set(series.labels, le).c_str(), (unsigned long long)cumulative);
+    }
+    append_format(out, "%s_bucket%s %llu\n", family.name.c_str(),
+                  label_set(series.labels, "le=\"+Inf\"").c_str(), (unsigned long long)count);
+    append_format(out, "%s_sum%s %.9g\n", family.name.c_str(), label_set(series.labels).c_str(),
+                  buckets[Histogram::BUCKETS] / family.scale);
+    append_format(out, "%s_count%s %llu\n", family.name.c_str(), label_set(series.labels).c_str(),
+                  (unsigned long long)count);
+}
+
+void Registry::render(std::string *out) {
+    // Families and series are never removed, so pointers taken under the lock
+    // stay valid; the series lists may grow, hence the copy
+    std::vector<std::pair<const Family *, std::vector<const Series *>>> families;
+    std::vector<uint64_t> totals;
+    m_lock.lock();
+    collect(&totals);
+    for (const auto &family : m_families) {
+        families.emplace_back(family.get(), std::vector<const Series *>());
+        for (const auto &series : family->series) {
+            families.back().second.push_back(series.get());
+        }
+    }
+    m_lock.unlock();
+
+    static const char *const TYPE_NAMES[] = {"counter", "gauge", "histogram"};
+    for (const auto &entry : families) {
+        const Family *family = entry.first;
+        append_format(out, "# HELP %s %s\n", family->name.c_str(), family->help.c_str());
+        append_format(out, "# TYPE %s %s\n", family->name.c_str(), TYPE_NAMES[family->type]);
+        for (const Series *series : entry.second) {
+            if (family->type == HISTOGRAM) {
+                render_histogram(*family, *series, totals, out);
+                continue;
+            }
+            if (series->samples_fn) {
+                Samples samples;
+                series->samples_fn(&samples);
+                for (const auto &sample : samples) {
+                    append_format(out, "%s%s ", family->name.c_str(), label_set(sample.first).c_str());
+                    append_value(out, sample.second);
+                }
+                continue;
+            }
+            append_format(out, "%s%s ", family->name.c_str(), label_set(series->labels).c_str());
+            append_value(out, series->fn ? series->fn() : (double)totals[series->cell]);
+        }
+    }
+
+    // Quantiles from the fine buckets, as a separate gauge family per histogram
+    for (const auto &entry : families) {
+        const Family *family = entry.first;
+        if (family->type != HISTOGRAM) {
+            continue;
+        }
+        append_format(out, "# HELP %s_quantile %s (estimated quantiles)\n",
+                      family->name.c_str(), family->help.c_str());
+        append_format(out, "# TYPE %s_quantile gauge\n", family->name.c_str());
+        for (const Series *series : entry.second) {
+            const uint64_t *buckets = totals.data() + series->cell;
+            uint64_t count = 0;
+            for (int i = 0; i < Histogram::BUCKETS; ++i) {
+                count += buckets[i];
+            }
+            for (double q : QUANTILES) {
+                // Midpoint of the bucket holding the q-th value
+                uint64_t rank = (uint64_t)(q * count);
+                uint64_t seen = 0;
+                double value = 0;
+                for (int i = 0; i < Histogram::BUCKETS && count > 0; ++i) {
+                    seen += buckets[i];
+                    if (seen > rank) {
+                        value = (Histogram::lower_bound(i) + Histogram::lower_bound(i + 1)) / 2.0;
+                        break;
+                    }
+                }
+                char label[32];
+                snprintf(label, sizeof(label), "quantile=\"%g\"", q);
+                append_format(out, "%s_quantile%s %.9g\n", family->name.c_str(),
+                              label_set(series->labels, label).c_str(), value / family->scale);
+            }
+        }
+    }
+}
+
+} // namespace metrics
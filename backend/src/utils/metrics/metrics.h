@@ -0,0 +1,207 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../lock/locker.h"
+
+// In-process metrics registry with Prometheus text exposition.
+//
+// Counters and histograms are sharded per thread: every thread that records
+// a value gets its own slab of cells and only ever writes to that slab, so
+// the hot path is a relaxed load and store with no shared cache line. A
+// scrape sums all slabs (plus the totals of threads that have exited).
+// Slabs are made of fixed-size chunks; registering past the last chunk adds
+// one to every slab, so the number of metrics is only bounded by
+// MAX_CHUNKS, and exceeding that throws.
+//
+// Histograms are log-linear over integers (microseconds for durations): 8
+// linear sub-buckets per power of two, which keeps quantiles within ~6% up
+// to about an hour.
+// The exposition reports cumulative buckets at powers of two and a few
+// quantiles computed from the fine buckets.
+//
+// Metrics must be registered before they are recorded from other threads;
+// registering the same name and labels twice returns the same metric.
+namespace metrics {
+
+namespace detail {
+
+typedef std::atomic<uint64_t> Cell;
+
+// A series never straddles two chunks, so its cells are contiguous
+const int CHUNK_BITS = 12;
+const uint32_t CHUNK_CELLS = 1u << CHUNK_BITS;
+const uint32_t MAX_CHUNKS = 64;
+
+struct Slab {
+    // Filled in by the registry; a chunk is published before any metric
+    // that lives in it is handed out
+    std::atomic<Cell *> chunks[MAX_CHUNKS];
+};
+
+extern thread_local Slab *t_slab;
+Slab *attach_thread();
+
+// First cell of the series starting at `cell` in this thread's slab
+inline Cell *cells(uint32_t cell) {
+    Slab *slab = t_slab;
+    if (!slab) {
+        slab = attach_thread();
+    }
+    return slab->chunks[cell >> CHUNK_BITS].load(std::memory_order_acquire) + (cell & (CHUNK_CELLS - 1));
+}
+
+// Single writer per slab, so no read-modify-write is needed
+inline void add(uint32_t cell, uint64_t n) {
+    Cell &c = *cells(cell);
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+} // namespace detail
+
+class Counter {
+public:
+    explicit Counter(uint32_t cell) : m_cell(cell) {}
+    void inc(uint64_t n = 1) { detail::add(m_cell, n); }
+
+private:
+    uint32_t m_cell;
+};
+
+class Histogram {
+public:
+    static const int SUB_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_EXPONENT = 32;
+    static const int BUCKETS = (MAX_EXPONENT - SUB_BITS + 1) * SUB_BUCKETS;
+    // Buckets followed by the sum of all values
+    static const int CELLS = BUCKETS + 1;
+
+    explicit Histogram(uint32_t cell) : m_cell(cell) {}
+
+    void observe(uint64_t value_us) {
+        detail::Cell *cells = detail::cells(m_cell);
+        detail::Cell &bucket = cells[bucket_of(value_us)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        detail::Cell &sum = cells[BUCKETS];
+        sum.store(sum.load(std::memory_order_relaxed) + value_us, std::memory_order_relaxed);
+    }
+
+    static int bucket_of(uint64_t v) {
+        if (v < (uint64_t)SUB_BUCKETS) {
+            return (int)v;
+        }
+        int exponent = 63 - __builtin_clzll(v);
+        if (exponent >= MAX_EXPONENT) {
+            return BUCKETS - 1;
+        }
+        int shift = exponent - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + (int)((v >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Smallest value that lands in `bucket`
+    static uint64_t lower_bound(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        int shift = bucket / SUB_BUCKETS - 1;
+        return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    }
+
+private:
+    uint32_t m_cell;
+};
+
+class Registry {
+public:
+    typedef std::function<double()> Callback;
+    // (labels, value) pairs for series whose label sets are only known at scrape time
+    typedef std::vector<std::pair<std::string, double>> Samples;
+    typedef std::function<void(Samples *)> SamplesCallback;
+
+    // What histogram values mean: durations in microseconds are exported in
+    // seconds, counts (batch sizes and the like) as they are
+    enum class Unit {
+        MICROSECONDS,
+        COUNT
+    };
+
+    static Registry *get_instance();
+
+    // `labels` is the inner part of a label set, e.g. "code=\"2xx\"".
+    // Throws std::runtime_error when the slabs are full or the name is
+    // already registered with another type.
+    Counter *counter(const char *name, const char *help, const char *labels = "");
+    Histogram *histogram(const char *name, const char *help, const char *labels = "",
+                         Unit unit = Unit::MICROSECONDS);
+    // Values read at scrape time, for state that already lives elsewhere
+    void gauge(const char *name, const char *help, Callback fn, const char *labels = "");
+    void counter_fn(const char *name, const char *help, Callback fn, const char *labels = "");
+    void counter_samples(const char *name, const char *help, SamplesCallback fn);
+
+    // Appends the Prometheus text format to `out`. Callbacks run without the
+    // registry lock held, so they may take locks that are held while recording
+    void render(std::string *out);
+
+    // Per-thread slabs, see attach_thread()
+    detail::Slab *add_slab();
+    void retire_slab(detail::Slab *slab);
+
+private:
+    Registry();
+    Registry(const Registry&) = delete;
+    Registry& operator=(const Registry&) = delete;
+
+    enum Type {
+        COUNTER = 0,
+        GAUGE,
+        HISTOGRAM
+    };
+
+    struct Series {
+        std::string labels;
+        uint32_t cell;
+        Callback fn;
+        SamplesCallback samples_fn;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Histogram> histogram;
+    };
+
+    struct Family {
+        std::string name;
+        std::string help;
+        Type type;
+        // Divisor applied to histogram values on export
+        double scale;
+        std::vector<std::unique_ptr<Series>> series;
+    };
+
+    Series *add_series(const char *name, const char *help, Type type, const char *labels,
+                       uint32_t cells, bool *created, double scale = 1);
+    // Caller holds m_lock
+    uint32_t allocate_cells(uint32_t cells, const char *name);
+    void add_chunk(detail::Slab *slab, uint32_t chunk);
+    void collect(std::vector<uint64_t> *totals);
+    void render_histogram(const Family &family, const Series &series,
+                          const std::vector<uint64_t> &totals, std::string *out);
+
+    locker::Mutex m_lock;
+    std::vector<std::unique_ptr<Family>> m_families;
+    uint32_t m_next_cell;
+    uint32_t m_chunk_count;
+    std::vector<detail::Slab *> m_slabs;
+    // Totals left behind by threads that have exited, m_chunk_count chunks
+    std::vector<uint64_t> m_retired;
+};
+
+} // namespace metrics
+
+#endif
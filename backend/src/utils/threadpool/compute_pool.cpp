@@ -0,0 +1,136 @@
+#include "compute_pool.h"
+
+#include <exception>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../timer/monotonic.h"
+
+static void update_max(std::atomic<uint64_t>& max, uint64_t value) {
+    uint64_t cur = max.load(std::memory_order_relaxed);
+    while (value > cur && !max.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+    }
+}
+
+ComputePool::ComputePool(const std::string& name, int thread_number, int max_pending, int nice)
+    : m_name(name)
+    , m_thread_number(thread_number)
+    , m_max_pending(max_pending)
+    , m_nice(nice)
+    , m_threads(nullptr)
+    , m_queuelocker("compute_pool_queue")
+    , m_stop(false)
+    , m_submitted(0)
+    , m_rejected(0)
+    , m_completed(0)
+    , m_max_queue_depth(0)
+    , m_total_wait_us(0)
+    , m_max_wait_us(0)
+    , m_total_run_us(0) {
+    if (thread_number <= 0 || max_pending <= 0) {
+        throw std::exception();
+    }
+    m_threads = new pthread_t[m_thread_number];
+    for (int i = 0; i < thread_number; ++i) {
+        if (pthread_create(m_threads + i, nullptr, worker, this) != 0) {
+            // Let the threads already started exit before failing
+            m_thread_number = i;
+            shutdown();
+            throw std::exception();
+        }
+    }
+}
+
+ComputePool::~ComputePool() {
+    shutdown();
+}
+
+void ComputePool::shutdown() {
+    if (!m_threads) {
+        return;
+    }
+    m_queuelocker.lock();
+    m_stop = true;
+    m_queuelocker.unlock();
+    for (int i = 0; i < m_thread_number; ++i) {
+        m_queuestat.post();
+    }
+    for (int i = 0; i < m_thread_number; ++i) {
+        pthread_join(m_threads[i], nullptr);
+    }
+    delete[] m_threads;
+    m_threads = nullptr;
+}
+
+bool ComputePool::submit(Task task) {
+    m_queuelocker.lock();
+    if (m_stop || (int)m_queue.size() >= m_max_pending) {
+        m_queuelocker.unlock();
+        ++m_rejected;
+        return false;
+    }
+    Item item;
+    item.task = std::move(task);
+    item.submitted_us = monotonic::now_us();
+    m_queue.push_back(std::move(item));
+    uint64_t depth = m_queue.size();
+    m_queuelocker.unlock();
+
+    ++m_submitted;
+    update_max(m_max_queue_depth, depth);
+    m_queuestat.post();
+    return true;
+}
+
+void* ComputePool::worker(void* arg) {
+    ComputePool* pool = static_cast<ComputePool*>(arg);
+    if (pool->m_nice != 0) {
+        // On Linux the nice value is per thread
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), pool->m_nice);
+    }
+    pool->run();
+    return pool;
+}
+
+void ComputePool::run() {
+    while (true) {
+        m_queuestat.wait();
+        m_queuelocker.lock();
+        if (m_stop) {
+            // Pending tasks are dropped; their callers are shutting down too
+            m_queuelocker.unlock();
+            break;
+        }
+        if (m_queue.empty()) {
+            m_queuelocker.unlock();
+            continue;
+        }
+        Item item = std::move(m_queue.front());
+        m_queue.pop_front();
+        m_queuelocker.unlock();
+
+        uint64_t start = monotonic::now_us();
+        uint64_t wait = start - item.submitted_us;
+        m_total_wait_us += wait;
+        update_max(m_max_wait_us, wait);
+
+        item.task();
+
+        m_total_run_us += monotonic::now_us() - start;
+        ++m_completed;
+    }
+}
+
+ComputePool::Stats ComputePool::get_stats() const {
+    Stats stats;
+    stats.submitted = m_submitted;
+    stats.rejected = m_rejected;
+    stats.completed = m_completed;
+    stats.queue_depth = stats.submitted - stats.completed;
+    stats.max_queue_depth = m_max_queue_depth;
+    stats.total_wait_us = m_total_wait_us;
+    stats.max_wait_us = m_max_wait_us;
+    stats.total_run_us = m_total_run_us;
+    return stats;
+}
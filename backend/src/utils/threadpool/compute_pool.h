@@ -0,0 +1,73 @@
+#ifndef COMPUTE_POOL_H
+#define COMPUTE_POOL_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <string>
+#include <pthread.h>
+
+#include "../lock/locker.h"
+
+// Bounded pool for CPU-heavy work (password hashing) kept off the request
+// workers, so a burst of expensive tasks queues here instead of delaying
+// static file responses. Threads run at a lower scheduling priority (`nice`),
+// and submit() fails rather than queueing past `max_pending`.
+class ComputePool {
+public:
+    typedef std::function<void()> Task;
+
+    struct Stats {
+        uint64_t submitted;
+        uint64_t rejected;
+        uint64_t completed;
+        uint64_t queue_depth;   // queued or running
+        uint64_t max_queue_depth;
+        // Time from submit() until a thread picked the task up
+        uint64_t total_wait_us;
+        uint64_t max_wait_us;
+        uint64_t total_run_us;
+    };
+
+    ComputePool(const std::string& name, int thread_number, int max_pending, int nice = 0);
+    ~ComputePool();
+
+    bool submit(Task task);
+    Stats get_stats() const;
+    const std::string& get_name() const { return m_name; }
+    int get_thread_number() const { return m_thread_number; }
+
+    ComputePool(const ComputePool&) = delete;
+    ComputePool& operator=(const ComputePool&) = delete;
+
+private:
+    struct Item {
+        Task task;
+        uint64_t submitted_us;
+    };
+
+    static void* worker(void* arg);
+    void run();
+    void shutdown();
+
+    std::string m_name;
+    int m_thread_number;
+    int m_max_pending;
+    int m_nice;
+    pthread_t* m_threads;
+    std::list<Item> m_queue;
+    locker::Mutex m_queuelocker;
+    locker::Semaphore m_queuestat;
+    bool m_stop;
+
+    std::atomic<uint64_t> m_submitted;
+    std::atomic<uint64_t> m_rejected;
+    std::atomic<uint64_t> m_completed;
+    std::atomic<uint64_t> m_max_queue_depth;
+    std::atomic<uint64_t> m_total_wait_us;
+    std::atomic<uint64_t> m_max_wait_us;
+    std::atomic<uint64_t> m_total_run_us;
+};
+
+#endif
@@ -8,6 +8,8 @@
 #include <memory>
 
 #include "../lock/locker.h"
+#include "../metrics/metrics.h"
+#include "../timer/monotonic.h"
 #include "../../third_party/sql_connection_pool.h"
 
 template <typename T>
@@ -16,25 +18,37 @@ private:
     int m_thread_number;
     int m_max_requests;
     pthread_t* m_threads;
-    std::list<T*> m_workqueue;
+    // 入队时间用于统计请求在队列中的等待时间
+    struct Item {
+        T* request;
+        int64_t enqueued_us;
+    };
+    std::list<Item> m_workqueue;
     locker::Mutex m_queuelocker;
     locker::Semaphore m_queuestat;
     ConnectionPool* m_connPool;
     int m_actor_model;
+    // 每个工作线程启动时独占一个数据库连接
+    bool m_sql_affine;
+    metrics::Histogram* m_wait_seconds;
 
     static void* worker(void* arg);
     void run();
 
 public:
-    threadpool(int actor_model, ConnectionPool* connPool, int thread_number = 8, int max_request = 10000);
+    threadpool(int actor_model, ConnectionPool* connPool, int thread_number = 8, int max_request = 10000, bool sql_affine = false);
     ~threadpool();
     
     bool append(T* request, int state);
     bool append_p(T* request);
+    // 当前排队的请求数，供/metrics读取
+    int queue_depth();
 };
 
 template <typename T>
-threadpool<T>::threadpool(int actor_model, ConnectionPool* connPool, int thread_number, int max_requests) : m_actor_model(actor_model), m_thread_number(thread_number), m_max_requests(max_requests), m_threads(nullptr), m_connPool(connPool) {
+threadpool<T>::threadpool(int actor_model, ConnectionPool* connPool, int thread_number, int max_requests, bool sql_affine) : m_actor_model(actor_model), m_thread_number(thread_number), m_max_requests(max_requests), m_threads(nullptr), m_queuelocker("threadpool_queue"), m_connPool(connPool), m_sql_affine(sql_affine) {
+    m_wait_seconds = metrics::Registry::get_instance()->histogram(
+        "tws_threadpool_wait_seconds", "Time a request waited in the worker queue");
     if (thread_number == 0 || max_requests <= 0) {
         throw std::exception();
     }
@@ -43,7 +57,7 @@ threadpool<T>::threadpool(int actor_model, ConnectionPool* connPool, int thread_
         throw std::exception();
     }
     for (int i = 0; i < thread_number; ++i) {
-        if (pthread_create(m_threads + 1, nullptr, worker, this) != 0) {
+        if (pthread_create(m_threads + i, nullptr, worker, this) != 0) {
             delete[] m_threads;
             throw std::exception();
         }
@@ -67,7 +81,7 @@ bool threadpool<T>::append(T* request, int state) {
         return false;
     }
     request->m_state = state;
-    m_workqueue.emplace_back(request);
+    m_workqueue.push_back(Item{request, monotonic::now_us()});
     m_queuelocker.unlock();
     m_queuestat.post();
     return true;
@@ -80,12 +94,20 @@ bool threadpool<T>::append_p(T* request) {
         m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.emplace_back(request);
+    m_workqueue.push_back(Item{request, monotonic::now_us()});
     m_queuelocker.unlock();
     m_queuestat.post();
     return true;
 }
 
+template <typename T>
+int threadpool<T>::queue_depth() {
+    m_queuelocker.lock();
+    int depth = (int)m_workqueue.size();
+    m_queuelocker.unlock();
+    return depth;
+}
+
 template <typename T>
 void* threadpool<T>::worker(void* arg) {
     threadpool* pool = (threadpool*)arg;
@@ -95,6 +117,9 @@ void* threadpool<T>::worker(void* arg) {
 
 template <typename T>
 void threadpool<T>::run() {
+    if (m_sql_affine && m_connPool) {
+        m_connPool->bind_thread_connection();
+    }
     while (true) {
         m_queuestat.wait();
         m_queuelocker.lock();
@@ -102,9 +127,11 @@ void threadpool<T>::run() {
             m_queuelocker.unlock();
             continue;
         }
-        T* request = m_workqueue.front();
+        Item item = m_workqueue.front();
         m_workqueue.pop_front();
         m_queuelocker.unlock();
+        T* request = item.request;
+        m_wait_seconds->observe(monotonic::now_us() - item.enqueued_us);
         if (!request) {
             continue;
         }
@@ -112,22 +139,21 @@ void threadpool<T>::run() {
             if (request->m_state == 0) {
                 if (request->read_once()) {
                     request->improv = 1;
-                    ConnectionRAII mysqlcon(&request->mysql, m_connPool);
                     request->process();
                 } else {
-                    request->improv = 1;
                     request->timer_flag = 1;
+                    request->improv = 1;
                 }
             } else {
                 if (request->write()) {
                     request->improv = 1;
                 } else {
-                    request->improv = 1;
                     request->timer_flag = 1;
+                    request->improv = 1;
                 }
             }
         } else {
-            ConnectionRAII mysqlcon(&request->mysql, m_connPool);
+            // 数据库连接由需要它的处理函数按需获取，静态文件请求不再占用连接池
             request->process();
         }
     }
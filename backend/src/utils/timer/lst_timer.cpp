@@ -91,6 +91,7 @@ void SortTimerLst::tick() {
         if (cur < tmp->expire) {
             break;
         }
+        TWS_PROBE1(timer_expire, tmp->user_data->sockfd);
         tmp->cb_func(tmp->user_data);
         m_head = tmp->next;
         if (m_head) {
@@ -192,5 +193,8 @@ void cb_func(ClientData* user_data) {
     epoll_ctl(Utils::u_epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
     assert(user_data);
     close(user_data->sockfd);
+    if (user_data->conn) {
+        user_data->conn->cancel_pending();
+    }
     HttpConn::m_user_count--;
 }
\ No newline at end of file
@@ -25,11 +25,14 @@
 #include "../log/log.h"
 
 class UtilTimer;
+class HttpConn;
 
 struct ClientData {
     sockaddr_in address;
     int sockfd;
     UtilTimer* timer;
+    // 关闭时作废该连接上未完成的异步请求
+    HttpConn* conn;
 };
 
 class UtilTimer {
@@ -0,0 +1,28 @@
+#ifndef MONOTONIC_H
+#define MONOTONIC_H
+
+#include <stdint.h>
+#include <time.h>
+
+// The server's one monotonic clock, in microseconds. Histograms, access
+// records, capture events, lock profiling and queue waits all read it, so
+// timestamps taken in different modules can be subtracted from each other.
+namespace monotonic {
+
+inline int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Same clock at tick resolution (a few ms) but without the vDSO's clock
+// source read; for hot paths that only need coarse ages
+inline int64_t coarse_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+}  // namespace monotonic
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT static tracepoints, provider "tws".
+//
+// Built in when sys/sdt.h is available (TWS_HAVE_SDT, set by CMake). A
+// probe is a single nop until a tracer attaches, e.g.
+//
+//   bpftrace -e 'usdt:./tiny_webserver:tws:response { @[arg1] = hist(arg3); }'
+//
+// Without sys/sdt.h the macros expand to nothing and their arguments are
+// not evaluated.
+//
+// The probe names and arguments below are a stable contract: new probes
+// may be added, existing ones keep their arguments in order. Durations are
+// nanoseconds (currently measured with microsecond resolution), fds and
+// byte counts are the raw values.
+//
+//   accept(fd, ipv4_addr, port)         connection accepted; address in
+//                                       network byte order, port in host order
+//   read(fd, bytes)                     one recv(); 0 on EOF, -1 on error
+//   parse(fd, http_code)                process_read() result (HttpConn::HTTP_CODE)
+//   route(fd, method, route)            request dispatched; HttpConn::METHOD and
+//                                       accesslog::Route
+//   db_acquire(wait_ns)                 MySQL connection taken from the pool;
+//                                       for async queries wait counts from submit
+//   db_release(hold_ns)                 MySQL connection returned to (or closed
+//                                       by) the pool
+//   write(fd, bytes, remaining)         partial writev(), response not done yet
+//   response(fd, status, bytes, total_ns)
+//                                       last byte sent, or the write failed
+//                                       (status 0 if no response was built);
+//                                       total is first byte read -> written
+//   timer_expire(fd)                    idle connection closed by the timer
+#ifdef TWS_HAVE_SDT
+#include <sys/sdt.h>
+
+#define TWS_PROBE1(name, a) DTRACE_PROBE1(tws, name, a)
+#define TWS_PROBE2(name, a, b) DTRACE_PROBE2(tws, name, a, b)
+#define TWS_PROBE3(name, a, b, c) DTRACE_PROBE3(tws, name, a, b, c)
+#define TWS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(tws, name, a, b, c, d)
+#else
+#define TWS_PROBE1(name, a) do {} while (0)
+#define TWS_PROBE2(name, a, b) do {} while (0)
+#define TWS_PROBE3(name, a, b, c) do {} while (0)
+#define TWS_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif
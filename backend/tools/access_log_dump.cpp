@@ -0,0 +1,149 @@
+// Convert a binary access log (see utils/log/access_record.h) to text or CSV.
+//
+//   access_log_dump [--csv] [--local] AccessLog [more files...]
+//
+// Text output is one line per record; --csv prints a header row followed by
+// one row per record with all latencies in microseconds. Times are UTC
+// unless --local is given.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "utils/log/access_record.h"
+
+using namespace accesslog;
+
+namespace {
+
+const char *const STAGE_NAMES[STAGE_COUNT] = {"read", "queue", "process", "write"};
+
+struct Options {
+    bool csv = false;
+    bool local = false;
+};
+
+void format_time(int64_t time_us, bool local, char *out, size_t len) {
+    time_t sec = (time_t)(time_us / 1000000);
+    struct tm tm;
+    if (local) {
+        localtime_r(&sec, &tm);
+    } else {
+        gmtime_r(&sec, &tm);
+    }
+    size_t n = strftime(out, len, "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(out + n, len - n, ".%06d", (int)(time_us % 1000000));
+}
+
+void print_record(const AccessRecord &r, const Options &opt) {
+    char when[48];
+    format_time(r.time_us, opt.local, when, sizeof(when));
+    char ip[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    addr.s_addr = r.client_ip;
+    if (!inet_ntop(AF_INET, &addr, ip, sizeof(ip))) {
+        strcpy(ip, "?");
+    }
+    const char *method = r.method < METHOD_COUNT ? METHOD_NAMES[r.method] : "?";
+    const char *route = r.route < ROUTE_COUNT ? ROUTE_NAMES[r.route] : "?";
+
+    if (opt.csv) {
+        printf("%s,%s,%u,%s,%s,%u,%u,%u", when, ip, r.client_port, method, route,
+               r.status, r.bytes, r.sample);
+        for (int i = 0; i < STAGE_COUNT; ++i) {
+            printf(",%u", r.stage_us[i]);
+        }
+        printf(",%u\n", r.total_us);
+        return;
+    }
+    printf("%s %s:%u %s %s %u %uB", when, ip, r.client_port, method, route, r.status, r.bytes);
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        printf(" %s=%uus", STAGE_NAMES[i], r.stage_us[i]);
+    }
+    printf(" total=%uus", r.total_us);
+    if (r.sample > 1) {
+        printf(" sample=1/%u", r.sample);
+    }
+    printf("\n");
+}
+
+bool dump_file(const char *path, const Options &opt) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+    FileHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: not an access log\n", path);
+        fclose(fp);
+        return false;
+    }
+    // Newer versions may only append fields, so read the common prefix
+    if (header.version > VERSION || header.record_size < sizeof(AccessRecord)) {
+        fprintf(stderr, "%s: unsupported version %u (record size %u)\n", path,
+                header.version, header.record_size);
+        fclose(fp);
+        return false;
+    }
+
+    std::vector<char> buf(header.record_size);
+    size_t count = 0;
+    while (fread(buf.data(), buf.size(), 1, fp) == 1) {
+        AccessRecord record;
+        memcpy(&record, buf.data(), sizeof(record));
+        print_record(record, opt);
+        ++count;
+    }
+    if (ferror(fp)) {
+        fprintf(stderr, "%s: read error after %zu records\n", path, count);
+    }
+    fclose(fp);
+    return true;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--csv] [--local] FILE...\n", prog);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    std::vector<const char *> files;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--csv") == 0) {
+            opt.csv = true;
+        } else if (strcmp(argv[i], "--local") == 0) {
+            opt.local = true;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            usage(argv[0]);
+            return 2;
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.empty()) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (opt.csv) {
+        printf("time,client_ip,client_port,method,route,status,bytes,sample");
+        for (int i = 0; i < STAGE_COUNT; ++i) {
+            printf(",%s_us", STAGE_NAMES[i]);
+        }
+        printf(",total_us\n");
+    }
+    int status = 0;
+    for (const char *file : files) {
+        if (!dump_file(file, opt)) {
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,465 @@
+// Replay a traffic capture (see utils/log/capture_record.h) against a server.
+//
+//   tws_replay [-H host] [-p port] [-s speed] [-w seconds] capture_file
+//
+// Every captured connection gets its own client connection, opened, fed and
+// half-closed in the captured order and with the captured gaps between
+// events, scaled by 1/speed: -s 1 is real time, -s 10 ten times faster and
+// -s 0 as fast as possible. DATA records are sent byte for byte, so a
+// request split across several reads in the capture is split the same way
+// on the wire again (modulo Nagle, which is off).
+//
+// Responses are read and discarded. The report gives the scheduling lag
+// (how late each event went out), the time from a send to the first
+// response byte after it, and connections the server closed while the
+// capture still had data for them. After the last event the tool waits up
+// to -w seconds (default 5) for outstanding responses.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "utils/log/capture_record.h"
+
+namespace {
+
+const size_t READ_CHUNK = 65536;
+const int MAX_EVENTS = 256;
+
+int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct Event {
+    int64_t time_us;
+    uint64_t conn_id;
+    uint8_t type;
+    size_t offset;      // into Capture::data
+    uint32_t length;
+};
+
+struct Capture {
+    std::vector<Event> events;
+    std::vector<char> data;
+};
+
+struct Conn {
+    int fd = -1;
+    std::string out;        // captured bytes not yet accepted by the socket
+    size_t out_pos = 0;
+    bool shut_pending = false;  // client close replayed once `out` is sent
+    bool write_shut = false;
+    bool server_closed = false;
+    int64_t waiting_since = 0;  // send time still waiting for a response byte
+    bool connecting = false;
+    bool want_write = false;
+};
+
+struct Stats {
+    uint64_t opened = 0;
+    uint64_t connect_failed = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    uint64_t dropped_events = 0;   // events for connections the server had closed
+    uint64_t unanswered = 0;
+    std::vector<int64_t> lag_ns;
+    std::vector<int64_t> first_byte_ns;
+};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 9000;
+    double speed = 1.0;
+    double wait = 5.0;
+};
+
+bool load_capture(const char* path, Capture* capture) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+    capture::FileHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, capture::MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        fclose(fp);
+        return false;
+    }
+    if (header.version != capture::VERSION || header.record_size != sizeof(capture::CaptureRecord)) {
+        fprintf(stderr, "%s: unsupported version %u (record size %u)\n", path, header.version,
+                header.record_size);
+        fclose(fp);
+        return false;
+    }
+
+    capture::CaptureRecord r;
+    while (fread(&r, sizeof(r), 1, fp) == 1) {
+        Event e;
+        e.time_us = r.time_us;
+        e.conn_id = r.conn_id;
+        e.type = r.type;
+        e.offset = capture->data.size();
+        e.length = r.type == capture::DATA ? r.length : 0;
+        if (e.length > 0) {
+            capture->data.resize(e.offset + e.length);
+            if (fread(&capture->data[e.offset], 1, e.length, fp) != e.length) {
+                fprintf(stderr, "%s: truncated after %zu records\n", path, capture->events.size());
+                capture->data.resize(e.offset);
+                break;
+            }
+        }
+        capture->events.push_back(e);
+    }
+    fclose(fp);
+
+    // The writer drains per-thread buffers in batches, so the file is only
+    // ordered within each thread
+    std::stable_sort(capture->events.begin(), capture->events.end(),
+                     [](const Event& a, const Event& b) { return a.time_us < b.time_us; });
+    return true;
+}
+
+class Replayer {
+public:
+    Replayer(const Options& options, const Capture& capture)
+        : m_options(options), m_capture(capture), m_epollfd(-1) {}
+
+    ~Replayer() {
+        for (auto& kv : m_conns) {
+            if (kv.second.fd >= 0) {
+                close(kv.second.fd);
+            }
+        }
+        if (m_epollfd >= 0) {
+            close(m_epollfd);
+        }
+    }
+
+    bool init() {
+        memset(&m_addr, 0, sizeof(m_addr));
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_port = htons(m_options.port);
+        if (inet_pton(AF_INET, m_options.host.c_str(), &m_addr.sin_addr) != 1) {
+            fprintf(stderr, "host must be an IPv4 address\n");
+            return false;
+        }
+        m_epollfd = epoll_create1(0);
+        return m_epollfd >= 0;
+    }
+
+    void run() {
+        const std::vector<Event>& events = m_capture.events;
+        int64_t start = now_ns();
+        int64_t t0 = events.empty() ? 0 : events[0].time_us;
+        for (const Event& e : events) {
+            int64_t due = start;
+            if (m_options.speed > 0) {
+                due += (int64_t)((e.time_us - t0) * 1000 / m_options.speed);
+            }
+            int64_t now;
+            while ((now = now_ns()) < due) {
+                poll((int)((due - now + 999999) / 1000000));
+            }
+            poll(0);
+            m_stats.lag_ns.push_back(now - due);
+            apply(e);
+        }
+
+        int64_t deadline = now_ns() + (int64_t)(m_options.wait * 1e9);
+        while (busy() && now_ns() < deadline) {
+            poll(10);
+        }
+        for (auto& kv : m_conns) {
+            if (kv.second.waiting_since) {
+                ++m_stats.unanswered;
+            }
+        }
+        m_elapsed_ns = now_ns() - start;
+    }
+
+    void report() {
+        const std::vector<Event>& events = m_capture.events;
+        double span = events.empty() ? 0 : (events.back().time_us - events.front().time_us) / 1e6;
+        printf("%zu events on %llu connections, captured over %.2f s, replayed in %.2f s\n",
+               events.size(), (unsigned long long)m_stats.opened, span, m_elapsed_ns / 1e9);
+        printf("bytes: sent %llu, received %llu\n", (unsigned long long)m_stats.bytes_sent,
+               (unsigned long long)m_stats.bytes_received);
+        printf("errors: connect %llu, events after server close %llu, unanswered sends %llu\n",
+               (unsigned long long)m_stats.connect_failed, (unsigned long long)m_stats.dropped_events,
+               (unsigned long long)m_stats.unanswered);
+        print_distribution("schedule lag", &m_stats.lag_ns);
+        print_distribution("first response byte", &m_stats.first_byte_ns);
+    }
+
+private:
+    static void print_distribution(const char* name, std::vector<int64_t>* values) {
+        if (values->empty()) {
+            printf("%s (us): no samples\n", name);
+            return;
+        }
+        std::sort(values->begin(), values->end());
+        auto at = [values](double q) { return (*values)[(size_t)(q * (values->size() - 1))] / 1e3; };
+        printf("%s (us): p50 %.1f  p90 %.1f  p99 %.1f  max %.1f  (%zu samples)\n", name, at(0.5),
+               at(0.9), at(0.99), values->back() / 1e3, values->size());
+    }
+
+    bool busy() const {
+        for (const auto& kv : m_conns) {
+            const Conn& c = kv.second;
+            if (c.fd >= 0 && (c.waiting_since || c.out_pos < c.out.size())) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void apply(const Event& e) {
+        if (e.type == capture::OPEN) {
+            open_conn(e.conn_id);
+            return;
+        }
+        auto it = m_conns.find(e.conn_id);
+        if (it == m_conns.end()) {
+            // The capture started while this connection was already open
+            return;
+        }
+        Conn& c = it->second;
+        if (c.fd < 0 || c.server_closed || c.write_shut) {
+            ++m_stats.dropped_events;
+            return;
+        }
+        if (e.type == capture::DATA) {
+            c.out.append(&m_capture.data[e.offset], e.length);
+            if (!c.waiting_since) {
+                c.waiting_since = now_ns();
+            }
+        } else if (e.type == capture::CLOSE) {
+            c.shut_pending = true;
+        }
+        flush(c);
+    }
+
+    void open_conn(uint64_t id) {
+        Conn& c = m_conns[id];
+        if (c.fd >= 0) {
+            close(c.fd);
+        }
+        c = Conn();
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            ++m_stats.connect_failed;
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        // Non-blocking, so a SYN dropped by a full accept queue delays only
+        // this connection; its data waits in `out` until the connect is done
+        if (connect(fd, (struct sockaddr*)&m_addr, sizeof(m_addr)) < 0) {
+            if (errno != EINPROGRESS) {
+                close(fd);
+                ++m_stats.connect_failed;
+                return;
+            }
+            c.connecting = true;
+        }
+        c.fd = fd;
+        c.want_write = c.connecting;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | (c.connecting ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.ptr = &c;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &ev);
+        ++m_stats.opened;
+    }
+
+    // Returns false if the connect failed and the connection was dropped
+    bool finish_connect(Conn& c) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            ++m_stats.connect_failed;
+            --m_stats.opened;
+            c.waiting_since = 0;
+            close_conn(c);
+            return false;
+        }
+        c.connecting = false;
+        return true;
+    }
+
+    void close_conn(Conn& c) {
+        c.server_closed = true;
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        c.fd = -1;
+    }
+
+    void flush(Conn& c) {
+        if (c.connecting) {
+            return;
+        }
+        while (c.out_pos < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    set_write_interest(c, true);
+                    return;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                c.server_closed = true;
+                c.out.clear();
+                c.out_pos = 0;
+                return;
+            }
+            m_stats.bytes_sent += n;
+            c.out_pos += n;
+        }
+        c.out.clear();
+        c.out_pos = 0;
+        set_write_interest(c, false);
+        if (c.shut_pending && !c.write_shut) {
+            // Half close like the captured client; the server sees recv() == 0
+            shutdown(c.fd, SHUT_WR);
+            c.write_shut = true;
+        }
+    }
+
+    void set_write_interest(Conn& c, bool on) {
+        if (c.want_write == on) {
+            return;
+        }
+        c.want_write = on;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | (on ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.ptr = &c;
+        epoll_ctl(m_epollfd, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+
+    void poll(int timeout_ms) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(m_epollfd, events, MAX_EVENTS, timeout_ms);
+        for (int i = 0; i < n; ++i) {
+            Conn& c = *static_cast<Conn*>(events[i].data.ptr);
+            if (c.fd < 0) {
+                continue;
+            }
+            if (c.connecting && !finish_connect(c)) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush(c);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                drain(c);
+            }
+        }
+    }
+
+    void drain(Conn& c) {
+        char buf[READ_CHUNK];
+        for (;;) {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                if (c.waiting_since) {
+                    m_stats.first_byte_ns.push_back(now_ns() - c.waiting_since);
+                    c.waiting_since = 0;
+                }
+                m_stats.bytes_received += n;
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            // EOF or reset: the server closed the connection
+            if (c.waiting_since) {
+                ++m_stats.unanswered;
+                c.waiting_since = 0;
+            }
+            close_conn(c);
+            return;
+        }
+    }
+
+    const Options& m_options;
+    const Capture& m_capture;
+    struct sockaddr_in m_addr;
+    int m_epollfd;
+    // Node-based, so Conn pointers in epoll data stay valid on insert
+    std::unordered_map<uint64_t, Conn> m_conns;
+    Stats m_stats;
+    int64_t m_elapsed_ns = 0;
+};
+
+void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-H host] [-p port] [-s speed] [-w seconds] capture_file\n", prog);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:s:w:")) != -1) {
+        switch (opt) {
+            case 'H':
+                options.host = optarg;
+                break;
+            case 'p':
+                options.port = atoi(optarg);
+                break;
+            case 's':
+                options.speed = atof(optarg);
+                break;
+            case 'w':
+                options.wait = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1 || options.speed < 0 || options.wait < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    Capture capture;
+    if (!load_capture(argv[optind], &capture)) {
+        return 1;
+    }
+    Replayer replayer(options, capture);
+    if (!replayer.init()) {
+        return 1;
+    }
+    printf("replaying %s against %s:%d, ", argv[optind], options.host.c_str(), options.port);
+    if (options.speed > 0) {
+        printf("%gx speed\n", options.speed);
+    } else {
+        printf("full speed\n");
+    }
+    replayer.run();
+    replayer.report();
+    return 0;
+}